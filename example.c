@@ -0,0 +1,57 @@
+/**
+ * redis-c by Andrew Brampton 2010
+ * A small example of using the redis-c library
+ */
+#include "redis-c.h"
+
+#include <stdio.h>
+
+int main(int argc, char *argv[]) {
+
+	struct RedisHandle *handle = redis_alloc();
+	if (!handle) {
+		printf("Failed to create redis handle\n");
+		return -1;
+	}
+
+	const struct Object args[] = {
+		REDIS_STR("SET"),
+		REDIS_STR("key"),
+		REDIS_STR("value"),
+	};
+
+	if ( redis_connect(handle, "localhost", 6379) ) {
+		printf("redis_connect: %s\n", redis_error(handle));
+		return 0;
+	}
+
+	printf("Connected\n");
+
+	if ( redis_send_bulk(handle, 3, args) ) {
+		printf("redis_sendBulk: %s\n", redis_error(handle));
+		return 0;
+	}
+
+	printf("Sent bulk\n");
+
+	int ret;
+	int i;
+	for (i = 0; i < 10; i++) {
+		ret = redis_read(handle);
+		printf("%d\n", ret);
+
+		if (ret == -1) {
+			printf("redis_read: %s\n", redis_error(handle));
+		} else if (ret > 0) {
+			struct Reply *r = redis_reply_pop(handle);
+			redis_reply_print(r);
+		}
+
+	}
+
+	//redis_sendMultiBulk(handle, 3, args);
+
+	redis_free(handle);
+
+	return 0;
+}
@@ -0,0 +1,614 @@
+/**
+ * redis-c-bench
+ * A load generator in the spirit of redis-benchmark, but driven through redis-c,
+ * so changes to the library can be measured end to end.
+ */
+#include "redis-c.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define KEY_LENGTH 32 /** Room for the prefix and the key number */
+
+struct BenchConfig {
+	const char *host;
+	unsigned short port;
+	const char *socket;      /** Connect to this Unix domain socket instead, if set */
+	unsigned int clients;    /** Number of threads, each with its own handle */
+	unsigned long requests;  /** Total requests per test */
+	size_t valueSize;        /** Size of SET values */
+	unsigned long keyspace;  /** Keys are picked at random from key:0 to key:keyspace-1 */
+	unsigned int pipeline;   /** Commands sent per round trip */
+	unsigned int mgetKeys;   /** Keys per MGET */
+	size_t cacheBytes;       /** Give each handle a near cache this big, and GET through redis_get */
+	unsigned int cacheTtl;   /** How long cached values are used for, in ms */
+	unsigned int batch;      /** Coalesce up to this many GETs or SETs into each MGET or MSET, 0 not to */
+	size_t into;             /** GET values into buffers of this size with redis_send_get_into, 0 not to */
+	unsigned int connections; /** Share this many connections, each driven by a RedisThread, 0 not to */
+	int uring;               /** Send and receive through io_uring, where the kernel supports it */
+	const char *tests;       /** Comma separated list of tests to run */
+};
+
+struct BenchTest {
+	const char *name;
+	unsigned int argc;       /** Number of arguments each command has */
+};
+
+struct BenchThread {
+	const struct BenchConfig *config;
+	const struct BenchTest *test;
+
+	unsigned long requests;  /** How many requests this thread makes */
+	uint64_t *latency;       /** Latency of each request, in ns */
+	unsigned long errors;    /** Error replies, or failed requests */
+	unsigned int seed;       /** For picking keys */
+	struct RedisStats stats; /** The handle's counters once it finished */
+	struct RedisThread *io;  /** The shared connection to submit to, if any */
+
+	pthread_t thread;
+};
+
+static const struct BenchTest tests[] = {
+	{ "set",  3 },
+	{ "get",  2 },
+	{ "incr", 2 },
+	{ "mget", 0 },  /* 1 + mgetKeys */
+	{ NULL,   0 },
+};
+
+static char *value;          /** The value SET stores */
+
+static uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_uint64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Fills in argv with one command for the test. keys must have room for mgetKeys keys.
+ */
+static void build_command(struct BenchThread *t, struct Object *argv, char (*keys)[KEY_LENGTH]) {
+	const struct BenchConfig *c = t->config;
+	unsigned int i, nkeys = 1;
+	const char *prefix = "key";
+
+	memset(argv, 0, sizeof(struct Object) * (1 + c->mgetKeys + 1));
+
+	if (strcmp(t->test->name, "mget") == 0)
+		nkeys = c->mgetKeys;
+
+	/* The values SET stores aren't numbers, so INCR needs keys of its own */
+	if (strcmp(t->test->name, "incr") == 0)
+		prefix = "counter";
+
+	for (i = 0; i < nkeys; i++) {
+		int len = snprintf(keys[i], KEY_LENGTH, "%s:%012lu", prefix, (unsigned long)rand_r(&t->seed) % c->keyspace);
+		argv[1 + i].ptr  = keys[i];
+		argv[1 + i].len  = len;
+		argv[1 + i].type = REDIS_TYPE_RAW;
+	}
+
+	argv[0].type = REDIS_TYPE_STR;
+	argv[0].ptr  = (char *)t->test->name;
+	argv[0].len  = strlen(t->test->name);
+
+	if (strcmp(t->test->name, "set") == 0) {
+		argv[2].ptr  = value;
+		argv[2].len  = c->valueSize;
+		argv[2].type = REDIS_TYPE_RAW;
+	}
+}
+
+/**
+ * Counts the batched requests which failed.
+ */
+static void batch_done(struct RedisHandle *h, int ret, const struct Object *value, void *arg) {
+	struct BenchThread *t = arg;
+
+	(void)h;
+	(void)value;
+
+	if (ret < 0)
+		t->errors++;
+}
+
+/**
+ * Pops and frees all waiting replies, counting any errors.
+ */
+static void drain_replies(struct BenchThread *t, struct RedisHandle *h) {
+	struct Reply *replies[64];
+	unsigned int n, i;
+
+	while ( (n = redis_reply_pop_many(h, replies, 64)) > 0 ) {
+		for (i = 0; i < n; i++) {
+			const struct Reply *r = replies[i];
+			if (r->argc == 1 && r->argv[0].type != REDIS_TYPE_INT && r->argv[0].len > 0 && r->argv[0].ptr[0] == '-')
+				t->errors++;
+		}
+		redis_reply_free_many(replies, n);
+	}
+}
+
+/**
+ * Submits each round trip's requests to the shared connection, then waits for them all.
+ */
+static void bench_submit(struct BenchThread *t, unsigned int argc, struct Object *argv, char (*keys)[KEY_LENGTH]) {
+	const struct BenchConfig *c = t->config;
+	struct RedisFuture *futures = malloc(sizeof(struct RedisFuture) * c->pipeline);
+	unsigned long done = 0, i;
+
+	if (futures == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < c->pipeline; i++) {
+		if (redis_future_init(&futures[i]) == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+
+	while (done < t->requests) {
+		unsigned long batch = c->pipeline;
+		uint64_t start, latency;
+
+		if (batch > t->requests - done)
+			batch = t->requests - done;
+
+		start = now();
+
+		for (i = 0; i < batch; i++) {
+			build_command(t, argv, keys);
+			if (redis_thread_submit(t->io, &futures[i], argc, argv)) {
+				fprintf(stderr, "redis_thread_submit: failed\n");
+				exit(1);
+			}
+		}
+
+		for (i = 0; i < batch; i++) {
+			const struct Reply *r;
+
+			if (redis_future_wait(&futures[i], -1) != REDIS_FUTURE_DONE) {
+				t->errors++;
+				continue;
+			}
+
+			r = futures[i].reply;
+			if (r->argc == 1 && r->argv[0].type != REDIS_TYPE_INT && r->argv[0].len > 0 && r->argv[0].ptr[0] == '-')
+				t->errors++;
+
+			redis_reply_free(futures[i].reply);
+			futures[i].reply = NULL;
+		}
+
+		latency = now() - start;
+		for (i = 0; i < batch; i++)
+			t->latency[done++] = latency;
+	}
+
+	for (i = 0; i < c->pipeline; i++)
+		redis_future_cleanup(&futures[i]);
+	free(futures);
+}
+
+static void * bench_thread(void *arg) {
+	struct BenchThread *t = arg;
+	const struct BenchConfig *c = t->config;
+	unsigned int argc = t->test->argc ? t->test->argc : 1 + c->mgetKeys;
+	struct RedisHandle *h;
+	struct Object *argv;
+	char (*keys)[KEY_LENGTH];
+	unsigned long done = 0;
+
+	argv = malloc(sizeof(struct Object) * (1 + c->mgetKeys + 1));
+	keys = malloc(KEY_LENGTH * c->mgetKeys);
+	if (t->io != NULL && argv != NULL && keys != NULL) {
+		bench_submit(t, argc, argv, keys);
+		free(keys);
+		free(argv);
+		return NULL;
+	}
+
+	h    = redis_alloc();
+	if (argv == NULL || keys == NULL || h == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	if (c->socket != NULL ? redis_connect_unix(h, c->socket) : redis_connect(h, c->host, c->port)) {
+		fprintf(stderr, "redis_connect: %s\n", redis_error(h));
+		exit(1);
+	}
+
+	/* Without io_uring the handle carries on with send() and recv() */
+	if (c->uring && redis_use_uring(h, 0) && t->seed == 1)
+		fprintf(stderr, "redis_use_uring: %s, using the socket instead\n", redis_error(h));
+
+	if (c->cacheBytes && redis_use_cache(h, c->cacheBytes, c->cacheTtl)) {
+		fprintf(stderr, "redis_use_cache: %s\n", redis_error(h));
+		exit(1);
+	}
+
+	/* Cached GETs are answered one at a time, so can't be pipelined */
+	while (c->cacheBytes && strcmp(t->test->name, "get") == 0 && done < t->requests) {
+		struct Object value;
+		uint64_t start = now();
+		int ret;
+
+		build_command(t, argv, keys);
+		ret = redis_get(h, argv[1].ptr, argv[1].len, &value);
+		if (ret < 0)
+			t->errors++;
+		else if (ret > 0)
+			redis_object_cleanup(&value);
+
+		t->latency[done++] = now() - start;
+	}
+
+	if (c->batch && redis_use_batching(h, c->batch, 0)) {
+		fprintf(stderr, "redis_use_batching: %s\n", redis_error(h));
+		exit(1);
+	}
+
+	/* Each round trip's requests are coalesced into as few MGETs or MSETs as the batch size allows */
+	while (c->batch && (strcmp(t->test->name, "get") == 0 || strcmp(t->test->name, "set") == 0) && done < t->requests) {
+		unsigned long batch = c->pipeline;
+		unsigned long i;
+		uint64_t start, latency;
+		int ret = 0;
+
+		if (batch > t->requests - done)
+			batch = t->requests - done;
+
+		start = now();
+
+		for (i = 0; i < batch && ret == 0; i++) {
+			build_command(t, argv, keys);
+			if (argc == 3)
+				ret = redis_batch_set(h, argv[1].ptr, argv[1].len, argv[2].ptr, argv[2].len, batch_done, t);
+			else
+				ret = redis_batch_get(h, argv[1].ptr, argv[1].len, batch_done, t);
+		}
+
+		if (ret == 0)
+			ret = redis_batch_wait(h);
+
+		if (ret < 0) {
+			fprintf(stderr, "redis_batch: %s\n", redis_error(h));
+			exit(1);
+		}
+
+		latency = now() - start;
+		for (i = 0; i < batch; i++)
+			t->latency[done++] = latency;
+	}
+
+	/* Each GET in the pipeline has a buffer of its own to be received into */
+	if (c->into && strcmp(t->test->name, "get") == 0) {
+		struct RedisInto *into = malloc(sizeof(struct RedisInto) * c->pipeline);
+		char *buffers = malloc(c->into * c->pipeline);
+		unsigned long i;
+
+		if (into == NULL || buffers == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+
+		for (i = 0; i < c->pipeline; i++) {
+			into[i].dst = buffers + i * c->into;
+			into[i].cap = c->into;
+		}
+
+		while (done < t->requests) {
+			unsigned long batch = c->pipeline;
+			uint64_t start, latency;
+			int ret = 0;
+
+			if (batch > t->requests - done)
+				batch = t->requests - done;
+
+			start = now();
+
+			redis_pipeline_begin(h);
+			for (i = 0; i < batch && ret == 0; i++) {
+				build_command(t, argv, keys);
+				ret = redis_send_get_into(h, argv[1].ptr, argv[1].len, &into[i]);
+			}
+
+			if (ret == 0)
+				ret = redis_pipeline_flush(h);
+
+			if (ret < 0) {
+				fprintf(stderr, "redis_send_get_into: %s\n", redis_error(h));
+				exit(1);
+			}
+
+			latency = now() - start;
+			for (i = 0; i < batch; i++) {
+				if (into[i].status == REDIS_INTO_ERROR)
+					t->errors++;
+				t->latency[done++] = latency;
+			}
+
+			drain_replies(t, h);
+		}
+
+		free(buffers);
+		free(into);
+	}
+
+	while (done < t->requests) {
+		unsigned long batch = c->pipeline;
+		unsigned long i;
+		uint64_t start, latency;
+		int ret;
+
+		if (batch > t->requests - done)
+			batch = t->requests - done;
+
+		start = now();
+
+		if (batch > 1)
+			redis_pipeline_begin(h);
+
+		for (i = 0; i < batch; i++) {
+			build_command(t, argv, keys);
+			if (redis_send_multibulk(h, argc, argv) < 0) {
+				fprintf(stderr, "redis_send_multibulk: %s\n", redis_error(h));
+				exit(1);
+			}
+		}
+
+		if (batch > 1) {
+			ret = redis_pipeline_flush(h);
+		} else {
+			do {
+				ret = redis_read(h);
+			} while (ret == 0);
+		}
+
+		if (ret < 0) {
+			fprintf(stderr, "redis_read: %s\n", redis_error(h));
+			exit(1);
+		}
+
+		/* Every command in the batch waited for the whole batch */
+		latency = now() - start;
+		for (i = 0; i < batch; i++)
+			t->latency[done++] = latency;
+
+		drain_replies(t, h);
+	}
+
+	redis_stats(h, &t->stats);
+	redis_free(h);
+	free(keys);
+	free(argv);
+
+	return NULL;
+}
+
+static void run_test(const struct BenchConfig *c, const struct BenchTest *test) {
+	struct BenchThread *threads;
+	struct RedisThread **io = NULL;
+	uint64_t *latency;
+	uint64_t start, elapsed;
+	unsigned long errors = 0;
+	unsigned long offset = 0;
+	uint64_t sendCalls = 0, recvCalls = 0;
+	uint64_t cacheHits = 0, cacheMisses = 0;
+	uint64_t commands = 0;
+	uint64_t uringEnters = 0;
+	unsigned int i;
+
+	threads = calloc(c->clients, sizeof(struct BenchThread));
+	latency = malloc(sizeof(uint64_t) * c->requests);
+	if (threads == NULL || latency == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	if (c->connections) {
+		io = calloc(c->connections, sizeof(struct RedisThread *));
+		if (io == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+
+		for (i = 0; i < c->connections; i++) {
+			io[i] = redis_thread_alloc(c->host, c->port, 4096);
+			if (io[i] == NULL) {
+				fprintf(stderr, "redis_thread_alloc: failed to connect\n");
+				exit(1);
+			}
+		}
+	}
+
+	start = now();
+
+	for (i = 0; i < c->clients; i++) {
+		struct BenchThread *t = &threads[i];
+
+		t->config   = c;
+		t->test     = test;
+		t->requests = c->requests / c->clients + (i < c->requests % c->clients);
+		t->latency  = latency + offset;
+		t->seed     = i + 1;
+		t->io       = io != NULL ? io[i % c->connections] : NULL;
+		offset += t->requests;
+
+		pthread_create(&t->thread, NULL, bench_thread, t);
+	}
+
+	for (i = 0; i < c->clients; i++) {
+		pthread_join(threads[i].thread, NULL);
+		errors    += threads[i].errors;
+		sendCalls += threads[i].stats.sendCalls;
+		recvCalls += threads[i].stats.recvCalls;
+		cacheHits   += threads[i].stats.cacheHits;
+		cacheMisses += threads[i].stats.cacheMisses;
+		commands    += threads[i].stats.commands;
+		uringEnters += threads[i].stats.uringEnters;
+	}
+
+	elapsed = now() - start;
+
+	/* The clients shared the connections, so count those instead */
+	for (i = 0; i < c->connections; i++) {
+		struct RedisStats stats;
+
+		redis_thread_stats(io[i], &stats);
+		sendCalls += stats.sendCalls;
+		recvCalls += stats.recvCalls;
+		redis_thread_free(io[i]);
+	}
+	free(io);
+
+	qsort(latency, c->requests, sizeof(uint64_t), cmp_uint64);
+
+	printf("====== %s ======\n", test->name);
+	printf("  %lu requests completed in %.2f seconds\n", c->requests, elapsed / 1e9);
+	printf("  %u parallel clients over %s, %lu byte values, pipeline %u\n", c->clients,
+		c->socket != NULL ? "unix" : "tcp", (unsigned long)c->valueSize, c->pipeline);
+	if (c->connections)
+		printf("  sharing %u connections, each with an I/O thread\n", c->connections);
+	if (errors)
+		printf("  %lu error replies\n", errors);
+	printf("  %.2f requests per second\n", c->requests / (elapsed / 1e9));
+	printf("  %.2f send and %.2f recv calls per request\n", (double)sendCalls / c->requests, (double)recvCalls / c->requests);
+	if (uringEnters)
+		printf("  %.2f io_uring_enter calls per request\n", (double)uringEnters / c->requests);
+	if (c->batch)
+		printf("  %.3f commands sent per request\n", (double)commands / c->requests);
+	if (cacheHits + cacheMisses)
+		printf("  %.1f%% of lookups answered by the near cache\n", 100.0 * cacheHits / (cacheHits + cacheMisses));
+	printf("  latency (usec): p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n\n",
+		latency[(size_t)(c->requests * 0.50)]  / 1e3,
+		latency[(size_t)(c->requests * 0.99)]  / 1e3,
+		latency[(size_t)(c->requests * 0.999)] / 1e3,
+		latency[c->requests - 1] / 1e3);
+
+	free(latency);
+	free(threads);
+}
+
+/**
+ * @return 1 if name is one of the entries in the comma separated list
+ */
+static int in_list(const char *list, const char *name) {
+	size_t len = strlen(name);
+
+	while (*list) {
+		size_t entry = strcspn(list, ",");
+		if (entry == len && strncmp(list, name, len) == 0)
+			return 1;
+
+		list += entry;
+		if (*list == ',')
+			list++;
+	}
+
+	return 0;
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr,
+		"Usage: %s [-h host] [-p port] [-s socket] [-c clients] [-n requests]\n"
+		"          [-d size] [-r keyspace] [-P pipeline] [-k mget keys] [-t tests]\n"
+		"          [-C cache bytes] [-T cache ttl] [-b batch] [-i into size] [-S connections]\n"
+		"          [-U]\n"
+		"\n"
+		" -h <host>      Server hostname (default localhost)\n"
+		" -p <port>      Server port (default 6379)\n"
+		" -s <socket>    Server Unix domain socket (overrides host and port)\n"
+		" -c <clients>   Number of threads, each with its own connection (default 50)\n"
+		" -n <requests>  Total number of requests per test (default 100000)\n"
+		" -d <size>      Size of SET values in bytes (default 3)\n"
+		" -r <keyspace>  Use random keys from key:0 to key:keyspace-1 (default 100000)\n"
+		" -P <pipeline>  Pipeline this many requests per round trip (default 1)\n"
+		" -k <keys>      Number of keys per MGET (default 10)\n"
+		" -t <tests>     Comma separated list of tests: set,get,incr,mget (default all)\n"
+		" -C <bytes>     Give each client a near cache this big, and GET through it\n"
+		" -T <msec>      How long the near cache uses values for (default 1000)\n"
+		" -b <requests>  Coalesce up to this many GETs or SETs into each MGET or MSET\n"
+		" -i <bytes>     GET values straight into buffers this big, with redis_send_get_into\n"
+		" -S <conns>     Share this many connections between the clients, each driven by an I/O thread\n"
+		" -U             Send and receive through io_uring instead of send() and recv()\n",
+		argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	struct BenchConfig c;
+	const struct BenchTest *test;
+	int opt;
+
+	c.host      = "localhost";
+	c.port      = 6379;
+	c.socket    = NULL;
+	c.clients   = 50;
+	c.requests  = 100000;
+	c.valueSize = 3;
+	c.keyspace  = 100000;
+	c.pipeline  = 1;
+	c.mgetKeys  = 10;
+	c.cacheBytes = 0;
+	c.cacheTtl   = 1000;
+	c.batch      = 0;
+	c.into       = 0;
+	c.connections = 0;
+	c.uring       = 0;
+	c.tests     = "set,get,incr,mget";
+
+	while ( (opt = getopt(argc, argv, "h:p:s:c:n:d:r:P:k:t:C:T:b:i:S:U")) != -1 ) {
+		switch (opt) {
+			case 'h': c.host      = optarg; break;
+			case 'p': c.port      = atoi(optarg); break;
+			case 's': c.socket    = optarg; break;
+			case 'c': c.clients   = atoi(optarg); break;
+			case 'n': c.requests  = strtoul(optarg, NULL, 10); break;
+			case 'd': c.valueSize = strtoul(optarg, NULL, 10); break;
+			case 'r': c.keyspace  = strtoul(optarg, NULL, 10); break;
+			case 'P': c.pipeline  = atoi(optarg); break;
+			case 'k': c.mgetKeys  = atoi(optarg); break;
+			case 't': c.tests     = optarg; break;
+			case 'C': c.cacheBytes = strtoul(optarg, NULL, 10); break;
+			case 'T': c.cacheTtl   = strtoul(optarg, NULL, 10); break;
+			case 'b': c.batch      = atoi(optarg); break;
+			case 'i': c.into       = strtoul(optarg, NULL, 10); break;
+			case 'S': c.connections = atoi(optarg); break;
+			case 'U': c.uring       = 1; break;
+			default:  usage(argv[0]);
+		}
+	}
+
+	if (c.clients == 0 || c.requests < c.clients || c.keyspace == 0 || c.pipeline == 0 || c.mgetKeys == 0)
+		usage(argv[0]);
+
+	value = malloc(c.valueSize + 1);
+	if (value == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	memset(value, 'x', c.valueSize);
+
+	for (test = tests; test->name != NULL; test++) {
+		if (in_list(c.tests, test->name))
+			run_test(&c, test);
+	}
+
+	free(value);
+
+	return 0;
+}
@@ -0,0 +1,595 @@
+/**
+ * redis-c micro-benchmarks
+ * Times the library's hot paths on canned data, without needing a Redis server.
+ * Recorded reply streams are parsed through a socketpair, and commands are encoded
+ * into a send buffer which is thrown away, so neither needs a server either.
+ */
+#include "redis-c.h"
+#include "redis_private.h"
+
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define TICK_UNIT "cycle"
+#else
+# define TICK_UNIT "ns"
+#endif
+
+#define STREAM_LENGTH (1024 * 1024) /** How many bytes of replies each benchmark parses per round */
+#define ROUNDS        64            /** How many times each benchmark parses the stream */
+
+/**
+ * Returns a timestamp, in cycles where the CPU has a cycle counter, otherwise in ns.
+ */
+static unsigned long long ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/**
+ * The byte at a time scanner redis_readLine used before it was vectorised,
+ * kept here so the two can be compared.
+ */
+static char * readline_bytewise(struct RedisHandle * h) {
+
+	char * ptr    = buffer_start(&h->buf);
+	char * ptrEnd = buffer_end  (&h->buf);
+
+	ptr += h->linePos + 1;
+	while ( ptr < ptrEnd ) {
+		if (*(ptr - 1) == '\r' && *ptr == '\n') {
+			h->linePos = 0;
+			return ptr;
+		}
+
+		if (*ptr != '\r')
+			ptr+=2;
+		else
+			ptr++;
+	}
+
+	h->linePos = ptr - 1 - buffer_start(&h->buf);
+
+	return NULL;
+}
+
+typedef char * (*readline_func)(struct RedisHandle * h);
+
+/**
+ * Splits the stream held in the handle's buffer into lines ROUNDS times.
+ * @return The number of bytes scanned per tick.
+ */
+static double bench_readline(struct RedisHandle * h, readline_func readline, size_t len, size_t lines) {
+	unsigned long long start, end;
+	size_t found = 0;
+	char *lineEnd;
+	int round;
+
+	start = ticks();
+	for (round = 0; round < ROUNDS; round++) {
+		/* The stream is still in the buffer's memory, just mark it as data again */
+		buffer_push(&h->buf, len);
+
+		while ( (lineEnd = readline(h)) != NULL ) {
+			buffer_unshift(&h->buf, lineEnd - buffer_start(&h->buf) + 1);
+			found++;
+		}
+	}
+	end = ticks();
+
+	if (found != lines * ROUNDS) {
+		fprintf(stderr, "Found %lu lines, expected %lu\n", (unsigned long)found, (unsigned long)(lines * ROUNDS));
+		exit(1);
+	}
+
+	return (double)len * ROUNDS / (end - start);
+}
+
+/**
+ * Compares the old and new line scanners on a stream of a single repeated reply.
+ */
+static void run_readline(const char *name, const char *reply) {
+	struct RedisHandle *h;
+	size_t replyLen = strlen(reply);
+	size_t lines = STREAM_LENGTH / replyLen;
+	size_t i;
+	double before, after;
+
+	h = redis_alloc();
+	if (h == NULL) {
+		fprintf(stderr, "Failed to create redis handle\n");
+		exit(1);
+	}
+
+	for (i = 0; i < lines; i++) {
+		if (buffer_append(&h->buf, reply, replyLen) == NULL) {
+			fprintf(stderr, "Failed to build stream\n");
+			exit(1);
+		}
+	}
+	buffer_pop(&h->buf, buffer_len(&h->buf));
+
+	before = bench_readline(h, readline_bytewise, lines * replyLen, lines);
+	after  = bench_readline(h, redis_readLine,    lines * replyLen, lines);
+
+	printf("readline %-8s bytewise %6.3f bytes/%s   redis_readLine %6.3f bytes/%s   (x%.2f)\n",
+		name, before, TICK_UNIT, after, TICK_UNIT, after / before);
+
+	redis_free(h);
+}
+
+#define ALLOC_BATCH   1000   /** How many replies are held at once by the batched allocation benchmark */
+#define ALLOC_REPLIES 200000 /** How many replies each allocation benchmark creates */
+
+/**
+ * Creates and frees ALLOC_REPLIES single argument replies, batch at a time, each
+ * with a payload of payloadLen bytes.
+ * @return The ticks taken per reply.
+ */
+static double bench_alloc(const struct RedisAllocator *a, int batch, size_t payloadLen) {
+	static struct Reply *replies[ALLOC_BATCH];
+	unsigned long long start, end;
+	int i, j;
+
+	start = ticks();
+	for (i = 0; i < ALLOC_REPLIES; i += batch) {
+		for (j = 0; j < batch; j++) {
+			replies[j] = redis_reply_alloc_with(a, 1);
+			if (replies[j] == NULL || redis_object_init_with(a, &replies[j]->argv[0], payloadLen) == NULL) {
+				fprintf(stderr, "Failed to allocate reply\n");
+				exit(1);
+			}
+		}
+		for (j = 0; j < batch; j++)
+			redis_reply_free(replies[j]);
+	}
+	end = ticks();
+
+	return (double)(end - start) / ALLOC_REPLIES;
+}
+
+/**
+ * Compares malloc with the handle's arena for allocating replies.
+ */
+static void run_alloc(const char *name, int batch, size_t payloadLen) {
+	struct RedisHandle *h = redis_alloc();
+	double before, after;
+
+	if (h == NULL || redis_use_arena(h)) {
+		fprintf(stderr, "Failed to create arena\n");
+		exit(1);
+	}
+
+	before = bench_alloc(NULL,         batch, payloadLen);
+	after  = bench_alloc(h->allocator, batch, payloadLen);
+
+	printf("alloc    %-14s malloc %7.1f %ss/reply   arena %7.1f %ss/reply   (x%.2f)\n",
+		name, before, TICK_UNIT, after, TICK_UNIT, before / after);
+
+	redis_free(h);
+}
+
+/**
+ * Returns a timestamp in ns.
+ */
+static unsigned long long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Hands out memory from malloc, counting how many allocations are made.
+ */
+static void * counting_alloc(void *ctx, size_t size) {
+	(*(unsigned long *)ctx)++;
+	return malloc(size);
+}
+
+static void counting_release(void *ctx, void *ptr, size_t size) {
+	(void)ctx;
+	(void)size;
+	free(ptr);
+}
+
+#define CORPUS_LENGTH (4 * 1024 * 1024) /** Corpora are repeated until they are at least this long */
+#define PARSE_ROUNDS  8                 /** How many times each corpus is parsed */
+
+/**
+ * A recorded stream of replies.
+ */
+struct Corpus {
+	char *data;
+	size_t len;
+	unsigned long replies;    /** How many replies are in data */
+};
+
+/**
+ * Appends str count times to the corpus, as replies replies.
+ */
+static void corpus_add(struct Corpus *c, const char *str, size_t len, unsigned long replies) {
+	c->data = realloc(c->data, c->len + len);
+	if (c->data == NULL) {
+		fprintf(stderr, "Failed to build corpus\n");
+		exit(1);
+	}
+
+	memcpy(c->data + c->len, str, len);
+	c->len     += len;
+	c->replies += replies;
+}
+
+static void corpus_str(struct Corpus *c, const char *str, unsigned long replies) {
+	corpus_add(c, str, strlen(str), replies);
+}
+
+/**
+ * Repeats the corpus until it is at least CORPUS_LENGTH long.
+ */
+static void corpus_fill(struct Corpus *c) {
+	size_t len = c->len;
+	unsigned long replies = c->replies;
+
+	while (c->len < CORPUS_LENGTH) {
+		char *data = malloc(len);
+		memcpy(data, c->data, len);
+		corpus_add(c, data, len, replies);
+		free(data);
+	}
+}
+
+static void corpus_status(struct Corpus *c) {
+	corpus_str(c, "+OK\r\n", 1);
+}
+
+static void corpus_bulk(struct Corpus *c) {
+	char header[32];
+	char value[1024];
+
+	memset(value, 'x', sizeof(value));
+	corpus_add(c, header, snprintf(header, sizeof(header), "$%lu\r\n", (unsigned long)sizeof(value)), 0);
+	corpus_add(c, value, sizeof(value), 0);
+	corpus_str(c, "\r\n", 1);
+}
+
+static void corpus_array(struct Corpus *c) {
+	char element[32];
+	int i;
+
+	corpus_str(c, "*10000\r\n", 1);
+	for (i = 0; i < 10000; i++)
+		corpus_add(c, element, snprintf(element, sizeof(element), "$12\r\nelement:%04d\r\n", i), 0);
+}
+
+static void corpus_mixed(struct Corpus *c) {
+	corpus_str(c, "+OK\r\n", 1);
+	corpus_str(c, ":1000\r\n", 1);
+	corpus_str(c, "$5\r\nvalue\r\n", 1);
+	corpus_str(c, "$-1\r\n", 1);
+	corpus_str(c, "*3\r\n$1\r\na\r\n$-1\r\n:2\r\n", 1);
+	corpus_str(c, "-ERR unknown command\r\n", 1);
+}
+
+/**
+ * Pops and frees every waiting reply.
+ * @return How many there were.
+ */
+static unsigned long drain_replies(struct RedisHandle *h) {
+	unsigned long count = 0;
+	struct Reply *r;
+
+	while ( (r = redis_reply_pop(h)) != NULL ) {
+		redis_reply_free(r);
+		count++;
+	}
+
+	return count;
+}
+
+/**
+ * Reads and frees whatever replies the handle can parse without blocking.
+ * @return How many replies were read.
+ */
+static unsigned long read_available(struct RedisHandle *h) {
+	unsigned long count = 0;
+	int ret;
+
+	do {
+		ret = redis_read(h);
+		if (ret < 0) {
+			fprintf(stderr, "redis_read: %s\n", redis_error(h));
+			exit(1);
+		}
+		count += drain_replies(h);
+	} while (ret > 0);
+
+	return count;
+}
+
+/**
+ * Feeds the corpus PARSE_ROUNDS times through a socketpair into a non-blocking
+ * handle, so the parser runs exactly as it would on a real connection.
+ */
+static void run_parse(const char *name, void (*build)(struct Corpus *)) {
+	struct Corpus c = { NULL, 0, 0 };
+	struct RedisAllocator allocator = { counting_alloc, counting_release, NULL };
+	unsigned long allocs = 0;
+	unsigned long replies = 0;
+	unsigned long long start, elapsed;
+	struct RedisHandle *h;
+	int size = 1024 * 1024;
+	int fds[2];
+	int round;
+
+	build(&c);
+	corpus_fill(&c);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+		perror("socketpair");
+		exit(1);
+	}
+	setsockopt(fds[0], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+	allocator.ctx = &allocs;
+
+	h = redis_alloc();
+	if (h == NULL || redis_use_socket(h, fds[0]) || redis_set_nonblocking(h, 1)) {
+		fprintf(stderr, "Failed to create redis handle\n");
+		exit(1);
+	}
+	redis_set_allocator(h, &allocator);
+
+	start = now_ns();
+	for (round = 0; round < PARSE_ROUNDS; round++) {
+		size_t sent = 0;
+
+		while (sent < c.len) {
+			ssize_t len = send(fds[1], c.data + sent, c.len - sent, 0);
+			if (len < 0 && errno != EAGAIN && errno != EINTR) {
+				perror("send");
+				exit(1);
+			}
+			if (len > 0)
+				sent += len;
+
+			replies += read_available(h);
+		}
+	}
+
+	/* Everything has been sent, so collect the stragglers */
+	while (replies < c.replies * PARSE_ROUNDS)
+		replies += read_available(h);
+	elapsed = now_ns() - start;
+
+	printf("parse    %-18s %8.1f ns/reply %8.1f MB/s %6.2f allocs/reply\n",
+		name, (double)elapsed / replies, (double)c.len * PARSE_ROUNDS * 1000 / elapsed, (double)allocs / replies);
+
+	redis_free(h);
+	close(fds[0]);
+	close(fds[1]);
+	free(c.data);
+}
+
+#define DRAIN_PIPELINE 1000 /** How many replies are waiting each time the handle is drained */
+#define DRAIN_ROUNDS   200  /** How many times the handle is filled and drained */
+
+/**
+ * Times draining DRAIN_PIPELINE waiting replies from an arena backed handle, either
+ * one #redis_reply_pop at a time, or with a single #redis_reply_pop_many.
+ * @return The ticks taken per reply.
+ */
+static double bench_drain(int many) {
+	static struct Reply *replies[DRAIN_PIPELINE];
+	static char pipeline[DRAIN_PIPELINE * 5];
+	unsigned long long elapsed = 0;
+	struct RedisHandle *h;
+	int size = 1024 * 1024;
+	int fds[2];
+	int round, i;
+
+	for (i = 0; i < DRAIN_PIPELINE; i++)
+		memcpy(pipeline + i * 5, "+OK\r\n", 5);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+		perror("socketpair");
+		exit(1);
+	}
+	setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	h = redis_alloc();
+	if (h == NULL || redis_use_socket(h, fds[0]) || redis_set_nonblocking(h, 1) || redis_use_arena(h)) {
+		fprintf(stderr, "Failed to create redis handle\n");
+		exit(1);
+	}
+
+	for (round = 0; round < DRAIN_ROUNDS; round++) {
+		unsigned long long start;
+
+		if (send(fds[1], pipeline, sizeof(pipeline), 0) != sizeof(pipeline)) {
+			perror("send");
+			exit(1);
+		}
+
+		while (h->replies < DRAIN_PIPELINE) {
+			if (redis_read(h) < 0) {
+				fprintf(stderr, "redis_read: %s\n", redis_error(h));
+				exit(1);
+			}
+		}
+
+		start = ticks();
+		if (many) {
+			redis_reply_free_many(replies, redis_reply_pop_many(h, replies, DRAIN_PIPELINE));
+		} else {
+			struct Reply *r;
+			while ( (r = redis_reply_pop(h)) != NULL )
+				redis_reply_free(r);
+		}
+		elapsed += ticks() - start;
+	}
+
+	redis_free(h);
+	close(fds[0]);
+	close(fds[1]);
+
+	return (double)elapsed / (DRAIN_ROUNDS * DRAIN_PIPELINE);
+}
+
+static void run_drain(void) {
+	double one  = bench_drain(0);
+	double many = bench_drain(1);
+
+	printf("drain    %-14s pop    %7.1f %ss/reply   pop_many %5.1f %ss/reply   (x%.2f)\n",
+		"1000x +OK", one, TICK_UNIT, many, TICK_UNIT, one / many);
+}
+
+#define ENCODE_COMMANDS 200000 /** How many commands each encoder benchmark encodes */
+#define ENCODE_BATCH    1000   /** How many commands are encoded before the send buffer is emptied */
+
+typedef int (*send_func)(struct RedisHandle *h, const int argc, const struct Object argv[]);
+
+/**
+ * Encodes the command ENCODE_COMMANDS times while pipelining, throwing the send
+ * buffer away every ENCODE_BATCH commands instead of sending it.
+ */
+static void run_encode(const char *name, send_func send, int argc, const struct Object argv[]) {
+	unsigned long long start, elapsed;
+	unsigned long long bytes = 0;
+	struct RedisHandle *h = redis_alloc();
+	int i, j;
+
+	if (h == NULL) {
+		fprintf(stderr, "Failed to create redis handle\n");
+		exit(1);
+	}
+
+	/* The encoders need a socket, even though nothing is ever sent on it */
+	h->socket = STDOUT_FILENO;
+
+	start = now_ns();
+	for (i = 0; i < ENCODE_COMMANDS; i += ENCODE_BATCH) {
+		redis_pipeline_begin(h);
+		for (j = 0; j < ENCODE_BATCH; j++) {
+			if (send(h, argc, argv) < 0) {
+				fprintf(stderr, "Failed to encode: %s\n", redis_error(h));
+				exit(1);
+			}
+		}
+
+		bytes += buffer_len(&h->sendBuf);
+		buffer_unshift(&h->sendBuf, buffer_len(&h->sendBuf));
+		h->pipeline  = 0;
+		h->pipelined = 0;
+	}
+	elapsed = now_ns() - start;
+
+	printf("encode   %-18s %8.1f ns/cmd   %8.1f MB/s\n",
+		name, (double)elapsed / ENCODE_COMMANDS, (double)bytes * 1000 / elapsed);
+
+	h->socket = INVALID_SOCKET;
+	redis_free(h);
+}
+
+static const struct RedisPrepared *prepared; /** The command #send_prepared sends */
+
+/**
+ * Sends prepared, filling its placeholders from all but the first of argv, so the
+ * same arguments can be given to the other encoders.
+ */
+static int send_prepared(struct RedisHandle *h, const int argc, const struct Object argv[]) {
+	(void)argc;
+	return redis_send_prepared(h, prepared, argv + 1);
+}
+
+/**
+ * Compares encoding a command with redis_send_multibulk against preparing it first.
+ */
+static void run_prepared(const char *name, int argc, const struct Object argv[], const struct Object template[]) {
+	struct RedisPrepared *p = redis_prepare(argc, template);
+	char label[32];
+
+	if (p == NULL) {
+		fprintf(stderr, "Failed to prepare %s\n", name);
+		exit(1);
+	}
+	prepared = p;
+
+	snprintf(label, sizeof(label), "multibulk %s", name);
+	run_encode(label, redis_send_multibulk, argc, argv);
+	snprintf(label, sizeof(label), "prepared %s", name);
+	run_encode(label, send_prepared, argc, argv);
+
+	redis_prepared_free(p);
+}
+
+int main(int argc, char *argv[]) {
+	(void)argc;
+	(void)argv;
+
+	run_readline("+OK",   "+OK\r\n");
+	run_readline(":1",    ":1\r\n");
+	run_readline("-ERR",  "-ERR Operation against a key holding the wrong kind of value\r\n");
+
+	run_alloc("1x 16B",       1,           16);
+	run_alloc("1000x 16B",    ALLOC_BATCH, 16);
+	run_alloc("1000x 512B",   ALLOC_BATCH, 512);
+
+	run_parse("status",       corpus_status);
+	run_parse("1KB bulk",     corpus_bulk);
+	run_parse("10k array",    corpus_array);
+	run_parse("mixed",        corpus_mixed);
+
+	run_drain();
+
+	{
+		static char value[1024];
+		const struct Object get[]  = { REDIS_STR("GET"), REDIS_STR("key:000000000001") };
+		const struct Object set[]  = { REDIS_STR("SET"), REDIS_STR("key:000000000001"), REDIS_RAW(value, sizeof(value)) };
+		const struct Object incr[] = { REDIS_STR("INCRBY"), REDIS_STR("counter"), REDIS_INT(1234567) };
+		struct Object mget[101];
+		int i;
+
+		mget[0] = get[0];
+		mget[0].ptr = "MGET";
+		mget[0].len = 4;
+		for (i = 1; i <= 100; i++)
+			mget[i] = get[1];
+
+		run_encode("inline GET",     redis_send,           2,   get);
+		run_encode("bulk SET 1KB",   redis_send_bulk,      3,   set);
+		run_encode("multibulk INCR", redis_send_multibulk, 3,   incr);
+		run_encode("MGET 100 keys",  redis_send_multibulk, 101, mget);
+	}
+
+	{
+		static char value[16];
+		const struct Object get[]     = { REDIS_STR("GET"), REDIS_STR("key:000000000001") };
+		const struct Object getT[]    = { REDIS_STR("GET"), REDIS_ARG(REDIS_TYPE_RAW) };
+		const struct Object set[]     = { REDIS_STR("SET"), REDIS_STR("key:000000000001"), REDIS_RAW(value, sizeof(value)) };
+		const struct Object setT[]    = { REDIS_STR("SET"), REDIS_ARG(REDIS_TYPE_RAW), REDIS_ARG(REDIS_TYPE_RAW) };
+		const struct Object hincr[]   = { REDIS_STR("HINCRBY"), REDIS_STR("key:000000000001"), REDIS_STR("field"), REDIS_INT(1) };
+		const struct Object hincrT[]  = { REDIS_STR("HINCRBY"), REDIS_ARG(REDIS_TYPE_RAW), REDIS_ARG(REDIS_TYPE_RAW), REDIS_INT(1) };
+
+		run_prepared("GET",     2, get,   getT);
+		run_prepared("SET",     3, set,   setT);
+		run_prepared("HINCRBY", 4, hincr, hincrT);
+	}
+
+	return 0;
+}
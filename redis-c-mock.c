@@ -0,0 +1,1128 @@
+/**
+ * redis-c-mock
+ * A small single threaded Redis server, holding an in-memory subset of the commands
+ * (GET, SET, DEL, EXISTS, INCR, MGET, RPUSH, LRANGE), so the library and redis-c-bench can be
+ * exercised without a real server. Replies can be delayed, split into fragments, and
+ * large values preloaded, to reproduce awkward conditions deterministically.
+ *
+ * Requests may be multi-bulk, inline, or the old bulk form ("SET key 5\r\nvalue\r\n").
+ */
+#include "redis-c.h"
+#include "redis_private.h"
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MOCK_READ_LENGTH  16384             /** The least we try to recv at a time */
+#define MOCK_MAX_EVENTS   64                /** How many events are fetched per epoll_wait */
+#define MOCK_MAX_INLINE   (64 * 1024)       /** The longest inline request line */
+#define MOCK_MAX_ARGS     (1024 * 1024)     /** The most arguments a request may have */
+
+struct MockConfig {
+	const char *host;           /** Address to listen on */
+	unsigned short port;
+	const char *socket;         /** Also listen on this Unix domain socket, if set */
+	uint64_t latency;           /** Each reply is held back this long, in us */
+	size_t fragment;            /** Replies are written in random pieces of 1 to fragment bytes, 0 for whole */
+	uint64_t gap;               /** Pause between writes, in us */
+	unsigned int seed;          /** Seeds the fragment sizes */
+	size_t maxBulk;             /** The largest bulk argument accepted */
+	size_t largeValue;          /** Size of the value preloaded into "large", 0 for none */
+	size_t largeList;           /** Elements preloaded into "largelist", 0 for none */
+};
+
+#define VALUE_STRING 0
+#define VALUE_LIST   1
+
+struct MockString {
+	char *ptr;
+	size_t len;
+};
+
+struct MockEntry {
+	struct MockEntry *next;     /** Next entry in the same bucket */
+	uint64_t hash;
+	struct MockString key;
+
+	int type;                   /** VALUE_STRING or VALUE_LIST */
+	struct MockString str;      /** The value of a string */
+	struct MockString *items;   /** The elements of a list */
+	size_t count;               /** Number of elements in the list */
+	size_t cap;                 /** Room in items */
+};
+
+struct MockTable {
+	struct MockEntry **buckets;
+	size_t size;                /** Number of buckets, always a power of two */
+	size_t count;               /** Number of entries */
+};
+
+/** Replies which have been encoded, but are being held back until due */
+struct MockPending {
+	uint64_t end;               /** Where the reply ends, counted in bytes ever appended to out */
+	uint64_t due;               /** When it may be written, in us */
+};
+
+struct MockConn {
+	int fd;
+	struct MockConn *prev, *next;
+
+	struct Buffer in;           /** Received but not yet executed requests */
+	struct Buffer out;          /** Encoded replies not yet written */
+
+	uint64_t appended;          /** Bytes ever appended to out */
+	uint64_t released;          /** Bytes of out which may be written */
+	uint64_t written;           /** Bytes ever written */
+	uint64_t writeAt;           /** Don't write again until, in us */
+
+	struct MockPending *pending;
+	size_t pendingHead, pendingCount, pendingCap;
+
+	struct MockString *argv;    /** The arguments of the request being executed, pointing into in */
+	size_t argc;
+	size_t argvCap;
+
+	unsigned int blocked :1;    /** Is the socket full, and EPOLLOUT armed */
+};
+
+struct MockCommand {
+	const char *name;
+	int arity;                  /** Number of arguments (including the name), -n for at least n */
+	int bulk;                   /** In the old inline form, the last argument is a length followed by the data */
+	void (*proc)(struct MockConn *c);
+};
+
+static struct MockConfig config;
+static struct MockTable db;
+static struct MockConn *conns;  /** All the connections */
+static int epfd;
+static int timerfd;
+
+/* Markers telling epoll events apart from connections' */
+static int listenTag, unixTag, timerTag;
+
+static void fatal(const char *msg) {
+	perror(msg);
+	exit(1);
+}
+
+static uint64_t now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void * xmalloc(size_t size) {
+	void *ptr = malloc(size ? size : 1);
+	if (ptr == NULL)
+		fatal("malloc");
+	return ptr;
+}
+
+static void * xrealloc(void *ptr, size_t size) {
+	ptr = realloc(ptr, size ? size : 1);
+	if (ptr == NULL)
+		fatal("realloc");
+	return ptr;
+}
+
+static struct MockString string_copy(const struct MockString *s) {
+	struct MockString copy;
+	copy.ptr = xmalloc(s->len);
+	copy.len = s->len;
+	memcpy(copy.ptr, s->ptr, s->len);
+	return copy;
+}
+
+/*
+ * The key space
+ */
+
+static uint64_t hash_key(const char *key, size_t len) {
+	/* FNV-1a */
+	uint64_t hash = 14695981039346656037ULL;
+	while (len--) {
+		hash ^= (unsigned char)*key++;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static void table_init(struct MockTable *t) {
+	t->size    = 1024;
+	t->count   = 0;
+	t->buckets = calloc(t->size, sizeof(struct MockEntry *));
+	if (t->buckets == NULL)
+		fatal("calloc");
+}
+
+static void table_grow(struct MockTable *t) {
+	struct MockEntry **buckets = calloc(t->size * 2, sizeof(struct MockEntry *));
+	size_t i;
+
+	if (buckets == NULL)
+		fatal("calloc");
+
+	for (i = 0; i < t->size; i++) {
+		struct MockEntry *e = t->buckets[i];
+		while (e != NULL) {
+			struct MockEntry *next = e->next;
+			size_t b = e->hash & (t->size * 2 - 1);
+			e->next = buckets[b];
+			buckets[b] = e;
+			e = next;
+		}
+	}
+
+	free(t->buckets);
+	t->buckets = buckets;
+	t->size   *= 2;
+}
+
+/**
+ * @return The entry's link in its bucket, pointing to NULL if the key does not exist
+ */
+static struct MockEntry ** table_find(struct MockTable *t, const struct MockString *key) {
+	uint64_t hash = hash_key(key->ptr, key->len);
+	struct MockEntry **link = &t->buckets[hash & (t->size - 1)];
+
+	while (*link != NULL) {
+		struct MockEntry *e = *link;
+		if (e->hash == hash && e->key.len == key->len && memcmp(e->key.ptr, key->ptr, key->len) == 0)
+			break;
+		link = &e->next;
+	}
+
+	return link;
+}
+
+static void entry_clear(struct MockEntry *e) {
+	size_t i;
+
+	free(e->str.ptr);
+	for (i = 0; i < e->count; i++)
+		free(e->items[i].ptr);
+	free(e->items);
+
+	e->str.ptr = NULL;
+	e->str.len = 0;
+	e->items   = NULL;
+	e->count   = e->cap = 0;
+}
+
+static struct MockEntry * table_get(struct MockTable *t, const struct MockString *key) {
+	return *table_find(t, key);
+}
+
+/**
+ * Finds the key, creating it as an empty value of type if it does not exist.
+ */
+static struct MockEntry * table_get_or_create(struct MockTable *t, const struct MockString *key, int type) {
+	struct MockEntry **link = table_find(t, key);
+	struct MockEntry *e = *link;
+
+	if (e != NULL)
+		return e;
+
+	e = calloc(1, sizeof(struct MockEntry));
+	if (e == NULL)
+		fatal("calloc");
+
+	e->hash = hash_key(key->ptr, key->len);
+	e->key  = string_copy(key);
+	e->type = type;
+	*link   = e;
+
+	if (++t->count > t->size)
+		table_grow(t);
+
+	return e;
+}
+
+static int table_delete(struct MockTable *t, const struct MockString *key) {
+	struct MockEntry **link = table_find(t, key);
+	struct MockEntry *e = *link;
+
+	if (e == NULL)
+		return 0;
+
+	*link = e->next;
+	entry_clear(e);
+	free(e->key.ptr);
+	free(e);
+	t->count--;
+
+	return 1;
+}
+
+static void list_push(struct MockEntry *e, const struct MockString *item) {
+	if (e->count == e->cap) {
+		e->cap   = e->cap ? e->cap * 2 : 8;
+		e->items = xrealloc(e->items, e->cap * sizeof(struct MockString));
+	}
+	e->items[e->count++] = string_copy(item);
+}
+
+/*
+ * Replies
+ */
+
+static void reply_append(struct MockConn *c, const void *data, size_t len) {
+	if (buffer_append(&c->out, data, len) == NULL)
+		fatal("buffer_append");
+	c->appended += len;
+}
+
+/** Appends prefix, num and a newline */
+static void reply_number(struct MockConn *c, char prefix, int64_t num) {
+	char tmp[1 + REDIS_INT64_LEN + 2];
+	size_t len;
+
+	tmp[0] = prefix;
+	len = 1 + redis_format_int64(tmp + 1, num);
+	tmp[len++] = '\r';
+	tmp[len++] = '\n';
+
+	reply_append(c, tmp, len);
+}
+
+static void reply_status(struct MockConn *c, const char *status) {
+	reply_append(c, "+", 1);
+	reply_append(c, status, strlen(status));
+	reply_append(c, "\r\n", 2);
+}
+
+static void reply_error(struct MockConn *c, const char *err) {
+	reply_append(c, "-", 1);
+	reply_append(c, err, strlen(err));
+	reply_append(c, "\r\n", 2);
+}
+
+static void reply_bulk(struct MockConn *c, const struct MockString *s) {
+	reply_number(c, '$', s->len);
+	reply_append(c, s->ptr, s->len);
+	reply_append(c, "\r\n", 2);
+}
+
+static void reply_nil(struct MockConn *c) {
+	reply_append(c, "$-1\r\n", 5);
+}
+
+static const char wrongType[] = "WRONGTYPE Operation against a key holding the wrong kind of value";
+
+/**
+ * The reply to the current request is complete. It may be written now, or once the
+ * configured latency has passed.
+ */
+static void reply_done(struct MockConn *c) {
+	struct MockPending *p;
+
+	if (config.latency == 0) {
+		c->released = c->appended;
+		return;
+	}
+
+	if (c->pendingHead > 0 && c->pendingHead == c->pendingCount)
+		c->pendingHead = c->pendingCount = 0;
+
+	if (c->pendingCount == c->pendingCap) {
+		c->pendingCap = c->pendingCap ? c->pendingCap * 2 : 16;
+		c->pending    = xrealloc(c->pending, c->pendingCap * sizeof(struct MockPending));
+	}
+
+	p = &c->pending[c->pendingCount++];
+	p->end = c->appended;
+	p->due = now_us() + config.latency;
+}
+
+/*
+ * Commands
+ */
+
+static void cmd_ping(struct MockConn *c) {
+	reply_status(c, "PONG");
+}
+
+static void cmd_get(struct MockConn *c) {
+	struct MockEntry *e = table_get(&db, &c->argv[1]);
+
+	if (e == NULL)
+		reply_nil(c);
+	else if (e->type != VALUE_STRING)
+		reply_error(c, wrongType);
+	else
+		reply_bulk(c, &e->str);
+}
+
+static void cmd_set(struct MockConn *c) {
+	struct MockEntry *e = table_get_or_create(&db, &c->argv[1], VALUE_STRING);
+
+	entry_clear(e);
+	e->type = VALUE_STRING;
+	e->str  = string_copy(&c->argv[2]);
+
+	reply_status(c, "OK");
+}
+
+static void cmd_mset(struct MockConn *c) {
+	size_t i;
+
+	if (c->argc % 2 == 0) {
+		reply_error(c, "ERR wrong number of arguments");
+		return;
+	}
+
+	for (i = 1; i < c->argc; i += 2) {
+		struct MockEntry *e = table_get_or_create(&db, &c->argv[i], VALUE_STRING);
+
+		entry_clear(e);
+		e->type = VALUE_STRING;
+		e->str  = string_copy(&c->argv[i + 1]);
+	}
+
+	reply_status(c, "OK");
+}
+
+static void cmd_del(struct MockConn *c) {
+	int64_t deleted = 0;
+	size_t i;
+
+	for (i = 1; i < c->argc; i++)
+		deleted += table_delete(&db, &c->argv[i]);
+
+	reply_number(c, ':', deleted);
+}
+
+static void cmd_exists(struct MockConn *c) {
+	int64_t exists = 0;
+	size_t i;
+
+	for (i = 1; i < c->argc; i++)
+		exists += table_get(&db, &c->argv[i]) != NULL;
+
+	reply_number(c, ':', exists);
+}
+
+static void cmd_incr(struct MockConn *c) {
+	struct MockEntry *e = table_get_or_create(&db, &c->argv[1], VALUE_STRING);
+	char tmp[REDIS_INT64_LEN];
+	int64_t num = 0;
+
+	if (e->type != VALUE_STRING) {
+		reply_error(c, wrongType);
+		return;
+	}
+
+	if (e->str.ptr != NULL && redis_parse_int64(e->str.ptr, e->str.len, &num)) {
+		reply_error(c, "ERR value is not an integer or out of range");
+		return;
+	}
+
+	if (num == INT64_MAX) {
+		reply_error(c, "ERR increment or decrement would overflow");
+		return;
+	}
+	num++;
+
+	free(e->str.ptr);
+	e->str.len = redis_format_int64(tmp, num);
+	e->str.ptr = xmalloc(e->str.len);
+	memcpy(e->str.ptr, tmp, e->str.len);
+
+	reply_number(c, ':', num);
+}
+
+static void cmd_mget(struct MockConn *c) {
+	size_t i;
+
+	reply_number(c, '*', c->argc - 1);
+
+	for (i = 1; i < c->argc; i++) {
+		struct MockEntry *e = table_get(&db, &c->argv[i]);
+		if (e == NULL || e->type != VALUE_STRING)
+			reply_nil(c);
+		else
+			reply_bulk(c, &e->str);
+	}
+}
+
+static void cmd_rpush(struct MockConn *c) {
+	struct MockEntry *e = table_get_or_create(&db, &c->argv[1], VALUE_LIST);
+	size_t i;
+
+	if (e->type != VALUE_LIST) {
+		reply_error(c, wrongType);
+		return;
+	}
+
+	for (i = 2; i < c->argc; i++)
+		list_push(e, &c->argv[i]);
+
+	reply_number(c, ':', e->count);
+}
+
+static void cmd_lrange(struct MockConn *c) {
+	struct MockEntry *e = table_get(&db, &c->argv[1]);
+	int64_t start, stop, count;
+	int64_t i;
+
+	if (redis_parse_int64(c->argv[2].ptr, c->argv[2].len, &start) ||
+	    redis_parse_int64(c->argv[3].ptr, c->argv[3].len, &stop)) {
+		reply_error(c, "ERR value is not an integer or out of range");
+		return;
+	}
+
+	if (e == NULL) {
+		reply_number(c, '*', 0);
+		return;
+	}
+
+	if (e->type != VALUE_LIST) {
+		reply_error(c, wrongType);
+		return;
+	}
+
+	/* Negative indexes count from the end */
+	count = (int64_t)e->count;
+	if (start < 0) start += count;
+	if (stop  < 0) stop  += count;
+	if (start < 0) start = 0;
+	if (stop >= count) stop = count - 1;
+
+	if (start > stop) {
+		reply_number(c, '*', 0);
+		return;
+	}
+
+	reply_number(c, '*', stop - start + 1);
+	for (i = start; i <= stop; i++)
+		reply_bulk(c, &e->items[i]);
+}
+
+static void cmd_flushdb(struct MockConn *c) {
+	size_t i;
+
+	for (i = 0; i < db.size; i++) {
+		while (db.buckets[i] != NULL)
+			table_delete(&db, &db.buckets[i]->key);
+	}
+
+	reply_status(c, "OK");
+}
+
+static const struct MockCommand commands[] = {
+	{ "PING",    1, 0, cmd_ping    },
+	{ "GET",     2, 0, cmd_get     },
+	{ "SET",     3, 1, cmd_set     },
+	{ "DEL",    -2, 0, cmd_del     },
+	{ "EXISTS", -2, 0, cmd_exists  },
+	{ "INCR",    2, 0, cmd_incr    },
+	{ "MGET",   -2, 0, cmd_mget    },
+	{ "MSET",   -3, 0, cmd_mset    },
+	{ "RPUSH",  -3, 1, cmd_rpush   },
+	{ "LRANGE",  4, 0, cmd_lrange  },
+	{ "FLUSHDB", 1, 0, cmd_flushdb },
+	{ NULL,      0, 0, NULL        },
+};
+
+static const struct MockCommand * lookup_command(const struct MockString *name) {
+	const struct MockCommand *cmd;
+
+	for (cmd = commands; cmd->name != NULL; cmd++) {
+		if (strlen(cmd->name) == name->len && strncasecmp(cmd->name, name->ptr, name->len) == 0)
+			return cmd;
+	}
+
+	return NULL;
+}
+
+static void execute(struct MockConn *c) {
+	const struct MockCommand *cmd;
+
+	if (c->argc == 0)
+		return;
+
+	cmd = lookup_command(&c->argv[0]);
+	if (cmd == NULL) {
+		reply_error(c, "ERR unknown command");
+	} else if ((cmd->arity > 0 && c->argc != (size_t)cmd->arity) ||
+	           (cmd->arity < 0 && c->argc < (size_t)-cmd->arity)) {
+		reply_error(c, "ERR wrong number of arguments");
+	} else {
+		cmd->proc(c);
+	}
+
+	reply_done(c);
+}
+
+/*
+ * Request parsing
+ */
+
+static void args_reserve(struct MockConn *c, size_t argc) {
+	if (argc <= c->argvCap)
+		return;
+
+	c->argvCap = argc;
+	c->argv    = xrealloc(c->argv, argc * sizeof(struct MockString));
+}
+
+static void args_push(struct MockConn *c, const char *ptr, size_t len) {
+	if (c->argc == c->argvCap)
+		args_reserve(c, c->argvCap ? c->argvCap * 2 : 8);
+
+	c->argv[c->argc].ptr = (char *)ptr;
+	c->argv[c->argc].len = len;
+	c->argc++;
+}
+
+/**
+ * Parses the number on the line from ptr up to (but not including) the \r\n ending at end.
+ * @return 0 on success, -1 if the line is not a number ending in \r\n
+ */
+static int parse_line_number(const char *ptr, const char *end, int64_t *num) {
+	if (end - ptr < 1 || end[-1] != '\r')
+		return -1;
+	return redis_parse_int64(ptr, end - 1 - ptr, num);
+}
+
+/**
+ * Parses a request of the form *argc\r\n then argc lots of $len\r\ndata\r\n.
+ * @return The number of bytes the request used, 0 if it has not all arrived, -1 on a protocol error.
+ */
+static ssize_t parse_multibulk(struct MockConn *c, const char *start, const char *end) {
+	const char *ptr = start;
+	const char *line;
+	int64_t argc, len, i;
+
+	line = memchr(ptr, '\n', end - ptr);
+	if (line == NULL)
+		return 0;
+
+	if (parse_line_number(ptr + 1, line, &argc) || argc > MOCK_MAX_ARGS)
+		return -1;
+
+	ptr = line + 1;
+	args_reserve(c, argc > 0 ? argc : 0);
+
+	for (i = 0; i < argc; i++) {
+		line = memchr(ptr, '\n', end - ptr);
+		if (line == NULL)
+			return 0;
+
+		if (*ptr != '$' || parse_line_number(ptr + 1, line, &len) || len < 0 || (uint64_t)len > config.maxBulk)
+			return -1;
+
+		ptr = line + 1;
+		if ((uint64_t)(end - ptr) < (uint64_t)len + 2)
+			return 0;
+
+		if (ptr[len] != '\r' || ptr[len + 1] != '\n')
+			return -1;
+
+		args_push(c, ptr, len);
+		ptr += len + 2;
+	}
+
+	return ptr - start;
+}
+
+/**
+ * Parses a line of space separated arguments. If the command is a bulk command, the last
+ * argument is the length of the data which follows on the next line.
+ * @return The number of bytes the request used, 0 if it has not all arrived, -1 on a protocol error.
+ */
+static ssize_t parse_inline(struct MockConn *c, const char *start, const char *end) {
+	const char *line, *ptr, *lineEnd;
+	const struct MockCommand *cmd;
+	int64_t len;
+
+	line = memchr(start, '\n', end - start);
+	if (line == NULL)
+		return end - start > MOCK_MAX_INLINE ? -1 : 0;
+
+	lineEnd = line;
+	if (lineEnd > start && lineEnd[-1] == '\r')
+		lineEnd--;
+
+	for (ptr = start; ptr < lineEnd; ) {
+		const char *arg;
+
+		while (ptr < lineEnd && *ptr == ' ')
+			ptr++;
+		if (ptr == lineEnd)
+			break;
+
+		arg = ptr;
+		while (ptr < lineEnd && *ptr != ' ')
+			ptr++;
+
+		args_push(c, arg, ptr - arg);
+	}
+
+	if (c->argc == 0)
+		return line + 1 - start;
+
+	cmd = lookup_command(&c->argv[0]);
+	if (cmd == NULL || !cmd->bulk || c->argc < 2)
+		return line + 1 - start;
+
+	/* The old bulk form, where the data follows on its own line */
+	c->argc--;
+	if (redis_parse_int64(c->argv[c->argc].ptr, c->argv[c->argc].len, &len) || len < 0 || (uint64_t)len > config.maxBulk)
+		return -1;
+
+	ptr = line + 1;
+	if ((uint64_t)(end - ptr) < (uint64_t)len + 2)
+		return 0;
+
+	if (ptr[len] != '\r' || ptr[len + 1] != '\n')
+		return -1;
+
+	args_push(c, ptr, len);
+
+	return ptr + len + 2 - start;
+}
+
+/**
+ * Executes every complete request in the connection's input buffer.
+ * @return 0 on success, -1 on a protocol error.
+ */
+static int process_input(struct MockConn *c) {
+	while (buffer_len(&c->in) > 0) {
+		const char *start = buffer_start(&c->in);
+		const char *end   = buffer_end(&c->in);
+		ssize_t used;
+
+		c->argc = 0;
+		if (*start == '*')
+			used = parse_multibulk(c, start, end);
+		else
+			used = parse_inline(c, start, end);
+
+		if (used < 0) {
+			reply_error(c, "ERR Protocol error");
+			reply_done(c);
+			return -1;
+		}
+
+		if (used == 0)
+			break;
+
+		execute(c);
+		buffer_unshift(&c->in, used);
+	}
+
+	return 0;
+}
+
+/*
+ * Connections
+ */
+
+static void conn_events(struct MockConn *c) {
+	struct epoll_event ev;
+
+	ev.events   = EPOLLIN | (c->blocked ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev))
+		fatal("epoll_ctl");
+}
+
+static void conn_close(struct MockConn *c) {
+	epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		conns = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+
+	buffer_cleanup(&c->in);
+	buffer_cleanup(&c->out);
+	free(c->pending);
+	free(c->argv);
+	free(c);
+}
+
+/**
+ * Writes whatever replies are due, in fragments if configured.
+ * @return 0 on success, -1 if the connection failed.
+ */
+static int conn_write(struct MockConn *c, uint64_t now) {
+	int wasBlocked = c->blocked;
+
+	while (c->pendingHead < c->pendingCount && c->pending[c->pendingHead].due <= now)
+		c->released = c->pending[c->pendingHead++].end;
+
+	c->blocked = 0;
+
+	while (c->released > c->written && c->writeAt <= now) {
+		size_t len = c->released - c->written;
+		ssize_t sent;
+
+		if (config.fragment) {
+			size_t piece = 1 + rand_r(&config.seed) % config.fragment;
+			if (len > piece)
+				len = piece;
+		}
+
+		sent = send(c->fd, buffer_start(&c->out), len, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				c->blocked = 1;
+				break;
+			}
+			return -1;
+		}
+
+		buffer_unshift(&c->out, sent);
+		c->written += sent;
+
+		if (config.gap)
+			c->writeAt = now + config.gap;
+	}
+
+	if (c->blocked != wasBlocked)
+		conn_events(c);
+
+	return 0;
+}
+
+/**
+ * @return When the connection next has something to do, or 0 if it is waiting on the client.
+ */
+static uint64_t conn_deadline(const struct MockConn *c) {
+	if (c->released > c->written && !c->blocked)
+		return c->writeAt;
+
+	if (c->pendingHead < c->pendingCount)
+		return c->pending[c->pendingHead].due > c->writeAt ? c->pending[c->pendingHead].due : c->writeAt;
+
+	return 0;
+}
+
+static void conn_read(struct MockConn *c) {
+	size_t want = buffer_len(&c->in) < MOCK_READ_LENGTH ? MOCK_READ_LENGTH : buffer_len(&c->in);
+	ssize_t len;
+
+	/* Grow geometrically, so large values don't cost a realloc per recv */
+	if (buffer_reserveExtra(&c->in, want) == NULL)
+		fatal("buffer_reserveExtra");
+
+	len = recv(c->fd, buffer_end(&c->in), buffer_available(&c->in), 0);
+	if (len < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+
+	if (len <= 0) {
+		conn_close(c);
+		return;
+	}
+
+	buffer_push(&c->in, len);
+
+	if (process_input(c)) {
+		/* Send the error, then give up on the connection */
+		c->released = c->appended;
+		conn_write(c, now_us());
+		conn_close(c);
+		return;
+	}
+
+	if (conn_write(c, now_us()))
+		conn_close(c);
+}
+
+static void conn_accept(int listenfd) {
+	struct epoll_event ev;
+	struct MockConn *c;
+	int one = 1;
+	int fd;
+
+	fd = accept(listenfd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK)) {
+		close(fd);
+		return;
+	}
+
+	/* Each fragment should go out in its own segment. This fails harmlessly on Unix sockets */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	c = calloc(1, sizeof(struct MockConn));
+	if (c == NULL || buffer_init(&c->in, MOCK_READ_LENGTH) == NULL || buffer_init(&c->out, MOCK_READ_LENGTH) == NULL)
+		fatal("calloc");
+
+	c->fd = fd;
+	c->next = conns;
+	if (conns != NULL)
+		conns->prev = c;
+	conns = c;
+
+	ev.events   = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev))
+		fatal("epoll_ctl");
+}
+
+/**
+ * Writes any replies which have become due, and arms the timer for the next one.
+ */
+static void service_timers(void) {
+	struct itimerspec its;
+	struct MockConn *c, *next;
+	uint64_t now = now_us();
+	uint64_t soonest = 0;
+
+	for (c = conns; c != NULL; c = next) {
+		uint64_t deadline;
+
+		next = c->next;
+		if (conn_write(c, now)) {
+			conn_close(c);
+			continue;
+		}
+
+		deadline = conn_deadline(c);
+		if (deadline != 0 && (soonest == 0 || deadline < soonest))
+			soonest = deadline;
+	}
+
+	/* An absolute time of zero would disarm the timer */
+	memset(&its, 0, sizeof(its));
+	if (soonest != 0) {
+		if (soonest <= now)
+			soonest = now + 1;
+		its.it_value.tv_sec  = soonest / 1000000;
+		its.it_value.tv_nsec = (soonest % 1000000) * 1000;
+	}
+
+	if (timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL))
+		fatal("timerfd_settime");
+}
+
+static int listen_tcp(const char *host, unsigned short port) {
+	struct sockaddr_in addr;
+	int one = 1;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port   = htons(port);
+	if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+		fprintf(stderr, "Invalid address %s\n", host);
+		exit(1);
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		fatal("socket");
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)))
+		fatal("bind");
+	if (listen(fd, 511))
+		fatal("listen");
+
+	return fd;
+}
+
+static int listen_unix(const char *path) {
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long %s\n", path);
+		exit(1);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		fatal("socket");
+
+	/* A socket left behind by an earlier run would make bind fail */
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)))
+		fatal("bind");
+	if (listen(fd, 511))
+		fatal("listen");
+
+	return fd;
+}
+
+/**
+ * Fills in the large values asked for on the command line.
+ */
+static void preload(void) {
+	struct MockEntry *e;
+	size_t i;
+
+	if (config.largeValue) {
+		struct MockString key = { "large", 5 };
+		e = table_get_or_create(&db, &key, VALUE_STRING);
+		e->str.ptr = xmalloc(config.largeValue);
+		e->str.len = config.largeValue;
+		memset(e->str.ptr, 'x', config.largeValue);
+	}
+
+	if (config.largeList) {
+		struct MockString key = { "largelist", 9 };
+		e = table_get_or_create(&db, &key, VALUE_LIST);
+		for (i = 0; i < config.largeList; i++) {
+			char tmp[32];
+			struct MockString item;
+			item.ptr = tmp;
+			item.len = snprintf(tmp, sizeof(tmp), "element:%lu", (unsigned long)i);
+			list_push(e, &item);
+		}
+	}
+}
+
+static void usage(const char *argv0) {
+	fprintf(stderr,
+		"Usage: %s [-h host] [-p port] [-s socket] [-l latency] [-f fragment] [-g gap]\n"
+		"          [-S seed] [-M max bulk] [-V large value] [-E large list]\n"
+		"\n"
+		" -h <host>      Address to listen on (default 127.0.0.1)\n"
+		" -p <port>      Port to listen on (default 6379)\n"
+		" -s <path>      Also listen on this Unix domain socket\n"
+		" -l <usec>      Hold every reply back this long\n"
+		" -f <bytes>     Write replies in random pieces of 1 to this many bytes\n"
+		" -g <usec>      Pause this long between writes\n"
+		" -S <seed>      Seed for the fragment sizes (default 1)\n"
+		" -M <bytes>     Largest bulk argument accepted (default 512MB)\n"
+		" -V <bytes>     Preload the key \"large\" with a value this big\n"
+		" -E <count>     Preload the list \"largelist\" with this many elements\n",
+		argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	struct epoll_event events[MOCK_MAX_EVENTS];
+	struct epoll_event ev;
+	int listenfd, unixfd = -1;
+	int opt;
+
+	config.host    = "127.0.0.1";
+	config.port    = 6379;
+	config.seed    = 1;
+	config.maxBulk = 512 * 1024 * 1024;
+
+	while ( (opt = getopt(argc, argv, "h:p:s:l:f:g:S:M:V:E:")) != -1 ) {
+		switch (opt) {
+			case 'h': config.host       = optarg; break;
+			case 'p': config.port       = atoi(optarg); break;
+			case 's': config.socket     = optarg; break;
+			case 'l': config.latency    = strtoull(optarg, NULL, 10); break;
+			case 'f': config.fragment   = strtoul(optarg, NULL, 10); break;
+			case 'g': config.gap        = strtoull(optarg, NULL, 10); break;
+			case 'S': config.seed       = strtoul(optarg, NULL, 10); break;
+			case 'M': config.maxBulk    = strtoul(optarg, NULL, 10); break;
+			case 'V': config.largeValue = strtoul(optarg, NULL, 10); break;
+			case 'E': config.largeList  = strtoul(optarg, NULL, 10); break;
+			default:  usage(argv[0]);
+		}
+	}
+
+	table_init(&db);
+	preload();
+
+	listenfd = listen_tcp(config.host, config.port);
+	if (config.socket != NULL)
+		unixfd = listen_unix(config.socket);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (epfd < 0 || timerfd < 0)
+		fatal("epoll_create1");
+
+	ev.events   = EPOLLIN;
+	ev.data.ptr = &listenTag;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev))
+		fatal("epoll_ctl");
+
+	if (unixfd >= 0) {
+		ev.data.ptr = &unixTag;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, unixfd, &ev))
+			fatal("epoll_ctl");
+	}
+
+	ev.data.ptr = &timerTag;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &ev))
+		fatal("epoll_ctl");
+
+	printf("Listening on %s:%u\n", config.host, config.port);
+	if (config.socket != NULL)
+		printf("Listening on %s\n", config.socket);
+	fflush(stdout);
+
+	for (;;) {
+		int n, i;
+
+		n = epoll_wait(epfd, events, MOCK_MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fatal("epoll_wait");
+		}
+
+		for (i = 0; i < n; i++) {
+			void *ptr = events[i].data.ptr;
+
+			if (ptr == &listenTag) {
+				conn_accept(listenfd);
+
+			} else if (ptr == &unixTag) {
+				conn_accept(unixfd);
+
+			} else if (ptr == &timerTag) {
+				uint64_t expirations;
+				if (read(timerfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+					fatal("read");
+
+			} else {
+				struct MockConn *c = ptr;
+
+				if (events[i].events & EPOLLOUT) {
+					if (conn_write(c, now_us())) {
+						conn_close(c);
+						continue;
+					}
+				}
+
+				if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+					conn_read(c);
+			}
+		}
+
+		/* Held back replies, and pauses between fragments, are driven by the timer */
+		if (config.latency || config.gap)
+			service_timers();
+	}
+
+	return 0;
+}
@@ -7,8 +7,12 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <assert.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,10 +29,67 @@ struct RedisHandle * redis_alloc() {
 		return NULL;
 	}
 
-	h->replies   = 0;
-	h->reply     = NULL;
-	h->lastReply = NULL;
-	h->linePos   = 0;
+	if (buffer_init(&h->sendBuf, INITIAL_SEND_LENGTH) == NULL) {
+		buffer_cleanup(&h->buf);
+		free(h);
+		return NULL;
+	}
+
+	h->readLen    = UNKNOWN_READ_LENGTH;
+	h->readShort  = 0;
+	h->sendRefCount = 0;
+	h->zerocopyThreshold = 0;
+	h->zerocopySent = 0;
+	h->zerocopyDone = 0;
+	h->replies    = 0;
+	h->replyRing  = NULL;
+	h->replyHead  = 0;
+	h->replyCount = 0;
+	h->replyCap   = 0;
+	h->linePos    = 0;
+	h->bulk       = NULL;
+	h->bulkPos    = 0;
+	h->bulkSkip   = 0;
+	h->intoRing   = NULL;
+	h->intoHead   = 0;
+	h->intoCount  = 0;
+	h->intoCap    = 0;
+	h->into       = NULL;
+	h->depth      = 0;
+	h->pipelined  = 0;
+	h->pipeline   = 0;
+	h->streamChunk   = NULL;
+	h->streamElement = NULL;
+	h->streamArg     = NULL;
+	h->streamLen     = 0;
+	h->streamPos     = 0;
+	h->streamBulk    = 0;
+	h->streaming     = 0;
+	h->allocator  = NULL;
+	h->arena      = NULL;
+	h->cache      = NULL;
+	h->batch      = NULL;
+	h->uring      = NULL;
+
+	memset(&h->stats, 0, sizeof(h->stats));
+	h->sendTimes    = NULL;
+	h->sendTimesCap = 0;
+	redis_stats_reset_inflight(h);
+
+	h->loop         = NULL;
+	h->loopCallback = NULL;
+	h->loopArg      = NULL;
+	h->loopBatchNext = NULL;
+	h->nonblocking  = 0;
+	h->loopWrite    = 0;
+	h->loopBatched  = 0;
+	h->failed       = 0;
+	h->selected     = 0;
+
+	{
+		const struct RedisConnectOptions options = REDIS_CONNECT_OPTIONS_INIT;
+		h->options = options;
+	}
 
 	h->socket      = INVALID_SOCKET;
 	h->socketOwned = 1;
@@ -41,28 +102,200 @@ struct RedisHandle * redis_alloc() {
 
 void redis_free(struct RedisHandle * h) {
 
-	struct Reply *r;
+	unsigned int i;
 
 	if (h == NULL)
 		return;
 
+	if (h->loop != NULL)
+		redis_loop_remove(h->loop, h);
+
+	/* Callbacks for batched requests may still use the handle */
+	redis_batch_free(h);
+
+	/* Anything io_uring still has queued goes out first */
+	redis_uring_free(h);
+
 	/* Close the socket if we own it */
 	if (h->socket != INVALID_SOCKET && h->socketOwned)
 		closesocket(h->socket);
 
 	buffer_cleanup(&h->buf);
+	buffer_cleanup(&h->sendBuf);
+	free(h->sendTimes);
+	free(h->intoRing);
 
-	/* Free all the replies */
-	r = h->reply;
-	while (r) {
-		struct Reply *next = r->next;
-		redis_reply_free(r);
-		r = next;
-	}
+	/* Free all the replies, including any still being read */
+	for (i = 0; i < h->replyCount; i++)
+		redis_reply_free(h->replyRing[(h->replyHead + i) & (h->replyCap - 1)]);
+	free(h->replyRing);
+
+	redis_cache_free(h->cache);
+
+	/* Any replies the caller still holds keep the arena alive */
+	redis_arena_detach(h->arena);
 
 	free(h);
 }
 
+/**
+ * @internal
+ * Makes the socket's O_NONBLOCK flag match the handle's nonblocking flag.
+ * @return 0 on success, -1 on failure.
+ */
+static int set_socket_nonblocking(struct RedisHandle * h) {
+	int flags = fcntl(h->socket, F_GETFL, 0);
+	if (flags < 0) {
+		h->lastErr = "Error reading socket flags";
+		return -1;
+	}
+
+	if (h->nonblocking)
+		flags |= O_NONBLOCK;
+	else
+		flags &= ~O_NONBLOCK;
+
+	if (fcntl(h->socket, F_SETFL, flags) < 0) {
+		h->lastErr = "Error setting socket non-blocking";
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @internal
+ * Sets an int socket option, unless value is 0.
+ * @return 0 on success, -1 on failure.
+ */
+static int set_socket_option(struct RedisHandle * h, int level, int name, int value, const char *err) {
+	if (value == 0)
+		return 0;
+
+	if (setsockopt(h->socket, level, name, &value, sizeof(value)) < 0) {
+		h->lastErr = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @internal
+ * Applies the handle's connect options to a new socket. The buffer sizes are set
+ * before connecting, because TCP picks its window scale during the handshake.
+ * @return 0 on success, -1 on failure.
+ */
+static int set_socket_options(struct RedisHandle * h, int family) {
+	const struct RedisConnectOptions *o = &h->options;
+
+	if (set_socket_option(h, SOL_SOCKET, SO_SNDBUF, o->sendBuffer, "Error setting SO_SNDBUF")
+	 || set_socket_option(h, SOL_SOCKET, SO_RCVBUF, o->recvBuffer, "Error setting SO_RCVBUF"))
+		return -1;
+
+	if (family == AF_UNIX)
+		return 0;
+
+	if (set_socket_option(h, IPPROTO_TCP, TCP_NODELAY, o->noDelay, "Error setting TCP_NODELAY"))
+		return -1;
+
+#ifdef SO_BUSY_POLL
+	if (set_socket_option(h, SOL_SOCKET, SO_BUSY_POLL, o->busyPoll, "Error setting SO_BUSY_POLL"))
+		return -1;
+#endif
+
+	if (!o->keepAlive)
+		return 0;
+
+	if (set_socket_option(h, SOL_SOCKET, SO_KEEPALIVE, 1, "Error setting SO_KEEPALIVE"))
+		return -1;
+
+#ifdef TCP_KEEPIDLE
+	if (set_socket_option(h, IPPROTO_TCP, TCP_KEEPIDLE,  o->keepIdle,     "Error setting TCP_KEEPIDLE")
+	 || set_socket_option(h, IPPROTO_TCP, TCP_KEEPINTVL, o->keepInterval, "Error setting TCP_KEEPINTVL")
+	 || set_socket_option(h, IPPROTO_TCP, TCP_KEEPCNT,   o->keepCount,    "Error setting TCP_KEEPCNT"))
+		return -1;
+#endif
+
+	return 0;
+}
+
+/**
+ * @internal
+ * Closes the handle's current socket, if it owns one, ready for a new connection.
+ */
+static void close_socket(struct RedisHandle * h) {
+	redis_uring_free(h);
+	if (h->socket != INVALID_SOCKET && h->socketOwned)
+		closesocket(h->socket);
+	h->socket      = INVALID_SOCKET;
+	h->socketOwned = 1;
+}
+
+/**
+ * @internal
+ * Forgets everything about the previous connection: half parsed replies, replies
+ * nobody popped, unsent commands and requests still waiting for replies. The
+ * handle's modes (pipelining, streaming, batching and so on) are kept.
+ */
+static void reset_connection(struct RedisHandle * h) {
+	unsigned int i;
+
+	redis_batch_reset(h);
+	redis_into_reset(h);
+
+	/* The parser starts again from the beginning of a reply */
+	h->state      = STATE_WAITING;
+	h->linePos    = 0;
+	h->bulk       = NULL;
+	h->bulkPos    = 0;
+	h->bulkSkip   = 0;
+	h->depth      = 0;
+	h->streamLen  = 0;
+	h->streamPos  = 0;
+	h->streamBulk = 0;
+	buffer_unshift(&h->buf, buffer_len(&h->buf));
+
+	/* Free all the replies, including any still being read */
+	for (i = 0; i < h->replyCount; i++)
+		redis_reply_free(h->replyRing[(h->replyHead + i) & (h->replyCap - 1)]);
+	h->replies    = 0;
+	h->replyHead  = 0;
+	h->replyCount = 0;
+
+	/* Commands queued for the old connection are never sent */
+	buffer_unshift(&h->sendBuf, buffer_len(&h->sendBuf));
+	h->sendRefCount = 0;
+	h->pipelined    = 0;
+
+	h->failed   = 0;
+	h->selected = 0;
+	h->zerocopyThreshold = 0;
+	h->zerocopySent      = 0;
+	h->zerocopyDone      = 0;
+	redis_stats_reset_inflight(h);
+	redis_cache_clear(h);
+}
+
+/**
+ * @internal
+ * Marks the handle as connected through the socket it has just connected.
+ * @return 0 on success, -1 on failure.
+ */
+static int connected(struct RedisHandle * h) {
+	reset_connection(h);
+	h->lastErr = NULL;
+
+	return h->nonblocking ? set_socket_nonblocking(h) : 0;
+}
+
+void redis_set_connect_options(struct RedisHandle * h, const struct RedisConnectOptions *options) {
+	assert(h != NULL);
+	assert(options != NULL);
+
+	h->options = *options;
+}
+
 const char * redis_error(struct RedisHandle * h) {
 	return h->lastErr;
 }
@@ -95,6 +328,8 @@ int redis_connect(struct RedisHandle * h, const char *host, unsigned short port)
 		return -1;
 	}
 
+	close_socket(h);
+
 	for (ai = aiList; ai != NULL; ai = ai->ai_next) {
 		h->socket = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
 		if (h->socket == INVALID_SOCKET) {
@@ -102,12 +337,14 @@ int redis_connect(struct RedisHandle * h, const char *host, unsigned short port)
 			goto cleanup;
 		}
 
+		if (set_socket_options(h, ai->ai_family)) {
+			close_socket(h);
+			goto cleanup;
+		}
+
 		if (connect(h->socket, ai->ai_addr, ai->ai_addrlen) == 0) {
 			/* If connecting was OK, we bail out */
-			h->lastErr = NULL;
-			h->socketOwned = 1;
-
-			ret = 0;
+			ret = connected(h);
 			goto cleanup;
 		}
 
@@ -123,64 +360,90 @@ cleanup:
 	return ret;
 }
 
+int redis_connect_unix(struct RedisHandle * h, const char *path) {
+	struct sockaddr_un addr;
+
+	assert(h != NULL);
+	assert(path != NULL);
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		h->lastErr = "Error socket path too long";
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	close_socket(h);
+
+	h->socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (h->socket == INVALID_SOCKET) {
+		h->lastErr = "Error allocating socket";
+		return -1;
+	}
+
+	if (set_socket_options(h, AF_UNIX)) {
+		close_socket(h);
+		return -1;
+	}
+
+	if (connect(h->socket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		h->lastErr = "Error connecting to redis server";
+		close_socket(h);
+		return -1;
+	}
+
+	return connected(h);
+}
+
+int redis_failed(struct RedisHandle * h) {
+	return h->failed;
+}
+
 SOCKET redis_get_socket(struct RedisHandle * h) {
 	return h->socket;
 }
 
 int redis_use_socket(struct RedisHandle * h, SOCKET s) {
+	redis_uring_free(h);
 	if (h->socket != INVALID_SOCKET)
 		closesocket(h->socket);
 	h->socket = s;
 	h->socketOwned = 0;
-	return 0;
+	reset_connection(h);
+	return h->nonblocking ? set_socket_nonblocking(h) : 0;
 }
 
-int main(int argc, char *argv[]) {
-
-	struct RedisHandle *handle = redis_alloc();
-	if (!handle) {
-		printf("Failed to create redis handle\n");
+int redis_set_nonblocking(struct RedisHandle * h, int nonblocking) {
+	if (nonblocking && h->uring != NULL) {
+		h->lastErr = "Error can not be non-blocking while using io_uring";
 		return -1;
 	}
 
-	const struct Object args[] = {
-		REDIS_STR("SET"),
-		REDIS_STR("key"),
-		REDIS_STR("value"),
-	};
+	h->nonblocking = nonblocking ? 1 : 0;
 
-	if ( redis_connect(handle, "localhost", 6379) ) {
-		printf("redis_connect: %s\n", redis_error(handle));
+	if (h->socket == INVALID_SOCKET)
 		return 0;
-	}
-
-	printf("Connected\n");
-
-	if ( redis_send_bulk(handle, 3, args) ) {
-		printf("redis_sendBulk: %s\n", redis_error(handle));
-		return 0;
-	}
 
-	printf("Sent bulk\n");
-
-	int ret;
-	int i;
-	for (i = 0; i < 10; i++) {
-		ret = redis_read(handle);
-		printf("%d\n", ret);
+	return set_socket_nonblocking(h);
+}
 
-		if (ret == -1) {
-			printf("redis_read: %s\n", redis_error(handle));
-		} else if (ret > 0) {
-			struct Reply *r = redis_reply_pop(handle);
-			redis_reply_print(r);
-		}
+void redis_set_allocator(struct RedisHandle * h, const struct RedisAllocator *a) {
+	redis_arena_detach(h->arena);
+	h->arena = NULL;
+	h->allocator = a;
+}
 
+int redis_use_arena(struct RedisHandle * h) {
+	struct RedisArena *arena = redis_arena_alloc();
+	if (arena == NULL) {
+		h->lastErr = "Error allocating arena";
+		return -1;
 	}
 
-	//redis_sendMultiBulk(handle, 3, args);
-
-	redis_free(handle);
+	redis_set_allocator(h, redis_arena_allocator(arena));
+	h->arena = arena;
 
 	return 0;
 }
@@ -3,6 +3,7 @@
 
 #include "redis_buffer.h"
 
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -18,41 +19,284 @@
 #define REDIS_TYPE_STR 1
 #define REDIS_TYPE_RAW 2
 #define REDIS_TYPE_INT 3
+#define REDIS_TYPE_MULTIBULK 4 /** ptr points to a nested #Reply */
+#define REDIS_TYPE_ARG 5       /** A placeholder in a #redis_prepare template, integer holds the type it accepts */
+
+#define REDIS_MAX_DEPTH 8 /** How deeply multi-bulk replies may be nested */
 
 struct Object {
 	char *ptr;                /** Pointer to raw/str data */
 	size_t len;               /** The length of the data */
-	unsigned int type     :2; /** What type of data is pointed to */
+	unsigned int type     :3; /** What type of data is pointed to */
 	unsigned int ptrOwned :1; /** Should we free the ptr? */
+	int64_t integer;          /** The value of a #REDIS_TYPE_INT (which has no ptr) */
+};
+
+/**
+ * Lets the memory for #Reply s and their #Object s' data come from somewhere other
+ * than malloc. release is always told the size that was asked of alloc.
+ */
+struct RedisAllocator {
+	void * (*alloc)  (void *ctx, size_t size);            /** Returns size bytes, or NULL */
+	void   (*release)(void *ctx, void *ptr, size_t size); /** Gives back memory from alloc */
+	void *ctx;                                            /** Passed to alloc and release */
 };
 
+struct RedisArena;
+struct RedisCache;
+struct RedisBatch;
+struct RedisUring;
+
 struct Reply {
-	struct Reply *next;       /** Next reply in the list of replies */
+	const struct RedisAllocator *allocator; /** Where this reply's memory came from, NULL for malloc */
 
 	unsigned int argc;        /** Number of responses this reply contains */
 	struct Object argv[1];    /** The responses */
 };
 
+struct RedisHandle;
+struct RedisLoop;
+
+/**
+ * Called by a #RedisLoop when a handle has replies waiting, or has failed.
+ *
+ * @param handle
+ * @param ret The number of replies waiting, or -1 if an error occurred.
+ * @param arg The argument given to #redis_loop_add
+ */
+typedef void (*redis_loop_callback)(struct RedisHandle *handle, int ret, void *arg);
+
+/**
+ * Called by a handle in streaming mode with each slice of a bulk value, as it arrives.
+ * See #redis_stream.
+ *
+ * @param handle
+ * @param data The slice, only valid during the call
+ * @param len The length of the slice. Empty values get one call with len 0.
+ * @param offset Where in the value the slice starts, 0 for the first slice of each value
+ * @param total The length of the whole value
+ * @param arg The argument given to #redis_stream
+ */
+typedef void (*redis_chunk_callback)(struct RedisHandle *handle, const char *data, size_t len, size_t offset, size_t total, void *arg);
+
+/**
+ * Called by a handle in streaming mode with each element of a reply which isn't a
+ * bulk value: integers (#REDIS_TYPE_INT), status and error lines (#REDIS_TYPE_STR),
+ * nil values (#REDIS_TYPE_RAW with a NULL ptr), and the start of each multi-bulk
+ * (#REDIS_TYPE_MULTIBULK with a NULL ptr, and integer set to its number of elements).
+ * See #redis_stream.
+ *
+ * @param handle
+ * @param depth How many multi-bulks the element is inside, 0 for the reply itself
+ * @param element The element, only valid during the call
+ * @param arg The argument given to #redis_stream
+ */
+typedef void (*redis_element_callback)(struct RedisHandle *handle, unsigned int depth, const struct Object *element, void *arg);
+
+/**
+ * Called with the result of a request queued by #redis_batch_get or #redis_batch_set.
+ *
+ * @param handle
+ * @param ret For a GET 1 if the key has a value, 0 if not. For a SET 0. Either way -1
+ *        if the request failed, see #redis_error.
+ * @param value The GET's value, only valid during the call. NULL unless ret is 1.
+ * @param arg The argument given with the request
+ */
+typedef void (*redis_batch_callback)(struct RedisHandle *handle, int ret, const struct Object *value, void *arg);
+
+#define REDIS_LATENCY_SUB_BITS 3  /** Each power of two is split into 2^REDIS_LATENCY_SUB_BITS latency buckets */
+#define REDIS_LATENCY_BUCKETS  (35 << REDIS_LATENCY_SUB_BITS) /** Enough buckets for round trips up to 2^37 ns (137 seconds) */
+
+/**
+ * Counters describing what a handle has done since it was created (or #redis_stats_reset).
+ * Times are in ns.
+ *
+ * Round trip times are kept in an HDR style histogram. Times below 8ns have a bucket
+ * each, and every power of two above that is split into 8 equal buckets, so each bucket
+ * is within 12.5% of the times it holds.
+ */
+struct RedisStats {
+	uint64_t sendCalls;       /** send() system calls */
+	uint64_t recvCalls;       /** recv() system calls */
+	uint64_t bytesSent;       /** Bytes written to the socket */
+	uint64_t bytesReceived;   /** Bytes read from the socket */
+
+	uint64_t commands;        /** Commands sent */
+	uint64_t replies;         /** Replies received */
+
+	uint64_t bufferReallocs;  /** Times the send or receive buffer was realloced */
+	uint64_t bufferMoves;     /** Times data was moved down the send or receive buffer to make room */
+
+	uint64_t cacheHits;       /** Lookups answered by the near cache */
+	uint64_t cacheMisses;     /** Lookups the near cache couldn't answer */
+	uint64_t cacheEvictions;  /** Entries dropped to stay within the cache's size */
+	uint64_t cacheInvalidations; /** Entries dropped because a command may have changed them */
+
+	uint64_t batches;         /** MGETs and MSETs sent for batched requests */
+	uint64_t batched;         /** Requests those carried */
+
+	uint64_t zerocopySends;   /** sendmsg() calls made with MSG_ZEROCOPY */
+	uint64_t zerocopyCopied;  /** Of those, how many the kernel copied anyway (such as over loopback) */
+
+	uint64_t uringEnters;     /** io_uring_enter() system calls, made instead of send() and recv() */
+
+	uint64_t untimed;         /** Commands not timed, because too many were waiting for replies */
+	uint64_t latencyCount;    /** Round trips timed */
+	uint64_t latencySum;      /** Total of the round trip times */
+	uint64_t latencyMax;      /** Longest round trip time */
+	uint64_t latency[REDIS_LATENCY_BUCKETS]; /** Histogram of round trip times */
+};
+
+/**
+ * @internal
+ * When a command waiting for its reply was sent.
+ */
+struct RedisSendTime {
+	uint64_t seq;             /** Which command this was, counting from 1 since connecting */
+	uint64_t time;            /** When it was sent, in ns */
+};
+
+#define REDIS_INTO_PENDING  -2 /** The reply has not been read yet */
+#define REDIS_INTO_ERROR    -1 /** The reply was not a value, such as an error */
+#define REDIS_INTO_NIL       0 /** The key has no value */
+#define REDIS_INTO_OK        1 /** The whole value was written */
+#define REDIS_INTO_TRUNCATED 2 /** Only the first cap bytes of the value were written, the rest was discarded */
+
+/**
+ * A caller's buffer which a GET's value is received straight into. See #redis_send_get_into.
+ */
+struct RedisInto {
+	char *dst;                /** Where the value is written */
+	size_t cap;               /** The size of dst */
+	size_t len;               /** Set to the length of the value, more than cap if it was truncated */
+	int status;               /** Set to one of the REDIS_INTO_ constants */
+};
+
+/**
+ * @internal
+ * A #RedisInto waiting for the reply to the command it was registered with.
+ */
+struct RedisIntoWait {
+	uint64_t seq;             /** Which command's reply it waits for, counting like RedisHandle::commandSeq */
+	struct RedisInto *into;
+};
+
+#define REDIS_MAX_SEND_REFS 8 /** The most large values one command is sent straight from, any more are copied */
+
+/**
+ * @internal
+ * A large value sent straight from the caller's memory, rather than copied into the send buffer.
+ */
+struct RedisSendRef {
+	size_t offset;            /** Where in the send buffer the value goes */
+	const char *ptr;
+	size_t len;
+};
+
+/**
+ * Socket options applied by #redis_connect and #redis_connect_unix. Start from
+ * #REDIS_CONNECT_OPTIONS_INIT, which is what handles use until told otherwise.
+ */
+struct RedisConnectOptions {
+	int noDelay;              /** Set TCP_NODELAY, so small commands aren't held back by Nagle's algorithm */
+	int sendBuffer;           /** SO_SNDBUF in bytes, 0 for the system default */
+	int recvBuffer;           /** SO_RCVBUF in bytes, 0 for the system default */
+	int busyPoll;             /** SO_BUSY_POLL in us, 0 to not busy poll */
+	int keepAlive;            /** Set SO_KEEPALIVE, so dead peers are noticed */
+	int keepIdle;             /** Seconds idle before the first keepalive probe, 0 for the system default */
+	int keepInterval;         /** Seconds between keepalive probes, 0 for the system default */
+	int keepCount;            /** Unanswered probes before the connection is dropped, 0 for the system default */
+};
+
+#define REDIS_CONNECT_OPTIONS_INIT {1, 0, 0, 0, 0, 0, 0, 0}
+
+struct MultiBulkState {
+	struct Reply *reply;      /** The multi-bulk reply being read, NULL when streaming */
+	unsigned int pos;         /** The next argument to be read */
+	unsigned int count;       /** How many arguments it has, when streaming */
+};
+
 struct RedisHandle {
 	SOCKET socket;
 	const char *lastErr;         /** Keeps track of the last err */
 
 	unsigned int state;          /** What state is this handle in */
 	struct Buffer buf;           /** Receive buffer to keep track of data between calls. */
+	size_t readLen;              /** How much each recv asks for, it doubles while recvs come back full */
+	unsigned int readShort;      /** How many recvs in a row came back mostly empty */
+	struct Buffer sendBuf;       /** Send buffer, each command is encoded here and then sent in one go */
+	struct RedisSendRef sendRefs[REDIS_MAX_SEND_REFS]; /** Large values sent from where they are, in order */
+	unsigned int sendRefCount;   /** How many sendRefs the command in sendBuf has */
+
+	size_t zerocopyThreshold;    /** Commands sending at least this much from sendRefs use MSG_ZEROCOPY, 0 never */
+	uint32_t zerocopySent;       /** MSG_ZEROCOPY sends made on this connection */
+	uint32_t zerocopyDone;       /** How many of those the kernel has finished with */
 
-	unsigned int replies;        /** Number of replies waiting (this may be less than the number of replies in the following linked list) */
-	struct Reply *reply;         /** List of replies */
-	struct Reply *lastReply;     /** The last reply we received (points to end of list) */
+	unsigned int replies;        /** Number of replies waiting (this may be one less than replyCount) */
+	struct Reply **replyRing;    /** Ring of replies, oldest first, followed by any reply still being read */
+	unsigned int replyHead;      /** Index of the oldest reply in replyRing */
+	unsigned int replyCount;     /** Number of replies in replyRing */
+	unsigned int replyCap;       /** Size of replyRing, always a power of two */
 
 	size_t linePos;              /** Keeps track of how far we have looked for the newline */
+	struct Object *bulk;         /** The object the current bulk reply is being read into */
+	size_t bulkPos;              /** How much of the current bulk reply has been received */
+	size_t bulkSkip;             /** How much of the current bulk reply is left to discard, as it didn't fit */
+
+	struct RedisIntoWait *intoRing; /** Ring of buffers waiting for replies, oldest first */
+	unsigned int intoHead;       /** Index of the oldest entry in intoRing */
+	unsigned int intoCount;      /** How many entries intoRing holds */
+	unsigned int intoCap;        /** The size of intoRing, a power of two */
+	struct RedisInto *into;      /** The buffer the current reply is being read into, if any */
+
+	unsigned int depth;          /** How many multi-bulk replies are being read (nested inside each other) */
+	struct MultiBulkState multi[REDIS_MAX_DEPTH]; /** Progress through each of the multi-bulk replies */
+
+	unsigned int pipelined;      /** Number of commands queued in sendBuf while pipelining */
+
+	redis_chunk_callback streamChunk;     /** Given bulk values in streaming mode, see #redis_stream */
+	redis_element_callback streamElement; /** Given other elements in streaming mode */
+	void *streamArg;             /** Passed to streamChunk and streamElement */
+	size_t streamLen;            /** The length of the bulk value being streamed */
+	size_t streamPos;            /** How much of it has been handed over */
+
+	const struct RedisAllocator *allocator; /** Allocates the replies, NULL for malloc */
+	struct RedisArena *arena;    /** The handle's own slab allocator, if #redis_use_arena was called */
+	struct RedisCache *cache;    /** The near cache, if #redis_use_cache was called */
+	struct RedisBatch *batch;    /** Requests waiting to be batched, if #redis_use_batching was called */
+	struct RedisUring *uring;    /** The io_uring transport, if #redis_use_uring was called */
+
+	struct RedisStats stats;     /** Counters, see #redis_stats */
+	struct RedisSendTime *sendTimes; /** Ring of when each command waiting for a reply was sent */
+	unsigned int sendTimesHead;  /** The oldest entry in sendTimes */
+	unsigned int sendTimesCount; /** How many entries sendTimes holds */
+	unsigned int sendTimesCap;   /** The size of sendTimes, a power of two */
+	uint64_t commandSeq;         /** Commands sent since connecting */
+	uint64_t replySeq;           /** Replies received since connecting */
+
+	struct RedisConnectOptions options; /** Applied to each new connection */
+
+	struct RedisLoop *loop;      /** The loop driving this handle, if any */
+	redis_loop_callback loopCallback; /** Called by the loop when replies are waiting */
+	void *loopArg;               /** Passed to loopCallback */
+	struct RedisHandle *loopBatchNext; /** The next handle in the loop with requests waiting to be batched */
 
 	unsigned int socketOwned :1; /** Did we create this socket? */
+	unsigned int pipeline    :1; /** Are commands being queued instead of sent? */
+	unsigned int nonblocking :1; /** Is the socket non-blocking? */
+	unsigned int loopWrite   :1; /** Is the loop waiting for the socket to become writable? */
+	unsigned int loopBatched :1; /** Is the handle in the loop's list of handles with batched requests? */
+	unsigned int streaming   :1; /** Are replies handed to the stream callbacks, from the next one on? */
+	unsigned int streamBulk  :1; /** Is a bulk value being streamed? */
+	unsigned int selected    :1; /** Has a SELECT been sent since connecting, so the database may not be 0? */
+	unsigned int failed      :1; /** Has the connection failed (or got out of step), so it can't be used? */
 };
 
-#define REDIS_STR(x)     {(char *)(x), strlen(x), REDIS_TYPE_STR, 0}
-#define REDIS_RAW(x,len) {(char *)(x), (len),     REDIS_TYPE_RAW, 0}
-#define REDIS_INT(x)     {(char *)(x), 0,         REDIS_TYPE_INT, 0}
-#define REDIS_NIL()      {NULL, 0,                REDIS_TYPE_RAW, 0}
+#define REDIS_STR(x)     {(char *)(x), strlen(x), REDIS_TYPE_STR, 0, 0}
+#define REDIS_RAW(x,len) {(char *)(x), (len),     REDIS_TYPE_RAW, 0, 0}
+#define REDIS_INT(x)     {NULL, 0,                REDIS_TYPE_INT, 0, (x)}
+#define REDIS_NIL()      {NULL, 0,                REDIS_TYPE_RAW, 0, 0}
+#define REDIS_ARG(type)  {NULL, 0,                REDIS_TYPE_ARG, 0, (type)}
 
 /**
  * Creates a new handle to connect to a Redis server. This handle will be passed to most
@@ -96,6 +340,37 @@ const char * redis_error(struct RedisHandle * handle);
  */
 int redis_connect(struct RedisHandle * handle, const char *host, unsigned short port);
 
+/**
+ * Connects to a Redis Server listening on a Unix domain socket.
+ *
+ * @param handle
+ * @param path The socket's path.
+ *
+ * @return  0 on success.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_connect_unix(struct RedisHandle * handle, const char *path);
+
+/**
+ * Sets the socket options used by future calls to #redis_connect and #redis_connect_unix.
+ * Options which only make sense for TCP are not applied to Unix domain sockets.
+ *
+ * @param handle
+ * @param options The options, which are copied.
+ */
+void redis_set_connect_options(struct RedisHandle * handle, const struct RedisConnectOptions *options);
+
+/**
+ * Returns if the handle's connection has failed. This happens when sending or receiving
+ * fails, the server closes the connection, or a reply can't be parsed. The handle can't
+ * be used again until it is reconnected.
+ *
+ * @param handle
+ *
+ * @return 1 if the connection has failed, otherwise 0.
+ */
+int redis_failed(struct RedisHandle * handle);
+
 /**
  * Returns the socket used to connect to the Redis Server.
  *
@@ -108,6 +383,74 @@ SOCKET redis_get_socket(struct RedisHandle * handle);
 
 int redis_use_socket(struct RedisHandle * handle, SOCKET s);
 
+/**
+ * Puts the handle's socket in (or takes it out of) non-blocking mode. This also applies
+ * to sockets later connected, or given to #redis_use_socket.
+ *
+ * When non-blocking #redis_read returns straight away if there is nothing to read, and the
+ * redis_send functions send what they can, leaving the rest of the command queued on the
+ * handle. Queued data is sent by #redis_flush, or by the #RedisLoop driving the handle.
+ * #redis_pipeline_flush only sends, the replies are collected by later #redis_read calls.
+ *
+ * @param handle
+ * @param nonblocking 1 for non-blocking, 0 for blocking.
+ *
+ * @return  0 on success.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_set_nonblocking(struct RedisHandle * handle, int nonblocking);
+
+/**
+ * Makes all future replies on this handle, and their arguments' data, be allocated with a.
+ * Any arena created by #redis_use_arena stops being used.
+ *
+ * @param handle
+ * @param a The allocator, which must outlive every reply allocated with it. NULL for malloc.
+ */
+void redis_set_allocator(struct RedisHandle * handle, const struct RedisAllocator *a);
+
+/**
+ * Makes all future replies on this handle come from a per-handle slab allocator. Reply
+ * headers and small arguments are then recycled through free lists when the reply is
+ * freed, instead of going back to malloc. Larger arguments still use malloc.
+ *
+ * Replies from the arena may outlive the handle, but must be freed from the thread
+ * using the handle.
+ *
+ * @param handle
+ *
+ * @return  0 on success.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_use_arena(struct RedisHandle * handle);
+
+/**
+ * Gives the handle a near cache, which answers #redis_get and #redis_exists for
+ * recently read keys without a round trip. Entries are kept for at most ttl ms, and
+ * the least recently used are evicted to keep the cache within maxBytes.
+ *
+ * Any command sent through the handle which may write to a cached key drops it (or,
+ * for commands like FLUSHDB which may write to any key, empties the cache). Writes
+ * made by other clients are not seen, so ttl bounds how stale an answer can be.
+ * Reconnecting also empties the cache.
+ *
+ * @param handle
+ * @param maxBytes The most memory the entries may use, 0 to remove the cache.
+ * @param ttl How long entries are used for, in ms, 0 for as long as they are cached.
+ *
+ * @return  0 on success.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_use_cache(struct RedisHandle * handle, size_t maxBytes, unsigned int ttl);
+
+/**
+ * Empties the handle's near cache, for example after learning another client has
+ * changed keys.
+ *
+ * @param handle
+ */
+void redis_cache_clear(struct RedisHandle * handle);
+
 /*
  * Object
  */
@@ -117,6 +460,13 @@ struct Object * redis_object_alloc_copy(const char *buf, size_t buflen);
 struct Object * redis_object_init(struct Object *o, size_t buflen);
 struct Object * redis_object_init_copy(struct Object * o, const char *buf, size_t buflen);
 
+/**
+ * As #redis_object_init and #redis_object_init_copy, but the data comes from a.
+ * The object must then be cleaned up with #redis_object_cleanup_with.
+ */
+struct Object * redis_object_init_with(const struct RedisAllocator *a, struct Object *o, size_t buflen);
+struct Object * redis_object_init_copy_with(const struct RedisAllocator *a, struct Object * o, const char *buf, size_t buflen);
+
 /**
  * Cleanup any memory used internally by the object.
  * Use this function if you created the #Object and used #redis_object_init
@@ -125,6 +475,14 @@ struct Object * redis_object_init_copy(struct Object * o, const char *buf, size_
  */
 void redis_object_cleanup( struct Object * o );
 
+/**
+ * Cleanup any memory used internally by an object created with #redis_object_init_with.
+ *
+ * @param a The allocator the object's data came from
+ * @param o
+ */
+void redis_object_cleanup_with( const struct RedisAllocator *a, struct Object * o );
+
 /**
  * Cleanup any memory used by the object, and free the #Object's memory.
  * Use this function if the #Object was created with #redis_object_alloc
@@ -184,63 +542,900 @@ int redis_send_bulk(struct RedisHandle *handle, const int argc, const struct Obj
  */
 int redis_send(struct RedisHandle *handle, const int argc, const struct Object argv[] );
 
-/*
- * Recv
+struct RedisPrepared;
+
+/**
+ * Encodes a command template ahead of time, so the same shape of command can be sent
+ * over and over by #redis_send_prepared without re-encoding its fixed arguments.
+ *
+ * Arguments made with #REDIS_ARG are placeholders, filled in on each send. Their type
+ * says what they accept: #REDIS_TYPE_INT only accepts integers, #REDIS_TYPE_STR or
+ * #REDIS_TYPE_RAW accept any string, and #REDIS_TYPE_UNKNOWN accepts anything.
+ * For example { REDIS_STR("HINCRBY"), REDIS_ARG(REDIS_TYPE_RAW), REDIS_ARG(REDIS_TYPE_RAW), REDIS_INT(1) }
+ *
+ * Prepared commands are always sent multi bulk encoded, and may be shared between handles.
+ *
+ * @param argc The number of arguments stored in argv.
+ * @param argv The template.
+ *
+ * @return A new #RedisPrepared, which must be freed with #redis_prepared_free.
+ * @return NULL on failure.
  */
+struct RedisPrepared * redis_prepare(const int argc, const struct Object argv[]);
 
-int redis_read(struct RedisHandle * handle);
+/**
+ * Frees a command prepared by #redis_prepare.
+ *
+ * @param prepared
+ */
+void redis_prepared_free(struct RedisPrepared *prepared);
 
-/*
- * Reply
+/**
+ * Sends a prepared command, filling its placeholders in order from argv.
+ *
+ * @param handle
+ * @param prepared
+ * @param argv One #Object for each of the template's placeholders.
+ *
+ * @return  0 on success
+ * @return -1 on failure. Use #redis_error to determine the error
  */
+int redis_send_prepared(struct RedisHandle *handle, const struct RedisPrepared *prepared, const struct Object argv[]);
 
 /**
- * Creates a new Reply with argc responses.
+ * Starts pipelining commands. Until #redis_pipeline_flush is called, the redis_send
+ * functions only encode their command into the handle's send buffer, and nothing is
+ * written to the socket.
  *
- * @param argc Number of responses to attach to the reply
+ * @param handle
  *
- * @return The new reply, or NULL on error.
+ * @return  0 on success
+ * @return -1 on failure. Use #redis_error to determine the error
+ *
+ * @see redis_pipeline_flush
  */
-struct Reply * redis_reply_alloc(int argc);
+int redis_pipeline_begin(struct RedisHandle *handle);
 
 /**
- * Retrieves a #Reply from the #RedisHandle.
+ * Sends all the commands queued since #redis_pipeline_begin in one batch, ends
+ * pipelining, and then reads until a reply for each of them is waiting on the handle.
+ * The replies can then be retrieved in order with #redis_reply_pop.
  *
  * @param handle
  *
- * @return A new #Reply
- * @return NULL if there are no queued #Reply s.
+ * @return The number of replies waiting
+ * @return -1 on failure. Use #redis_error to determine the error
+ *
+ * @see redis_pipeline_begin
  */
-struct Reply * redis_reply_pop(struct RedisHandle * handle);
+int redis_pipeline_flush(struct RedisHandle *handle);
 
 /**
- * Pushes the #Reply onto the end of list of replies, BUT don't increment
- * the count of replies. This allows us to store the reply while we are
- * working on it.
+ * Sends any data queued on a non-blocking handle, which the socket would not take earlier.
+ * Blocking handles never have queued data (unless pipelining).
  *
  * @param handle
- * @param reply
+ *
+ * @return  0 when everything has been sent
+ * @return  1 if the socket would block, and some data is still queued
+ * @return -1 on failure. Use #redis_error to determine the error
  */
-void redis_reply_temp_push(struct RedisHandle * handle, struct Reply *reply);
+int redis_flush(struct RedisHandle *handle);
 
 /**
- * We have now finished creating the reply, so increment the count of replies.
+ * Sends large values with MSG_ZEROCOPY, so the kernel transmits them straight from the
+ * caller's memory instead of copying them.
+ *
+ * A blocking handle which isn't pipelining always sends bulk values of at least 16 KB
+ * straight from the caller's memory, gathering them with the rest of the command into
+ * one sendmsg(). That is every argument of #redis_send_multibulk and the typed
+ * helpers, and the last argument of #redis_send_bulk; #redis_send's inline arguments
+ * are always copied. Normally the value can be reused as soon as the send returns. Once a
+ * command sends threshold bytes or more this way, it is sent with MSG_ZEROCOPY, and the
+ * value must be left untouched until the kernel has finished with it: take a ticket
+ * with #redis_zerocopy_ticket after sending, then wait for it with #redis_zerocopy_wait.
+ *
+ * Tickets are per connection, so wait for them before reconnecting. Over loopback the
+ * kernel copies the data anyway, which #RedisStats::zerocopyCopied counts.
+ *
+ * @param handle A connected TCP handle
+ * @param threshold The fewest bytes worth sending with MSG_ZEROCOPY, 0 to stop using it.
+ *
+ * @return  0 on success.
+ * @return -1 on failure, such as the socket not supporting it. Use #redis_error to
+ *          determine the error
+ */
+int redis_use_zerocopy(struct RedisHandle *handle, size_t threshold);
+
+/**
+ * @return A ticket covering every command sent with MSG_ZEROCOPY so far. Their values
+ *         may be reused once #redis_zerocopy_wait says the ticket is done.
+ */
+uint32_t redis_zerocopy_ticket(const struct RedisHandle *handle);
+
+/**
+ * Collects the kernel's notifications of which MSG_ZEROCOPY sends it has finished
+ * with, waiting up to timeout ms for the ticket to be done.
+ *
+ * @param handle
+ * @param ticket From #redis_zerocopy_ticket
+ * @param timeout How long to wait in milliseconds, 0 to only check, or -1 to wait forever.
+ *
+ * @return  1 if the ticket is done, so the values it covers may be reused.
+ * @return  0 if it isn't yet.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_zerocopy_wait(struct RedisHandle *handle, uint32_t ticket, int timeout);
+
+/**
+ * Sends and receives through io_uring instead of send() and recv(). A multishot receive
+ * stays armed on the socket, so replies land in buffers registered with the kernel
+ * without a system call each, and are copied out as they are parsed. Writes are queued
+ * rather than sent straight away, and submitted together, along with the wait for the
+ * reply, by a single io_uring_enter() once the handle next needs to read. Use
+ * #redis_flush to make sure everything has been written without reading.
+ *
+ * Large values are copied into the send buffer rather than sent from the caller's
+ * memory, so #redis_use_zerocopy has no effect. The handle must stay blocking.
+ *
+ * io_uring stays in use until the handle is reconnected. It needs Linux 6.0 or later;
+ * if the kernel lacks it (or it is disabled) this fails, and the handle carries on
+ * with send() and recv().
+ *
+ * @param handle A connected, blocking handle, which may be pipelining
+ * @param buffers How many 16 KB receive buffers to register, 0 for the default 16
+ *
+ * @return  0 on success.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_use_uring(struct RedisHandle *handle, unsigned int buffers);
+
+/*
+ * Recv
+ */
+
+int redis_read(struct RedisHandle * handle);
+
+/**
+ * Puts the handle in streaming mode, so replies are handed to callbacks as they are
+ * parsed rather than built up in memory. Bulk values are given to chunk in slices as
+ * big as each recv, and everything else to element, after which it is discarded. The
+ * client's memory use then stays bounded however big the reply.
+ *
+ * Each streamed reply still counts as a reply once all of it has been handed over,
+ * and leaves an empty #Reply (with argc 0) to be popped, so #redis_read and pipelining
+ * work as normal.
+ *
+ * The change takes effect from the next reply to start arriving.
+ *
  * @param handle
+ * @param chunk Given the bulk values, or NULL to ignore them
+ * @param element Given the other elements, or NULL to ignore them
+ * @param arg Passed to chunk and element
+ *
+ * @see redis_stream_end
  */
-void redis_reply_push(struct RedisHandle * handle);
+void redis_stream(struct RedisHandle * handle, redis_chunk_callback chunk, redis_element_callback element, void *arg);
 
 /**
- * Frees a reply that was created with #redis_reply_alloc
+ * Takes the handle out of streaming mode, from the next reply to start arriving.
  *
- * @param reply
+ * @param handle
+ */
+void redis_stream_end(struct RedisHandle * handle);
+
+/*
+ * Loop
  */
-void redis_reply_free(struct Reply *reply);
 
 /**
- * Prints the reply and all its arguments to stdout.
+ * Creates an epoll based loop, which lets one thread drive many non-blocking handles.
  *
- * @param reply
+ * @return A new #RedisLoop
+ * @return NULL if an error occurred.
  */
-void redis_reply_print(const struct Reply *reply);
+struct RedisLoop * redis_loop_alloc(void);
+
+/**
+ * Frees the loop. Handles should be removed with #redis_loop_remove first if they
+ * are going to be used again.
+ *
+ * @param loop
+ */
+void redis_loop_free(struct RedisLoop *loop);
+
+/**
+ * Adds a connected handle to the loop, making it non-blocking. From now on the loop
+ * reads from it, sends any queued commands, and calls cb when replies are waiting.
+ *
+ * @param loop
+ * @param handle
+ * @param cb Called when handle has replies waiting (it should pop them), or has failed.
+ * @param arg Passed to cb
+ *
+ * @return  0 on success.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_loop_add(struct RedisLoop *loop, struct RedisHandle *handle, redis_loop_callback cb, void *arg);
+
+/**
+ * Removes a handle from the loop. The handle stays non-blocking.
+ *
+ * @param loop
+ * @param handle
+ *
+ * @return  0 on success.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_loop_remove(struct RedisLoop *loop, struct RedisHandle *handle);
+
+/**
+ * Waits for any of the loop's handles to become readable (or writable, if they have
+ * queued data), and services only those handles.
+ *
+ * @param loop
+ * @param timeout How long to wait in milliseconds, or -1 to wait forever.
+ *
+ * @return The number of handles serviced (0 on timeout)
+ * @return -1 on failure.
+ */
+int redis_loop_run_once(struct RedisLoop *loop, int timeout);
+
+/*
+ * Batching
+ */
+
+/**
+ * Makes the handle coalesce single key GETs and SETs into MGETs and MSETs. Requests
+ * queued by #redis_batch_get and #redis_batch_set are held until maxRequests are
+ * queued, window us have passed since the first, a request of the other kind is
+ * queued, or any other command is sent. They are then sent as one command, and each
+ * request's callback is given its own result when the reply arrives.
+ *
+ * A handle in a #RedisLoop also has its held requests sent by the loop once the window
+ * has passed, or on its next iteration if window is 0. The loop hands the replies to
+ * the callbacks before calling the handle's own callback, which only sees replies to
+ * other commands. Without a loop, use #redis_batch_flush and #redis_batch_dispatch, or
+ * #redis_batch_wait. The typed command helpers, like #redis_get, also call the
+ * callbacks of any batched requests answered ahead of their own reply.
+ *
+ * @param handle
+ * @param maxRequests The most requests sent in one command, 0 to stop batching.
+ * @param window The longest a request is held, in us.
+ *
+ * @return  0 on success.
+ * @return -1 on failure, including if requests are still waiting. Use #redis_error to
+ *          determine the error
+ */
+int redis_use_batching(struct RedisHandle * handle, unsigned int maxRequests, unsigned int window);
+
+/**
+ * Queues a GET of key, copying the key. cb is called with the value once the MGET
+ * carrying it is answered.
+ *
+ * @return  0 once the request is queued. If sending it fails later, cb is given -1.
+ * @return -1 if it couldn't be queued, in which case cb is not called. Use #redis_error
+ *          to determine the error
+ */
+int redis_batch_get(struct RedisHandle * handle, const char *key, size_t len, redis_batch_callback cb, void *arg);
+
+/**
+ * Queues a SET of key to value, copying both. cb is called once the MSET carrying it
+ * is answered.
+ *
+ * @return  0 once the request is queued. If sending it fails later, cb is given -1.
+ * @return -1 if it couldn't be queued, in which case cb is not called. Use #redis_error
+ *          to determine the error
+ */
+int redis_batch_set(struct RedisHandle * handle, const char *key, size_t len, const char *value, size_t valueLen, redis_batch_callback cb, void *arg);
+
+/**
+ * Sends the queued requests now, as one MGET or MSET.
+ *
+ * @return  0 on success.
+ * @return -1 on failure, in which case the requests' callbacks have been given -1.
+ *          Use #redis_error to determine the error
+ */
+int redis_batch_flush(struct RedisHandle * handle);
+
+/**
+ * Pops the waiting replies to batched requests and calls their callbacks. This stops
+ * at a reply to any other command, which must be popped by the caller first.
+ *
+ * @return The number of callbacks called.
+ * @return -1 if the connection has failed, in which case every request waiting for a
+ *          reply has been given -1.
+ */
+int redis_batch_dispatch(struct RedisHandle * handle);
+
+/**
+ * For blocking handles. Sends the queued requests, then reads until every batched
+ * request has had its callback called.
+ *
+ * @return The number of callbacks called.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_batch_wait(struct RedisHandle * handle);
+
+/*
+ * Pool
+ */
+
+struct RedisPool;
+
+/**
+ * Counters describing how busy a #RedisPool is, to help size it. Times are in ns.
+ * The average utilization is busyTime / (size * elapsed).
+ */
+struct RedisPoolStats {
+	unsigned int size;        /** How many handles the pool holds */
+	unsigned int idle;        /** Handles connected and waiting to be checked out */
+	unsigned int inUse;       /** Handles currently checked out */
+	unsigned int inUseMax;    /** The most handles ever checked out at once */
+
+	uint64_t checkouts;       /** Successful checkouts */
+	uint64_t waits;           /** Checkouts which had to wait for a handle */
+	uint64_t timeouts;        /** Checkouts which gave up without a handle */
+	uint64_t waitTime;        /** Total time spent waiting for a handle */
+	uint64_t waitTimeMax;     /** Longest time spent waiting for a handle */
+
+	uint64_t discarded;       /** Handles checked in unfit for reuse (see #redis_pool_checkin), and thrown away */
+	uint64_t reconnects;      /** Handles connected to replace discarded ones */
+	uint64_t connectFailures; /** Failed attempts to replace discarded handles */
+
+	uint64_t busyTime;        /** inUse integrated over time */
+	uint64_t elapsed;         /** Time since the pool was created */
+};
+
+/**
+ * Creates a pool of size handles, all connected to the same server, which can be shared
+ * between threads. Every handle is connected before this returns.
+ *
+ * @param host Server's hostname. If NULL localhost is used.
+ * @param port Server's port. If 0 the default 6379 is used.
+ * @param size How many handles (connections) the pool holds.
+ *
+ * @return A new #RedisPool
+ * @return NULL if an error occurred, including failing to connect any of the handles.
+ */
+struct RedisPool * redis_pool_alloc(const char *host, unsigned short port, unsigned int size);
+
+/**
+ * Frees the pool and all the handles checked in to it. Handles which are still
+ * checked out must be freed by their owners with #redis_free.
+ *
+ * @param pool
+ */
+void redis_pool_free(struct RedisPool *pool);
+
+/**
+ * Takes a handle out of the pool for the calling thread's exclusive use. If every handle
+ * is checked out, this waits for one to be checked in. If a handle was previously
+ * discarded, a new one is connected to replace it.
+ *
+ * @param pool
+ * @param timeout How long to wait in milliseconds, 0 to not wait, or -1 to wait forever.
+ *
+ * @return The handle, which must be given back with #redis_pool_checkin.
+ * @return NULL if no handle became available in time, or connecting a new one failed.
+ */
+struct RedisHandle * redis_pool_checkout(struct RedisPool *pool, int timeout);
+
+/**
+ * Gives a handle back to the pool. If its connection has failed (see #redis_failed), it
+ * still has replies, unparsed data, queued commands or commands waiting for replies,
+ * or it was switched into a mode the next caller won't expect (batching, streaming,
+ * non-blocking, a near cache, io_uring, a loop, another database with SELECT, or its
+ * own allocator or arena), it is freed instead of being reused.
+ *
+ * @param pool
+ * @param handle A handle from #redis_pool_checkout
+ */
+void redis_pool_checkin(struct RedisPool *pool, struct RedisHandle *handle);
+
+/**
+ * Copies the pool's counters.
+ *
+ * @param pool
+ * @param stats Filled in with the counters
+ */
+void redis_pool_stats(struct RedisPool *pool, struct RedisPoolStats *stats);
+
+/*
+ * Threaded client
+ *
+ * A single connection shared by any number of threads. Commands are encoded by the
+ * thread submitting them and queued on a lock-free ring, and one I/O thread owns the
+ * handle: it writes everything queued since its last write in one go, parses the
+ * replies, and completes each command's #RedisFuture.
+ */
+
+struct RedisThread;
+
+#define REDIS_FUTURE_PENDING 0 /** The reply has not arrived yet */
+#define REDIS_FUTURE_DONE    1 /** The reply arrived, and is in reply */
+#define REDIS_FUTURE_ERROR   2 /** There will be no reply, as the connection failed or the thread was freed */
+
+/**
+ * A command submitted to a #RedisThread, and later its reply. Futures belong to the
+ * submitting thread, and can be reused once they are no longer pending, which saves
+ * encoding each command into newly allocated memory.
+ */
+struct RedisFuture {
+	struct Reply *reply;      /** The reply once done, which the caller must free with #redis_reply_free */
+	int state;                /** Changed by the I/O thread, use #redis_future_wait to read it */
+
+	struct Buffer cmd;        /** @internal The encoded command */
+	struct RedisFuture *next; /** @internal The next future waiting for a reply on the I/O thread */
+};
+
+/**
+ * Connects to the server and starts the I/O thread which drives the connection.
+ *
+ * @param host Server's hostname. If NULL localhost is used.
+ * @param port Server's port. If 0 the default 6379 is used.
+ * @param queueSize How many commands can be queued for the I/O thread at once, rounded
+ *        up to a power of two. Submitting waits while the queue is full.
+ *
+ * @return A new #RedisThread
+ * @return NULL if an error occurred, including failing to connect.
+ */
+struct RedisThread * redis_thread_alloc(const char *host, unsigned short port, unsigned int queueSize);
+
+/**
+ * Stops the I/O thread, and frees it along with its connection. Futures still pending
+ * are completed with #REDIS_FUTURE_ERROR. Nothing may be submitted while, or after,
+ * this is called.
+ *
+ * @param thread
+ */
+void redis_thread_free(struct RedisThread *thread);
+
+/**
+ * Encodes a multi-bulk command and queues it for the I/O thread to send. May be called
+ * from any number of threads at once.
+ *
+ * @param thread
+ * @param future Initialised with #redis_future_init, and not pending
+ * @param argc
+ * @param argv
+ *
+ * @return  0 on success, after which the future is pending.
+ * @return -1 if the command could not be encoded, or the connection has failed (see
+ *         #redis_thread_failed). The future is left as it was.
+ */
+int redis_thread_submit(struct RedisThread *thread, struct RedisFuture *future, const int argc, const struct Object argv[]);
+
+/**
+ * @return 1 if the thread's connection has failed, after which every command is completed
+ *         with #REDIS_FUTURE_ERROR, otherwise 0.
+ */
+int redis_thread_failed(struct RedisThread *thread);
+
+/**
+ * Copies the counters of the thread's handle.
+ *
+ * @param thread
+ * @param stats Filled in with the counters
+ */
+void redis_thread_stats(struct RedisThread *thread, struct RedisStats *stats);
+
+/**
+ * Initialises a future so it can be submitted.
+ *
+ * @param future
+ *
+ * @return NULL on failure.
+ * @return Otherwise the future parameter.
+ */
+struct RedisFuture * redis_future_init(struct RedisFuture *future);
+
+/**
+ * Frees the future's encoded command, and its reply if one was left in it. The future
+ * must not be pending.
+ *
+ * @param future
+ */
+void redis_future_cleanup(struct RedisFuture *future);
+
+/**
+ * Waits for a submitted command's reply. Only the thread which submitted the command
+ * should wait for it.
+ *
+ * @param future
+ * @param timeout How long to wait in milliseconds, 0 to not wait, or -1 to wait forever.
+ *
+ * @return #REDIS_FUTURE_DONE once future->reply holds the reply, #REDIS_FUTURE_ERROR if
+ *         there will be no reply, or #REDIS_FUTURE_PENDING if the timeout passed first.
+ */
+int redis_future_wait(struct RedisFuture *future, int timeout);
+
+/*
+ * Stats
+ */
+
+/**
+ * Copies the handle's counters.
+ *
+ * @param handle
+ * @param stats Filled in with the counters
+ */
+void redis_stats(struct RedisHandle *handle, struct RedisStats *stats);
+
+/**
+ * Sets all the handle's counters back to zero.
+ *
+ * @param handle
+ */
+void redis_stats_reset(struct RedisHandle *handle);
+
+/**
+ * Finds a percentile of the round trip times.
+ *
+ * @param stats
+ * @param percentile Between 0 and 100
+ *
+ * @return The highest time (in ns) in the histogram bucket holding the percentile,
+ *         or the longest time seen if that is lower
+ * @return 0 if no round trips have been timed
+ */
+uint64_t redis_stats_percentile(const struct RedisStats *stats, double percentile);
+
+/**
+ * Formats the counters in the Prometheus text exposition format. Metric names start
+ * with redis_c_, and the round trip histogram is reported with a bucket per power of
+ * two nanoseconds between 2^10ns (1.024us) and 2^36ns (about 68.7s).
+ *
+ * @param stats
+ * @param labels Added to every metric, for example "handle=\"cache\"". May be NULL.
+ * @param buf Where the text is written, always NUL terminated if size is not 0
+ * @param size The size of buf
+ *
+ * @return The length of the text, not including the NUL. If this is size or more,
+ *         the text was truncated, as with snprintf.
+ */
+size_t redis_stats_prometheus(const struct RedisStats *stats, const char *labels, char *buf, size_t size);
+
+/*
+ * Reply
+ */
+
+/**
+ * Creates a new Reply with argc responses.
+ *
+ * @param argc Number of responses to attach to the reply
+ *
+ * @return The new reply, or NULL on error.
+ */
+struct Reply * redis_reply_alloc(int argc);
+
+/**
+ * Creates a new Reply with argc responses, using the allocator a.
+ *
+ * @param a The allocator, or NULL for malloc
+ * @param argc Number of responses to attach to the reply
+ *
+ * @return The new reply, or NULL on error.
+ */
+struct Reply * redis_reply_alloc_with(const struct RedisAllocator *a, int argc);
+
+/**
+ * Retrieves a #Reply from the #RedisHandle.
+ *
+ * @param handle
+ *
+ * @return A new #Reply
+ * @return NULL if there are no queued #Reply s.
+ */
+struct Reply * redis_reply_pop(struct RedisHandle * handle);
+
+/**
+ * Retrieves up to n waiting replies from the #RedisHandle in one call, oldest first.
+ * Each must later be freed, for example with #redis_reply_free_many.
+ *
+ * @param handle
+ * @param replies Filled in with the replies
+ * @param n The most replies to retrieve
+ *
+ * @return The number of replies retrieved, 0 if none were waiting.
+ */
+unsigned int redis_reply_pop_many(struct RedisHandle * handle, struct Reply *replies[], unsigned int n);
+
+/**
+ * Pushes the #Reply onto the end of the handle's replies, BUT don't increment
+ * the count of replies. This allows us to store the reply while we are
+ * working on it. Any earlier reply which was never finished is freed.
+ *
+ * @param handle
+ * @param reply
+ *
+ * @return  0 on success.
+ * @return -1 on failure, in which case the reply is still the caller's.
+ */
+int redis_reply_temp_push(struct RedisHandle * handle, struct Reply *reply);
+
+/**
+ * We have now finished creating the reply, so increment the count of replies.
+ * @param handle
+ */
+void redis_reply_push(struct RedisHandle * handle);
+
+/**
+ * Frees a reply that was created with #redis_reply_alloc
+ *
+ * @param reply
+ */
+void redis_reply_free(struct Reply *reply);
+
+/**
+ * Frees n replies, as returned by #redis_reply_pop_many.
+ *
+ * @param replies
+ * @param n
+ */
+void redis_reply_free_many(struct Reply *replies[], unsigned int n);
+
+/**
+ * Prints the reply and all its arguments to stdout.
+ *
+ * @param reply
+ */
+void redis_reply_print(const struct Reply *reply);
+
+/*
+ * Commands
+ *
+ * Typed helpers for common commands. Each sends its command, waits for the reply
+ * and decodes it, so none of them can be used while pipelining or on a
+ * non-blocking handle. An error reply from the server fails the call.
+ */
+
+#define REDIS_KEY_NONE   0 /** The key does not exist */
+#define REDIS_KEY_STRING 1
+#define REDIS_KEY_LIST   2
+#define REDIS_KEY_SET    3
+#define REDIS_KEY_ZSET   4
+#define REDIS_KEY_HASH   5
+#define REDIS_KEY_STREAM 6
+
+/**
+ * DEL key [key ...]
+ *
+ * @param handle
+ * @param n The number of keys
+ * @param keys The keys to delete
+ *
+ * @return The number of keys deleted.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_del(struct RedisHandle * handle, const unsigned int n, const struct Object keys[]);
+
+/**
+ * EXISTS key, answered by the near cache if the key is in it.
+ *
+ * @param handle
+ * @param key
+ * @param len The length of the key
+ *
+ * @return  1 if the key exists, 0 if not.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_exists(struct RedisHandle * handle, const char *key, size_t len);
+
+/**
+ * TYPE key
+ *
+ * @return The type of the value stored at key, one of the REDIS_KEY_ constants.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_type(struct RedisHandle * handle, const char *key, size_t len);
+
+/**
+ * KEYS pattern
+ *
+ * @param handle
+ * @param pattern The glob-style pattern to match
+ * @param len The length of the pattern
+ * @param keys Set to a reply holding the matching keys, one RAW object each in argv,
+ *        which must be freed with #redis_reply_free. Untouched on failure.
+ *
+ * @return The number of keys matched.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_keys(struct RedisHandle * handle, const char *pattern, size_t len, struct Reply **keys);
+
+/**
+ * RANDOMKEY
+ *
+ * @param handle
+ * @param key Set to a copy of a random key, which must be freed with #redis_object_cleanup.
+ *        Untouched if the database is empty.
+ *
+ * @return  1 if a key was returned, 0 if the database is empty.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_randomkey(struct RedisHandle * handle, struct Object *key);
+
+/**
+ * RENAME key newkey, replacing newkey if it already exists.
+ *
+ * @return  0 on success.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_rename(struct RedisHandle * handle, const char *key, size_t len, const char *newkey, size_t newlen);
+
+/**
+ * RENAMENX key newkey, only if newkey does not already exist.
+ *
+ * @return  1 if the key was renamed, 0 if newkey already exists.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_renamenx(struct RedisHandle * handle, const char *key, size_t len, const char *newkey, size_t newlen);
+
+/**
+ * EXPIRE key seconds
+ *
+ * @return  1 if the timeout was set, 0 if the key does not exist.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_expire(struct RedisHandle * handle, const char *key, size_t len, int64_t seconds);
+
+/**
+ * PERSIST key, removing its timeout.
+ *
+ * @return  1 if the timeout was removed, 0 if the key does not exist or has no timeout.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_persist(struct RedisHandle * handle, const char *key, size_t len);
+
+/**
+ * TTL key
+ *
+ * @param seconds Set to the time to live, -1 if the key has no timeout, or -2 if
+ *        it does not exist.
+ *
+ * @return  0 on success.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_ttl(struct RedisHandle * handle, const char *key, size_t len, int64_t *seconds);
+
+/**
+ * SELECT index. This empties the near cache, if the handle has one.
+ *
+ * @return  0 on success.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_select(struct RedisHandle * handle, unsigned int db);
+
+/**
+ * MOVE key db, from the selected database to db.
+ *
+ * @return  1 if the key was moved, 0 if it does not exist or db already has it.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_move(struct RedisHandle * handle, const char *key, size_t len, unsigned int db);
+
+/**
+ * DBSIZE
+ *
+ * @param size Set to the number of keys in the selected database
+ *
+ * @return  0 on success.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_dbsize(struct RedisHandle * handle, int64_t *size);
+
+/**
+ * FLUSHDB, removing all the keys of the selected database.
+ *
+ * @return  0 on success.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_flushdb(struct RedisHandle * handle);
+
+/**
+ * FLUSHALL, removing all the keys of every database.
+ *
+ * @return  0 on success.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_flushall(struct RedisHandle * handle);
+
+/**
+ * GET key, answered by the near cache if the key is in it. The value is then cached,
+ * if the handle has a cache.
+ *
+ * @param handle
+ * @param key
+ * @param len The length of the key
+ * @param value Set to a copy of the value, which must be freed with #redis_object_cleanup.
+ *        Untouched if the key has no value.
+ *
+ * @return  1 if the key has a value, 0 if not.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_get(struct RedisHandle * handle, const char *key, size_t len, struct Object *value);
+
+/**
+ * GET key, with the value received straight into the caller's buffer instead of
+ * being allocated and copied. Like #redis_get it is answered by the near cache if
+ * the key is in it.
+ *
+ * @param handle
+ * @param key
+ * @param len The length of the key
+ * @param dst Where the value is written
+ * @param cap The size of dst
+ * @param valueLen Set to the length of the value, which is more than cap if it was truncated
+ *
+ * @return #REDIS_INTO_OK if the value was written, #REDIS_INTO_NIL if the key has no value,
+ *         or #REDIS_INTO_TRUNCATED if only the first cap bytes of it fitted.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_get_into(struct RedisHandle * handle, const char *key, size_t len, char *dst, size_t cap, size_t *valueLen);
+
+/**
+ * Sends GET key, registering into to receive its value, so it can be pipelined
+ * or used on a non-blocking handle. into->dst and into->cap must be set, and into
+ * must stay valid until its status is no longer #REDIS_INTO_PENDING.
+ *
+ * When the reply arrives its value is received straight into into->dst, then
+ * into->len and into->status are set. The reply itself is still pushed onto the
+ * handle as usual, pointing at into->dst, and must be popped and freed.
+ *
+ * Reconnecting sets any buffers still waiting to #REDIS_INTO_ERROR. Buffers aren't
+ * used while the handle is in streaming mode.
+ *
+ * @return  0 on success.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_send_get_into(struct RedisHandle * handle, const char *key, size_t len, struct RedisInto *into);
+
+/**
+ * SET key value
+ *
+ * @return  0 on success.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_set(struct RedisHandle * handle, const char *key, size_t len, const char *value, size_t valueLen);
+
+/**
+ * MGET key [key ...]. The values are cached, if the handle has a cache.
+ *
+ * @param handle
+ * @param n The number of keys
+ * @param keys The keys to get
+ * @param values Room for n values. Each is set to a copy of the key's value, or a
+ *        nil RAW object if it has none. All must be freed with #redis_object_cleanup.
+ *        Untouched on failure.
+ *
+ * @return The number of keys which had a value.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_mget(struct RedisHandle * handle, const unsigned int n, const struct Object keys[], struct Object values[]);
+
+/**
+ * INCR key, INCRBY key increment, DECR key and DECRBY key decrement.
+ *
+ * @param result Set to the value after the change, if not NULL
+ *
+ * @return  0 on success.
+ * @return -1 on failure, including if the value is not an integer. Use #redis_error
+ *          to determine the error
+ */
+int redis_incr(struct RedisHandle * handle, const char *key, size_t len, int64_t *result);
+int redis_incrby(struct RedisHandle * handle, const char *key, size_t len, int64_t increment, int64_t *result);
+int redis_decr(struct RedisHandle * handle, const char *key, size_t len, int64_t *result);
+int redis_decrby(struct RedisHandle * handle, const char *key, size_t len, int64_t decrement, int64_t *result);
+
+/**
+ * STRLEN key
+ *
+ * @param length Set to the length of the value, 0 if the key does not exist
+ *
+ * @return  0 on success.
+ * @return -1 on failure. Use #redis_error to determine the error
+ */
+int redis_strlen(struct RedisHandle * handle, const char *key, size_t len, int64_t *length);
 
 #endif /* REDIS_C_H */
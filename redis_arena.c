@@ -0,0 +1,155 @@
+#include "redis-c.h"
+#include "redis_private.h"
+
+#include <assert.h>
+
+#define ARENA_MIN_SHIFT 4           /** The smallest block is 16 bytes */
+#define ARENA_CLASSES   7           /** Blocks are 16, 32, ... 1024 bytes, anything larger uses malloc */
+#define ARENA_SLAB_SIZE (64 * 1024) /** Blocks are carved out of slabs of this size */
+
+#define ARENA_MAX_BLOCK (1 << (ARENA_MIN_SHIFT + ARENA_CLASSES - 1))
+
+struct ArenaBlock {
+	struct ArenaBlock *next;    /** Next free block of the same size */
+};
+
+struct ArenaSlab {
+	struct ArenaSlab *next;     /** Next slab owned by the arena */
+	size_t pad;                 /** Keeps the blocks which follow 16 byte aligned */
+};
+
+struct RedisArena {
+	struct RedisAllocator allocator;
+
+	struct ArenaBlock *freeList[ARENA_CLASSES]; /** Blocks given back, one list per size */
+
+	struct ArenaSlab *slabs;    /** Every slab, so they can be freed */
+	char *slabPos;              /** Where the next new block comes from in the newest slab */
+	char *slabEnd;              /** The end of the newest slab */
+
+	size_t outstanding;         /** How many allocations have not been given back yet */
+
+	unsigned int detached :1;   /** Has the owner finished with us? */
+};
+
+/**
+ * @internal
+ * @return The size class for size bytes, or -1 if it is too big for the arena.
+ */
+static int arena_class(size_t size) {
+	int cls = 0;
+	size_t blockSize = 1 << ARENA_MIN_SHIFT;
+
+	if (size > ARENA_MAX_BLOCK)
+		return -1;
+
+	while (blockSize < size) {
+		blockSize <<= 1;
+		cls++;
+	}
+
+	return cls;
+}
+
+static void arena_destroy(struct RedisArena *arena) {
+	struct ArenaSlab *slab = arena->slabs;
+
+	while (slab) {
+		struct ArenaSlab *next = slab->next;
+		free(slab);
+		slab = next;
+	}
+
+	free(arena);
+}
+
+static void * arena_alloc(void *ctx, size_t size) {
+	struct RedisArena *arena = ctx;
+	struct ArenaBlock *block;
+	size_t blockSize;
+	int cls;
+
+	cls = arena_class(size);
+	if (cls < 0) {
+		block = malloc(size);
+		if (block != NULL)
+			arena->outstanding++;
+		return block;
+	}
+
+	/* Reuse a block which has been given back */
+	block = arena->freeList[cls];
+	if (block != NULL) {
+		arena->freeList[cls] = block->next;
+		arena->outstanding++;
+		return block;
+	}
+
+	/* Otherwise carve a new one out of the slab, getting a new slab if needed */
+	blockSize = (size_t)1 << (ARENA_MIN_SHIFT + cls);
+	if (arena->slabPos == NULL || (size_t)(arena->slabEnd - arena->slabPos) < blockSize) {
+		struct ArenaSlab *slab = malloc(ARENA_SLAB_SIZE);
+		if (slab == NULL)
+			return NULL;
+
+		slab->next   = arena->slabs;
+		arena->slabs = slab;
+
+		arena->slabPos = (char *)(slab + 1);
+		arena->slabEnd = (char *)slab + ARENA_SLAB_SIZE;
+	}
+
+	block = (struct ArenaBlock *)arena->slabPos;
+	arena->slabPos += blockSize;
+	arena->outstanding++;
+
+	return block;
+}
+
+static void arena_release(void *ctx, void *ptr, size_t size) {
+	struct RedisArena *arena = ctx;
+	struct ArenaBlock *block = ptr;
+	int cls;
+
+	assert(arena->outstanding > 0);
+
+	cls = arena_class(size);
+	if (cls < 0) {
+		free(ptr);
+	} else {
+		block->next = arena->freeList[cls];
+		arena->freeList[cls] = block;
+	}
+
+	arena->outstanding--;
+
+	/* The last reply has gone, and so has the handle */
+	if (arena->outstanding == 0 && arena->detached)
+		arena_destroy(arena);
+}
+
+struct RedisArena * redis_arena_alloc(void) {
+	struct RedisArena *arena = calloc(1, sizeof(struct RedisArena));
+	if (arena == NULL)
+		return NULL;
+
+	arena->allocator.alloc   = arena_alloc;
+	arena->allocator.release = arena_release;
+	arena->allocator.ctx     = arena;
+
+	return arena;
+}
+
+const struct RedisAllocator * redis_arena_allocator(struct RedisArena *arena) {
+	return &arena->allocator;
+}
+
+void redis_arena_detach(struct RedisArena *arena) {
+	if (arena == NULL)
+		return;
+
+	if (arena->outstanding == 0)
+		arena_destroy(arena);
+	else
+		arena->detached = 1;
+}
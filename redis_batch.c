@@ -0,0 +1,470 @@
+#include "redis-c.h"
+#include "redis_private.h"
+
+#include <time.h>
+
+#define BATCH_GET 0 /** The requests are GETs, sent as one MGET */
+#define BATCH_SET 1 /** The requests are SETs, sent as one MSET */
+
+#define BATCH_DATA_INITIAL 1024 /** How big the buffer holding queued keys and values starts */
+
+/**
+ * A request waiting to be sent. The key and value are copied into the batch's data buffer.
+ */
+struct BatchRequest {
+	redis_batch_callback cb;
+	void *arg;
+	size_t key;                  /** Offset of the key in data */
+	size_t keyLen;
+	size_t value;                /** Offset of the value in data, for SETs */
+	size_t valueLen;
+};
+
+struct BatchCallback {
+	redis_batch_callback cb;
+	void *arg;
+};
+
+/**
+ * An MGET or MSET which has been sent, waiting for its reply.
+ */
+struct BatchSent {
+	struct BatchSent *next;
+	uint64_t seq;                /** Which command it was, see RedisHandle::commandSeq */
+	int kind;                    /** BATCH_GET or BATCH_SET */
+	unsigned int count;          /** How many requests it carried */
+	struct BatchCallback callbacks[1]; /** Who to give each request's result to */
+};
+
+struct RedisBatch {
+	unsigned int maxRequests;    /** The most requests held before they are sent */
+	unsigned int window;         /** The longest a request is held, in us, 0 until the loop comes round */
+	uint64_t deadline;           /** When the queued requests must be sent, in ns */
+
+	int kind;                    /** BATCH_GET or BATCH_SET, what is queued */
+	unsigned int count;          /** Requests queued */
+	struct BatchRequest *requests; /** Room for maxRequests */
+	struct Object *argv;         /** Room for the longest MSET */
+	struct Buffer data;          /** The queued keys and values */
+
+	struct BatchSent *oldest;    /** The next batch to be answered */
+	struct BatchSent *newest;
+};
+
+static uint64_t batch_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @internal
+ * Gives every request in the batch the same result.
+ */
+static void batch_answer_all(struct RedisHandle *h, const struct BatchSent *s, int ret) {
+	unsigned int i;
+
+	for (i = 0; i < s->count; i++)
+		s->callbacks[i].cb(h, ret, NULL, s->callbacks[i].arg);
+}
+
+/**
+ * @internal
+ * Fails every batch still waiting for its reply, which will now never come.
+ */
+static void batch_fail_sent(struct RedisHandle *h) {
+	struct RedisBatch *b = h->batch;
+
+	while (b->oldest != NULL) {
+		struct BatchSent *s = b->oldest;
+
+		b->oldest = s->next;
+		if (b->oldest == NULL)
+			b->newest = NULL;
+
+		batch_answer_all(h, s, -1);
+		free(s);
+	}
+}
+
+/**
+ * @internal
+ * Fails every request still queued, which will now never be sent.
+ */
+static void batch_fail_queued(struct RedisHandle *h) {
+	struct RedisBatch *b = h->batch;
+	unsigned int i;
+
+	for (i = 0; i < b->count; i++)
+		b->requests[i].cb(h, -1, NULL, b->requests[i].arg);
+
+	b->count = 0;
+	buffer_unshift(&b->data, buffer_len(&b->data));
+}
+
+int redis_use_batching(struct RedisHandle *h, unsigned int maxRequests, unsigned int window) {
+	struct RedisBatch *b;
+
+	assert(h != NULL);
+
+	if (h->batch != NULL) {
+		if (h->batch->count > 0 || h->batch->oldest != NULL) {
+			h->lastErr = "Error batched requests are still waiting";
+			return -1;
+		}
+
+		redis_batch_free(h);
+	}
+
+	if (maxRequests == 0)
+		return 0;
+
+	b = malloc(sizeof(struct RedisBatch));
+	if (b == NULL) {
+		h->lastErr = "Error allocating batch";
+		return -1;
+	}
+
+	b->requests = malloc(sizeof(struct BatchRequest) * maxRequests);
+	b->argv     = malloc(sizeof(struct Object) * (1 + 2 * (size_t)maxRequests));
+	if (b->requests == NULL || b->argv == NULL || buffer_init(&b->data, BATCH_DATA_INITIAL) == NULL) {
+		free(b->requests);
+		free(b->argv);
+		free(b);
+		h->lastErr = "Error allocating batch";
+		return -1;
+	}
+
+	b->maxRequests = maxRequests;
+	b->window      = window;
+	b->deadline    = 0;
+	b->kind        = BATCH_GET;
+	b->count       = 0;
+	b->oldest      = NULL;
+	b->newest      = NULL;
+
+	h->batch = b;
+	return 0;
+}
+
+void redis_batch_free(struct RedisHandle *h) {
+	struct RedisBatch *b = h->batch;
+
+	if (b == NULL)
+		return;
+
+	h->lastErr = "Error handle was freed";
+	batch_fail_queued(h);
+	batch_fail_sent(h);
+
+	buffer_cleanup(&b->data);
+	free(b->argv);
+	free(b->requests);
+	free(b);
+	h->batch = NULL;
+}
+
+void redis_batch_reset(struct RedisHandle *h) {
+	if (h->batch == NULL)
+		return;
+
+	h->lastErr = "Error connection was reset";
+	batch_fail_sent(h);
+}
+
+int redis_batch_flush(struct RedisHandle *h) {
+	struct RedisBatch *b;
+	struct BatchSent *s;
+	const char *data;
+	unsigned int i;
+	int argc = 1;
+	uint64_t seq;
+
+	assert(h != NULL);
+
+	b = h->batch;
+	if (b == NULL || b->count == 0)
+		return 0;
+
+	s = malloc(sizeof(struct BatchSent) + sizeof(struct BatchCallback) * (b->count - 1));
+	if (s == NULL) {
+		h->lastErr = "Error allocating batch";
+		batch_fail_queued(h);
+		return -1;
+	}
+
+	s->next  = NULL;
+	s->kind  = b->kind;
+	s->count = b->count;
+
+	data = buffer_start(&b->data);
+	b->argv[0].ptr  = (char *)(b->kind == BATCH_GET ? "MGET" : "MSET");
+	b->argv[0].len  = 4;
+	b->argv[0].type = REDIS_TYPE_STR;
+	b->argv[0].ptrOwned = 0;
+
+	for (i = 0; i < b->count; i++) {
+		const struct BatchRequest *r = &b->requests[i];
+		struct Object *o = &b->argv[argc++];
+
+		o->ptr      = (char *)data + r->key;
+		o->len      = r->keyLen;
+		o->type     = REDIS_TYPE_RAW;
+		o->ptrOwned = 0;
+
+		if (b->kind == BATCH_SET) {
+			o = &b->argv[argc++];
+			o->ptr      = (char *)data + r->value;
+			o->len      = r->valueLen;
+			o->type     = REDIS_TYPE_RAW;
+			o->ptrOwned = 0;
+		}
+
+		s->callbacks[i].cb  = r->cb;
+		s->callbacks[i].arg = r->arg;
+	}
+
+	/* Queued commands are counted when the pipeline is flushed, in order */
+	seq = h->commandSeq + h->pipelined + 1;
+
+	/* Nothing is queued any more, so sending the batch doesn't flush it again */
+	b->count = 0;
+
+	if (redis_send_multibulk(h, argc, b->argv) < 0) {
+		buffer_unshift(&b->data, buffer_len(&b->data));
+		batch_answer_all(h, s, -1);
+		free(s);
+		return -1;
+	}
+
+	buffer_unshift(&b->data, buffer_len(&b->data));
+
+	s->seq = seq;
+	if (b->newest != NULL)
+		b->newest->next = s;
+	else
+		b->oldest = s;
+	b->newest = s;
+
+	h->stats.batches++;
+	h->stats.batched += s->count;
+
+	return 0;
+}
+
+int redis_batch_due(const struct RedisHandle *h) {
+	const struct RedisBatch *b = h->batch;
+	uint64_t now;
+
+	if (b == NULL || b->count == 0)
+		return -1;
+
+	if (b->window == 0)
+		return 0;
+
+	now = batch_now();
+
+	if (now >= b->deadline)
+		return 0;
+
+	return (int)((b->deadline - now + 999999) / 1000000);
+}
+
+/**
+ * @internal
+ * Queues a request, sending what is already queued first if it is of the other kind,
+ * and sending the batch if it is now full or has been held long enough.
+ * @return 0 on success, -1 on failure.
+ */
+static int batch_queue(struct RedisHandle *h, int kind, const char *key, size_t len, const char *value, size_t valueLen, redis_batch_callback cb, void *arg) {
+	struct RedisBatch *b = h->batch;
+	struct BatchRequest *r;
+	uint64_t now;
+
+	if (b == NULL) {
+		h->lastErr = "Error batching is not enabled, see redis_use_batching";
+		return -1;
+	}
+
+	if (cb == NULL) {
+		h->lastErr = "Error batched requests need a callback";
+		return -1;
+	}
+
+	if (h->socket == INVALID_SOCKET) {
+		h->lastErr = "Invalid socket";
+		return -1;
+	}
+
+	/* An MGET can't carry SETs, and sending it first keeps the requests in order.
+	 * A full batch is sent when its last request is queued, but never overfill one */
+	if (b->count > 0 && (b->kind != kind || b->count == b->maxRequests) && redis_batch_flush(h))
+		return -1;
+
+	if (buffer_reserveExtra(&b->data, len + valueLen) == NULL) {
+		h->lastErr = "Error allocating batch";
+		return -1;
+	}
+
+	r = &b->requests[b->count];
+	r->cb       = cb;
+	r->arg      = arg;
+	r->key      = buffer_len(&b->data);
+	r->keyLen   = len;
+	r->value    = r->key + len;
+	r->valueLen = valueLen;
+
+	memcpy(buffer_end(&b->data), key, len);
+	buffer_push(&b->data, len);
+	if (valueLen > 0) {
+		memcpy(buffer_end(&b->data), value, valueLen);
+		buffer_push(&b->data, valueLen);
+	}
+
+	now = b->window > 0 ? batch_now() : 0;
+	if (b->count++ == 0) {
+		b->kind     = kind;
+		b->deadline = now + (uint64_t)b->window * 1000;
+		if (h->loop != NULL)
+			redis_loop_batched(h);
+	}
+
+	/* The request is queued now, so if sending fails it hears so through cb */
+	if (b->count == b->maxRequests || now > b->deadline)
+		redis_batch_flush(h);
+
+	return 0;
+}
+
+int redis_batch_get(struct RedisHandle *h, const char *key, size_t len, redis_batch_callback cb, void *arg) {
+	assert(h != NULL);
+
+	return batch_queue(h, BATCH_GET, key, len, NULL, 0, cb, arg);
+}
+
+int redis_batch_set(struct RedisHandle *h, const char *key, size_t len, const char *value, size_t valueLen, redis_batch_callback cb, void *arg) {
+	assert(h != NULL);
+
+	return batch_queue(h, BATCH_SET, key, len, value, valueLen, cb, arg);
+}
+
+/**
+ * @internal
+ * Hands each value in an MGET reply to the GET it answers.
+ */
+static void batch_answer_get(struct RedisHandle *h, const struct BatchSent *s, const struct Reply *r) {
+	unsigned int i;
+
+	if (r->argc != s->count) {
+		h->lastErr = r->argc == 1 && r->argv[0].type == REDIS_TYPE_STR
+			? "Error the server replied with an error"
+			: "Error reading MGET reply, the wrong number of values";
+		batch_answer_all(h, s, -1);
+		return;
+	}
+
+	for (i = 0; i < s->count; i++) {
+		const struct Object *o = &r->argv[i];
+
+		if (o->type != REDIS_TYPE_RAW) {
+			h->lastErr = "Error reading MGET reply, the value is not a bulk value";
+			s->callbacks[i].cb(h, -1, NULL, s->callbacks[i].arg);
+		} else {
+			s->callbacks[i].cb(h, o->ptr != NULL, o->ptr != NULL ? o : NULL, s->callbacks[i].arg);
+		}
+	}
+}
+
+/**
+ * @internal
+ * Gives every SET in an MSET its result.
+ */
+static void batch_answer_set(struct RedisHandle *h, const struct BatchSent *s, const struct Reply *r) {
+	if (r->argc == 1 && r->argv[0].type == REDIS_TYPE_STR && r->argv[0].len > 0 && r->argv[0].ptr[0] == '+') {
+		batch_answer_all(h, s, 0);
+		return;
+	}
+
+	h->lastErr = "Error the server replied with an error";
+	batch_answer_all(h, s, -1);
+}
+
+int redis_batch_dispatch(struct RedisHandle *h) {
+	struct RedisBatch *b;
+	int answered = 0;
+
+	assert(h != NULL);
+
+	b = h->batch;
+	if (b == NULL)
+		return 0;
+
+	/* The replies will never come */
+	if (h->failed) {
+		batch_fail_sent(h);
+		return -1;
+	}
+
+	while (b->oldest != NULL && h->replies > 0) {
+		struct BatchSent *s = b->oldest;
+		struct Reply *r;
+
+		/* The oldest waiting reply answers this command, anything before it isn't ours */
+		if (h->replySeq - h->replies + 1 != s->seq)
+			break;
+
+		r = redis_reply_pop(h);
+
+		b->oldest = s->next;
+		if (b->oldest == NULL)
+			b->newest = NULL;
+
+		if (s->kind == BATCH_GET)
+			batch_answer_get(h, s, r);
+		else
+			batch_answer_set(h, s, r);
+
+		answered += s->count;
+		redis_reply_free(r);
+		free(s);
+	}
+
+	return answered;
+}
+
+int redis_batch_wait(struct RedisHandle *h) {
+	int answered = 0;
+
+	assert(h != NULL);
+
+	if (h->pipeline) {
+		h->lastErr = "Error can not wait for a reply while pipelining";
+		return -1;
+	}
+
+	if (redis_batch_flush(h))
+		return -1;
+
+	while (h->batch != NULL && h->batch->oldest != NULL) {
+		int ret = redis_batch_dispatch(h);
+		if (ret < 0)
+			return -1;
+		answered += ret;
+
+		if (h->batch->oldest == NULL)
+			break;
+
+		/* A reply to some other command is in the way */
+		if (h->replies > 0) {
+			h->lastErr = "Error replies to other commands are waiting ahead of the batch";
+			return -1;
+		}
+
+		if (redis_read(h) < 0) {
+			batch_fail_sent(h);
+			return -1;
+		}
+	}
+
+	return answered;
+}
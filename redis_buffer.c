@@ -2,6 +2,9 @@
 
 #include <string.h>
 
+#define BUFFER_IDLE_PERIOD 256 /** Empty reserves between checks on whether the buffer is too big */
+#define BUFFER_SHRINK_RATIO 4  /** Shrink once the buffer is this many times bigger than needed */
+
 static void buffer_assert(const struct Buffer *buf) {
 	assert(buf != NULL);
 	assert(buf->buf != NULL);
@@ -17,9 +20,14 @@ struct Buffer * buffer_init(struct Buffer *buf, size_t size) {
 	if (buf->buf == NULL)
 		return NULL;
 
-	buf->bufLen  = size;
-	buf->data    = 0;
-	buf->dataLen = 0;
+	buf->bufLen   = size;
+	buf->data     = 0;
+	buf->dataLen  = 0;
+	buf->initLen  = size;
+	buf->peak     = 0;
+	buf->idle     = 0;
+	buf->reallocs = 0;
+	buf->moves    = 0;
 
 	return buf;
 }
@@ -29,6 +37,52 @@ void buffer_cleanup(struct Buffer *buf) {
 	free(buf->buf);
 }
 
+/**
+ * @internal
+ * @return The smallest power of two which is at least size
+ */
+static size_t buffer_round(size_t size) {
+	size_t rounded = 1;
+
+	while (rounded < size && rounded < ((size_t)-1 >> 1) + 1)
+		rounded <<= 1;
+
+	return rounded < size ? size : rounded;
+}
+
+/**
+ * @internal
+ * Called when the buffer is empty. Every #BUFFER_IDLE_PERIOD calls, a buffer which
+ * has been much bigger than anything asked of it is shrunk. Shrinking only well below
+ * the growth point stops a buffer bouncing between two sizes.
+ */
+static void buffer_idle(struct Buffer *buf) {
+	size_t size;
+	char *ptr;
+
+	if (++buf->idle < BUFFER_IDLE_PERIOD)
+		return;
+
+	size = buffer_round(buf->peak);
+	if (size < buf->initLen)
+		size = buf->initLen;
+
+	buf->idle = 0;
+	buf->peak = 0;
+
+	if (size > buf->bufLen / BUFFER_SHRINK_RATIO)
+		return;
+
+	ptr = realloc(buf->buf, size);
+	if (ptr == NULL)
+		return;
+
+	buf->buf    = ptr;
+	buf->bufLen = size;
+	buf->data   = 0;
+	buf->reallocs++;
+}
+
 struct Buffer * buffer_reserve(struct Buffer *buf, size_t size) {
 	buffer_assert(buf);
 
@@ -36,18 +90,28 @@ struct Buffer * buffer_reserve(struct Buffer *buf, size_t size) {
 	if (size == 0)
 		size = 1;
 
+	if (size > buf->peak)
+		buf->peak = size;
+
+	if (buf->dataLen == 0)
+		buffer_idle(buf);
+
 	if (size > buf->bufLen) {
-		/* If the size is bigger than we can handle, just realloc */
-		buf->buf = realloc(buf->buf, size);
-		if (buf->buf == NULL)
+		/* If the size is bigger than we can handle, grow geometrically */
+		size_t newLen = buffer_round(size);
+		char *ptr = realloc(buf->buf, newLen);
+		if (ptr == NULL)
 			return NULL;
-		buf->bufLen = size;
+		buf->buf    = ptr;
+		buf->bufLen = newLen;
+		buf->reallocs++;
 	}
 
 	if (size > (buf->bufLen - buf->data)) {
 		/* If the size is larger than our effective size (then move stuff down) */
 		memmove(buf->buf, &buf->buf[buf->data], buf->dataLen);
 		buf->data = 0;
+		buf->moves++;
 	}
 
 	return buf;
@@ -62,14 +126,18 @@ struct Buffer * buffer_shrink(struct Buffer *buf) {
 		/* Move all the data down (if needed) */
 		memmove(buf->buf, &buf->buf[buf->data], buf->dataLen);
 		buf->data = 0;
+		buf->moves++;
 	}
 
-	/* Shrink the malloced area */
-	if (buf->bufLen > buf->dataLen) {
-		buf->buf = realloc(buf->buf, buf->dataLen);
-		if (buf->buf == NULL)
+	/* Shrink the malloced area (keeping at least 1 byte, as realloc would free it) */
+	if (buf->bufLen > buf->dataLen && buf->dataLen > 0) {
+		/* On failure the buffer keeps its old, bigger, block */
+		char *ptr = realloc(buf->buf, buf->dataLen);
+		if (ptr == NULL)
 			return NULL;
+		buf->buf    = ptr;
 		buf->bufLen = buf->dataLen;
+		buf->reallocs++;
 	}
 
 	return buf;
@@ -103,6 +171,16 @@ size_t buffer_push(struct Buffer *buf, size_t size) {
 	return size;
 }
 
+struct Buffer * buffer_append(struct Buffer *buf, const void *data, size_t len) {
+	if (buffer_reserveExtra(buf, len) == NULL)
+		return NULL;
+
+	memcpy(buffer_end(buf), data, len);
+	buf->dataLen += len;
+
+	return buf;
+}
+
 size_t buffer_pop(struct Buffer *buf, size_t size) {
 	if (buffer_len(buf) < size)
 		size = buffer_len(buf);
@@ -10,6 +10,13 @@ struct Buffer {
 
 	size_t data;    /** Where is the beginning of the data */
 	size_t dataLen; /** The length of the data */
+
+	size_t initLen; /** The size the buffer started with, it is never shrunk below this */
+	size_t peak;    /** The most space asked of #buffer_reserve since the last idle check */
+	unsigned int idle; /** How many times #buffer_reserve found the buffer empty since the last idle check */
+
+	unsigned long reallocs; /** How many times buf has been realloced */
+	unsigned long moves;    /** How many times the data has been moved down to make room */
 };
 
 /**
@@ -32,7 +39,10 @@ struct Buffer * buffer_init(struct Buffer *buf, size_t size);
 void buffer_cleanup(struct Buffer *buf);
 
 /**
- * Ensure there is at least this much space overall in the buffer
+ * Ensure there is at least this much space overall in the buffer. The buffer grows
+ * to the next power of two, so a stream of slightly larger requests reallocs a
+ * logarithmic number of times. Once the buffer has sat empty for a while without
+ * needing most of its space, it is shrunk back down.
  *
  * @warning Memory may be realloced, so any pointers to the buffer must be invalidated afterwards.
  *
@@ -64,7 +74,7 @@ struct Buffer * buffer_reserveExtra(struct Buffer *buf, size_t size);
  *
  * @param buf
  *
- * @return NULL on failure.
+ * @return NULL on failure, in which case the buffer is left as it was.
  * @return Otherwise the buf parameter.
  */
 struct Buffer * buffer_shrink(struct Buffer *buf);
@@ -118,6 +128,20 @@ size_t buffer_available(const struct Buffer *buf);
  */
 size_t buffer_push(struct Buffer *buf, size_t size);
 
+/**
+ * Copies len bytes onto the end of the data, growing the buffer if needed.
+ *
+ * @warning Memory may be realloced, so any pointers to the buffer must be invalidated afterwards.
+ *
+ * @param buf
+ * @param data The bytes to copy
+ * @param len The number of bytes to copy
+ *
+ * @return NULL on failure.
+ * @return Otherwise the buf parameter.
+ */
+struct Buffer * buffer_append(struct Buffer *buf, const void *data, size_t len);
+
 /**
  * Pops size bytes from the end of the data.
  *
@@ -0,0 +1,389 @@
+#include "redis-c.h"
+#include "redis_private.h"
+
+#include <strings.h>
+#include <time.h>
+
+#define CACHE_BUCKETS_INITIAL 64 /** How many hash buckets a new cache starts with */
+
+/**
+ * A cached GET result. The key and value are stored after the entry, in one allocation.
+ */
+struct CacheEntry {
+	struct CacheEntry *next;     /** Next entry in the same hash bucket */
+	struct CacheEntry *newer;    /** More recently used entry, NULL for the newest */
+	struct CacheEntry *older;    /** Less recently used entry, NULL for the oldest */
+
+	uint64_t hash;
+	uint64_t expires;            /** When the entry goes stale, in ms, 0 for never */
+
+	size_t keyLen;
+	size_t valueLen;
+	unsigned int nil :1;         /** The key held no value */
+
+	char data[1];                /** The key, followed by the value */
+};
+
+struct RedisCache {
+	struct CacheEntry **buckets;
+	size_t bucketCount;          /** Always a power of two */
+	size_t entries;
+
+	size_t bytes;                /** Memory used by the entries */
+	size_t maxBytes;             /** Least recently used entries are evicted beyond this */
+	unsigned int ttl;            /** How long entries are used for, in ms, 0 for ever */
+
+	struct CacheEntry *newest;   /** Head of the LRU list */
+	struct CacheEntry *oldest;   /** Tail of the LRU list, the next to be evicted */
+};
+
+/**
+ * Commands which only read, so leave the cache alone. Anything else is assumed to
+ * write to the keys it is given.
+ */
+static const char * const readCommands[] = {
+	"GET", "MGET", "EXISTS", "STRLEN", "GETRANGE", "SUBSTR", "TYPE", "TTL", "PTTL",
+	"KEYS", "SCAN", "RANDOMKEY", "DBSIZE", "PING", "ECHO", "INFO", "TIME",
+	"LLEN", "LRANGE", "LINDEX", "SCARD", "SISMEMBER", "SMEMBERS", "SRANDMEMBER",
+	"HGET", "HMGET", "HGETALL", "HEXISTS", "HLEN", "HKEYS", "HVALS",
+	"ZCARD", "ZSCORE", "ZRANK", "ZREVRANK", "ZRANGE", "ZREVRANGE", "ZRANGEBYSCORE", "ZCOUNT",
+	NULL
+};
+
+/**
+ * Commands which change keys they aren't given, so empty the whole cache.
+ */
+static const char * const clearCommands[] = {
+	"FLUSHDB", "FLUSHALL", "SELECT", "SWAPDB", "MOVE", "RENAME", "RENAMENX",
+	"EVAL", "EVALSHA", "FCALL", "EXEC", "DEBUG", "RESTORE",
+	NULL
+};
+
+static uint64_t cache_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @internal
+ * FNV-1a hash of the key.
+ */
+static uint64_t cache_hash(const char *key, size_t len) {
+	uint64_t hash = 14695981039346656037ULL;
+
+	while (len-- > 0) {
+		hash ^= (unsigned char)*key++;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static size_t entry_size(size_t keyLen, size_t valueLen) {
+	return sizeof(struct CacheEntry) + keyLen + valueLen;
+}
+
+static int in_list(const char * const *list, const char *name, size_t len) {
+	for (; *list != NULL; list++) {
+		if (strlen(*list) == len && strncasecmp(*list, name, len) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * @internal
+ * Unlinks the entry from the LRU list.
+ */
+static void lru_remove(struct RedisCache *c, struct CacheEntry *e) {
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		c->newest = e->older;
+
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		c->oldest = e->newer;
+}
+
+/**
+ * @internal
+ * Links the entry in as the most recently used.
+ */
+static void lru_push(struct RedisCache *c, struct CacheEntry *e) {
+	e->newer = NULL;
+	e->older = c->newest;
+
+	if (c->newest)
+		c->newest->newer = e;
+	else
+		c->oldest = e;
+
+	c->newest = e;
+}
+
+/**
+ * @internal
+ * @return Where the pointer to the key's entry is, which points to NULL if it isn't cached.
+ */
+static struct CacheEntry ** cache_find(struct RedisCache *c, uint64_t hash, const char *key, size_t len) {
+	struct CacheEntry **e = &c->buckets[hash & (c->bucketCount - 1)];
+
+	while (*e != NULL) {
+		if ((*e)->hash == hash && (*e)->keyLen == len && memcmp((*e)->data, key, len) == 0)
+			break;
+		e = &(*e)->next;
+	}
+
+	return e;
+}
+
+/**
+ * @internal
+ * Removes and frees the entry which *link points to.
+ */
+static void cache_remove(struct RedisCache *c, struct CacheEntry **link) {
+	struct CacheEntry *e = *link;
+
+	*link = e->next;
+	lru_remove(c, e);
+
+	c->entries--;
+	c->bytes -= entry_size(e->keyLen, e->valueLen);
+	free(e);
+}
+
+/**
+ * @internal
+ * Removes the key's entry, if it has one.
+ * @return 1 if an entry was removed, otherwise 0.
+ */
+static int cache_remove_key(struct RedisCache *c, const char *key, size_t len) {
+	struct CacheEntry **link = cache_find(c, cache_hash(key, len), key, len);
+
+	if (*link == NULL)
+		return 0;
+
+	cache_remove(c, link);
+	return 1;
+}
+
+/**
+ * @internal
+ * Doubles the number of hash buckets. If this fails the chains just get longer.
+ */
+static void cache_grow(struct RedisCache *c) {
+	size_t count = c->bucketCount * 2;
+	struct CacheEntry **buckets = calloc(count, sizeof(struct CacheEntry *));
+	size_t i;
+
+	if (buckets == NULL)
+		return;
+
+	for (i = 0; i < c->bucketCount; i++) {
+		struct CacheEntry *e = c->buckets[i];
+
+		while (e != NULL) {
+			struct CacheEntry *next = e->next;
+			struct CacheEntry **bucket = &buckets[e->hash & (count - 1)];
+
+			e->next = *bucket;
+			*bucket = e;
+			e = next;
+		}
+	}
+
+	free(c->buckets);
+	c->buckets     = buckets;
+	c->bucketCount = count;
+}
+
+/**
+ * @internal
+ * Frees every entry, leaving the cache empty.
+ */
+static void cache_empty(struct RedisCache *c) {
+	struct CacheEntry *e = c->newest;
+
+	while (e != NULL) {
+		struct CacheEntry *older = e->older;
+		free(e);
+		e = older;
+	}
+
+	memset(c->buckets, 0, c->bucketCount * sizeof(struct CacheEntry *));
+	c->entries = 0;
+	c->bytes   = 0;
+	c->newest  = NULL;
+	c->oldest  = NULL;
+}
+
+int redis_use_cache(struct RedisHandle *h, size_t maxBytes, unsigned int ttl) {
+	struct RedisCache *c;
+
+	assert(h != NULL);
+
+	redis_cache_free(h->cache);
+	h->cache = NULL;
+
+	if (maxBytes == 0)
+		return 0;
+
+	c = malloc(sizeof(struct RedisCache));
+	if (c == NULL) {
+		h->lastErr = "Error allocating cache";
+		return -1;
+	}
+
+	c->buckets = calloc(CACHE_BUCKETS_INITIAL, sizeof(struct CacheEntry *));
+	if (c->buckets == NULL) {
+		free(c);
+		h->lastErr = "Error allocating cache";
+		return -1;
+	}
+
+	c->bucketCount = CACHE_BUCKETS_INITIAL;
+	c->entries     = 0;
+	c->bytes       = 0;
+	c->maxBytes    = maxBytes;
+	c->ttl         = ttl;
+	c->newest      = NULL;
+	c->oldest      = NULL;
+
+	h->cache = c;
+	return 0;
+}
+
+void redis_cache_clear(struct RedisHandle *h) {
+	assert(h != NULL);
+
+	if (h->cache == NULL)
+		return;
+
+	h->stats.cacheInvalidations += h->cache->entries;
+	cache_empty(h->cache);
+}
+
+void redis_cache_free(struct RedisCache *c) {
+	if (c == NULL)
+		return;
+
+	cache_empty(c);
+	free(c->buckets);
+	free(c);
+}
+
+int redis_cache_lookup(struct RedisHandle *h, const char *key, size_t len, const char **value, size_t *valueLen) {
+	struct RedisCache *c = h->cache;
+	struct CacheEntry **link;
+	struct CacheEntry *e;
+
+	if (c == NULL)
+		return 0;
+
+	link = cache_find(c, cache_hash(key, len), key, len);
+	e = *link;
+
+	if (e == NULL) {
+		h->stats.cacheMisses++;
+		return 0;
+	}
+
+	if (e->expires != 0 && cache_now() >= e->expires) {
+		cache_remove(c, link);
+		h->stats.cacheMisses++;
+		return 0;
+	}
+
+	lru_remove(c, e);
+	lru_push(c, e);
+	h->stats.cacheHits++;
+
+	*value    = e->nil ? NULL : e->data + e->keyLen;
+	*valueLen = e->valueLen;
+	return 1;
+}
+
+void redis_cache_store(struct RedisHandle *h, const char *key, size_t len, const char *value, size_t valueLen) {
+	struct RedisCache *c = h->cache;
+	struct CacheEntry *e;
+	size_t size = entry_size(len, valueLen);
+
+	if (c == NULL)
+		return;
+
+	cache_remove_key(c, key, len);
+
+	/* Something this big would push out everything else */
+	if (size > c->maxBytes)
+		return;
+
+	while (c->bytes + size > c->maxBytes) {
+		struct CacheEntry *oldest = c->oldest;
+		cache_remove(c, cache_find(c, oldest->hash, oldest->data, oldest->keyLen));
+		h->stats.cacheEvictions++;
+	}
+
+	e = malloc(size);
+	if (e == NULL)
+		return;
+
+	e->hash     = cache_hash(key, len);
+	e->expires  = c->ttl ? cache_now() + c->ttl : 0;
+	e->keyLen   = len;
+	e->valueLen = valueLen;
+	e->nil      = value == NULL;
+	memcpy(e->data, key, len);
+	if (value != NULL)
+		memcpy(e->data + len, value, valueLen);
+
+	if (c->entries >= c->bucketCount)
+		cache_grow(c);
+
+	e->next = c->buckets[e->hash & (c->bucketCount - 1)];
+	c->buckets[e->hash & (c->bucketCount - 1)] = e;
+	lru_push(c, e);
+
+	c->entries++;
+	c->bytes += size;
+}
+
+int redis_cache_command(const struct Object *name) {
+	if (name->type == REDIS_TYPE_INT || name->type == REDIS_TYPE_ARG || name->ptr == NULL)
+		return CACHE_CLEAR;
+
+	if (in_list(readCommands, name->ptr, name->len))
+		return CACHE_READ;
+
+	if (in_list(clearCommands, name->ptr, name->len))
+		return CACHE_CLEAR;
+
+	return CACHE_WRITE;
+}
+
+void redis_cache_written(struct RedisHandle *h, int action, const int argc, const struct Object argv[]) {
+	struct RedisCache *c = h->cache;
+	int i;
+
+	if (c == NULL || action == CACHE_READ)
+		return;
+
+	if (action == CACHE_CLEAR) {
+		redis_cache_clear(h);
+		return;
+	}
+
+	/* Values can't be told from keys, so any argument naming a cached key drops it */
+	for (i = 0; i < argc && c->entries > 0; i++) {
+		const struct Object *o = &argv[i];
+
+		if (o->type == REDIS_TYPE_INT) {
+			char tmp[REDIS_INT64_LEN];
+			h->stats.cacheInvalidations += cache_remove_key(c, tmp, redis_format_int64(tmp, o->integer));
+		} else if (o->ptr != NULL) {
+			h->stats.cacheInvalidations += cache_remove_key(c, o->ptr, o->len);
+		}
+	}
+}
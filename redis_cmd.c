@@ -1,79 +1,685 @@
-#include "redis-c.h"
-
-#include <assert.h>
-
-/**
+#include "redis-c.h"
+#include "redis_private.h"
+#include "redis_commands.h"
+
+#include <assert.h>
+
+/**
+ * The command table, generated from #REDIS_COMMANDS. Each command's name is encoded
+ * as a bulk string here, so sending it is a memcpy.
+ */
+const struct RedisCommand redis_commands[CMD_COUNT] = {
+#define X(id, name, len, arity, reply, cache) \
+	{ name, "$" #len "\r\n" name "\r\n", sizeof("$" #len "\r\n" name "\r\n") - 1, arity, REPLY_##reply, CACHE_##cache },
+	REDIS_COMMANDS(X)
+#undef X
+};
+
+/* Fails to compile if a length given in the table is not the length of the name */
+#define X(id, name, len, arity, reply, cache) \
+	typedef char check_length_##id[sizeof(name) - 1 == len ? 1 : -1];
+REDIS_COMMANDS(X)
+#undef X
+
+#define ANY_COUNT ((unsigned int)-1) /** An array reply may hold any number of values */
+
+/**
+ * @internal
+ * Checks the reply has the shape the command is documented to reply with.
+ * @param count The number of values expected in an array reply, or #ANY_COUNT
+ * @return 0 if it does, otherwise -1.
+ */
+static int check_reply(const struct Reply *r, int type, unsigned int count) {
+	unsigned int i;
+
+	if (type == REPLY_ARRAY) {
+		if (count != ANY_COUNT && r->argc != count)
+			return -1;
+		for (i = 0; i < r->argc; i++) {
+			if (r->argv[i].type != REDIS_TYPE_RAW)
+				return -1;
+		}
+		return 0;
+	}
+
+	if (r->argc != 1)
+		return -1;
+
+	switch (type) {
+		case REPLY_INT:
+			return r->argv[0].type == REDIS_TYPE_INT ? 0 : -1;
+		case REPLY_STATUS:
+			return r->argv[0].type == REDIS_TYPE_STR && r->argv[0].len > 0 && r->argv[0].ptr[0] == '+' ? 0 : -1;
+		case REPLY_BULK:
+			return r->argv[0].type == REDIS_TYPE_RAW ? 0 : -1;
+	}
+
+	return -1;
+}
+
+/**
+ * @internal
+ * A single line reply, decoded by #line_command.
+ */
+struct LineReply {
+	struct Object value;      /** The integer, or the status line including its '+' */
+	struct Reply *reply;      /** Holds value, if the reply had already been parsed */
+};
+
+/**
+ * @internal
+ * Sets lastErr for a reply which isn't what the command replies with.
+ */
+static void reply_failed(struct RedisHandle *h, const struct Object *o) {
+	/* Errors are always a single STR starting with '-' */
+	if (o != NULL && o->type == REDIS_TYPE_STR && o->len > 0 && o->ptr[0] == '-')
+		h->lastErr = "Error the server replied with an error";
+	else
+		h->lastErr = "Error reading reply, the reply is not what the command replies with";
+}
+
+/**
+ * @internal
+ * Sends a command from the table, then reads until only its own reply is left to come.
+ * Batched requests sent ahead of the command are answered on the way, so their replies
+ * go to their callbacks rather than being mistaken for ours.
+ * @param id Which command, CMD_GET etc
+ * @param argc The number of arguments, after the command's name
+ * @return 0 on success, -1 on failure.
+ */
+static int command_send(struct RedisHandle *h, int id, const int argc, const struct Object argv[]) {
+	uint64_t seq;
+
+	if (h->pipeline) {
+		h->lastErr = "Error can not wait for a reply while pipelining";
+		return -1;
+	}
+
+	if (h->nonblocking) {
+		h->lastErr = "Error can not wait for a reply on a non-blocking handle";
+		return -1;
+	}
+
+	if (redis_send_command(h, &redis_commands[id], argc, argv) < 0)
+		return -1;
+
+	seq = h->commandSeq;
+	while (h->replySeq + 1 < seq) {
+		if (redis_read(h) < 0)
+			return -1;
+	}
+
+	if (redis_batch_dispatch(h) < 0)
+		return -1;
+
+	/* Our reply may have arrived along with the ones before it */
+	if (h->replies > 0 && h->replySeq - h->replies + 1 != seq) {
+		h->lastErr = "Error replies to other commands are waiting ahead of the reply";
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @internal
+ * Waits for the reply to the command #command_send just sent, and parses it into a #Reply.
+ * @param count The number of values expected, if the command replies with an array
+ * @return The reply, which the caller must free, or NULL on failure.
+ */
+static struct Reply * command_wait(struct RedisHandle *h, int id, unsigned int count) {
+	struct Reply *r;
+
+	while (h->replies == 0) {
+		if (redis_read(h) < 0)
+			return NULL;
+	}
+
+	r = redis_reply_pop(h);
+	assert(r != NULL);
+
+	if (check_reply(r, redis_commands[id].reply, count) == 0)
+		return r;
+
+	reply_failed(h, r->argc == 1 ? &r->argv[0] : NULL);
+	redis_reply_free(r);
+	return NULL;
+}
+
+/**
+ * @internal
+ * Sends a command from the table and waits for its reply.
+ * @param count The number of values expected, if the command replies with an array
+ * @return The reply, which the caller must free, or NULL on failure.
+ */
+static struct Reply * command(struct RedisHandle *h, int id, const int argc, const struct Object argv[], unsigned int count) {
+	if (command_send(h, id, argc, argv))
+		return NULL;
+
+	return command_wait(h, id, count);
+}
+
+/**
+ * @internal
+ * Sends a command which replies with an integer or a status, and waits for it.
+ * Normally the reply is decoded straight from the receive buffer, without a #Reply
+ * being built. Free lr with #line_done once finished with it.
+ * @return 0 on success, -1 on failure.
+ */
+static int line_command(struct RedisHandle *h, int id, const int argc, const struct Object argv[], struct LineReply *lr) {
+	int type = redis_commands[id].reply;
+	int ret;
+
+	lr->reply = NULL;
+
+	if (command_send(h, id, argc, argv))
+		return -1;
+
+	if (h->replies == 0 && h->state == STATE_WAITING && !h->streaming) {
+		ret = redis_read_line(h, &lr->value);
+		if (ret < 0)
+			return -1;
+
+		if (ret > 0) {
+			if (type == REPLY_INT ? lr->value.type == REDIS_TYPE_INT : lr->value.type == REDIS_TYPE_STR && lr->value.ptr[0] == '+')
+				return 0;
+
+			reply_failed(h, &lr->value);
+			return -1;
+		}
+	}
+
+	/* Already parsed, or not a single line at all */
+	lr->reply = command_wait(h, id, 1);
+	if (lr->reply == NULL)
+		return -1;
+
+	lr->value = lr->reply->argv[0];
+	return 0;
+}
+
+/**
+ * @internal
+ * Frees anything #line_command kept for its reply.
+ */
+static void line_done(struct LineReply *lr) {
+	if (lr->reply != NULL)
+		redis_reply_free(lr->reply);
+}
+
+/**
+ * @internal
+ * Sends a command which replies with an integer, and waits for it.
+ * @param result Set to the integer replied
+ * @return 0 on success, -1 on failure.
+ */
+static int int_command(struct RedisHandle *h, int id, const int argc, const struct Object argv[], int64_t *result) {
+	struct LineReply lr;
+
+	if (line_command(h, id, argc, argv, &lr))
+		return -1;
+
+	*result = lr.value.integer;
+
+	line_done(&lr);
+	return 0;
+}
+
+/**
+ * @internal
+ * Sends a command which replies with +OK or another status, and waits for it.
+ * @return 0 on success, -1 on failure.
+ */
+static int status_command(struct RedisHandle *h, int id, const int argc, const struct Object argv[]) {
+	struct LineReply lr;
+
+	if (line_command(h, id, argc, argv, &lr))
+		return -1;
+
+	line_done(&lr);
+	return 0;
+}
+
+/**
  * Commands operating on all the kind of values
- */
-
-int redis_int_bulk_command(struct RedisHandle *h, const int argc, const struct Object argv[] ) {
-	int ret = 0;
-	struct Reply *r;
-
-	if (redis_send_bulk(h, argc, argv))
-		return -1;
-
-	while (ret == 0) {
-		ret = redis_read(h);
-		if (ret < 0)
-			return -1;
-	}
-
-	r = redis_reply_pop(h);
-	assert(r != NULL);
-
-	/* r should be a int */
-	if (r->argc != 1 || r->argv[0].type != REDIS_TYPE_INT) {
-		h->lastErr = "Error reading int reply, the reply does not have exactly one integer response.";
-		redis_reply_free(r);
-		return -1;
-	}
-
-	ret = (int)r->argv[0].ptr;
-
-	redis_reply_free(r);
-
-	return ret;
-}
-
-/**
- * EXISTS key test if a key exists
- * @param h
- * @param key
- * @param len
- * @return
- */
-int redis_exists(struct RedisHandle *h, const char *key, size_t len) {
-	const struct Object args[] = {
-		REDIS_STR("EXISTS"),
-		REDIS_RAW(key, len),
-	};
-	return redis_int_bulk_command(h, sizeof(args) / sizeof(args[0]), args);
-}
-
-/**
- * DEL key delete a key
- */
-
-/**
- * TYPE key return the type of the value stored at key
- */
-
-/**
- * KEYS pattern return all the keys matching a given pattern
- */
-
-/**
- * RANDOMKEY return a random key from the key space
- */
-/*
-RENAME oldname newname rename the old key in the new one, destroing the newname key if it already exists
-RENAMENX oldname newname rename the old key in the new one, if the newname key does not already exist
-DBSIZE return the number of keys in the current db
-EXPIRE set a time to live in seconds on a key
-TTL get the time to live in seconds of a key
-SELECT index Select the DB having the specified index
-MOVE key dbindex Move the key from the currently selected DB to the DB having as index dbindex
-FLUSHDB Remove all the keys of the currently selected DB
-FLUSHALL Remove all the keys from all the databases
-*/
+ */
+
+int redis_del(struct RedisHandle *h, const unsigned int n, const struct Object keys[]) {
+	int64_t deleted;
+
+	if (int_command(h, CMD_DEL, n, keys, &deleted))
+		return -1;
+
+	return (int)deleted;
+}
+
+int redis_exists(struct RedisHandle *h, const char *key, size_t len) {
+	const struct Object args[] = {
+		REDIS_RAW(key, len),
+	};
+	const char *cached;
+	size_t cachedLen;
+	int64_t exists;
+
+	if (redis_cache_lookup(h, key, len, &cached, &cachedLen))
+		return cached != NULL;
+
+	if (int_command(h, CMD_EXISTS, 1, args, &exists))
+		return -1;
+
+	return exists != 0;
+}
+
+/**
+ * @internal
+ * The names TYPE replies with, indexed by the REDIS_KEY_ constant.
+ */
+static const char * const keyTypes[] = {
+	"+none", "+string", "+list", "+set", "+zset", "+hash", "+stream",
+};
+
+int redis_type(struct RedisHandle *h, const char *key, size_t len) {
+	const struct Object args[] = {
+		REDIS_RAW(key, len),
+	};
+	struct LineReply lr;
+	unsigned int i;
+
+	if (line_command(h, CMD_TYPE, 1, args, &lr))
+		return -1;
+
+	for (i = 0; i < sizeof(keyTypes) / sizeof(keyTypes[0]); i++) {
+		if (lr.value.len == strlen(keyTypes[i]) && memcmp(lr.value.ptr, keyTypes[i], lr.value.len) == 0)
+			break;
+	}
+
+	line_done(&lr);
+
+	if (i == sizeof(keyTypes) / sizeof(keyTypes[0])) {
+		h->lastErr = "Error reading TYPE reply, unknown type";
+		return -1;
+	}
+
+	return (int)i;
+}
+
+int redis_keys(struct RedisHandle *h, const char *pattern, size_t len, struct Reply **keys) {
+	const struct Object args[] = {
+		REDIS_RAW(pattern, len),
+	};
+	struct Reply *r;
+
+	assert(keys != NULL);
+
+	r = command(h, CMD_KEYS, 1, args, ANY_COUNT);
+	if (r == NULL)
+		return -1;
+
+	/* The reply already is an array of the keys, so it is handed over as it is */
+	*keys = r;
+	return (int)r->argc;
+}
+
+int redis_randomkey(struct RedisHandle *h, struct Object *key) {
+	struct Reply *r;
+
+	assert(key != NULL);
+
+	r = command(h, CMD_RANDOMKEY, 0, NULL, 1);
+	if (r == NULL)
+		return -1;
+
+	if (r->argv[0].ptr == NULL) {
+		redis_reply_free(r);
+		return 0;
+	}
+
+	if (redis_object_init_copy(key, r->argv[0].ptr, r->argv[0].len) == NULL) {
+		h->lastErr = "Error allocating a Object struct";
+		redis_reply_free(r);
+		return -1;
+	}
+
+	redis_reply_free(r);
+	return 1;
+}
+
+int redis_rename(struct RedisHandle *h, const char *key, size_t len, const char *newkey, size_t newlen) {
+	const struct Object args[] = {
+		REDIS_RAW(key, len),
+		REDIS_RAW(newkey, newlen),
+	};
+
+	return status_command(h, CMD_RENAME, 2, args);
+}
+
+int redis_renamenx(struct RedisHandle *h, const char *key, size_t len, const char *newkey, size_t newlen) {
+	const struct Object args[] = {
+		REDIS_RAW(key, len),
+		REDIS_RAW(newkey, newlen),
+	};
+	int64_t renamed;
+
+	if (int_command(h, CMD_RENAMENX, 2, args, &renamed))
+		return -1;
+
+	return renamed != 0;
+}
+
+int redis_expire(struct RedisHandle *h, const char *key, size_t len, int64_t seconds) {
+	const struct Object args[] = {
+		REDIS_RAW(key, len),
+		REDIS_INT(seconds),
+	};
+	int64_t set;
+
+	if (int_command(h, CMD_EXPIRE, 2, args, &set))
+		return -1;
+
+	return set != 0;
+}
+
+int redis_persist(struct RedisHandle *h, const char *key, size_t len) {
+	const struct Object args[] = {
+		REDIS_RAW(key, len),
+	};
+	int64_t removed;
+
+	if (int_command(h, CMD_PERSIST, 1, args, &removed))
+		return -1;
+
+	return removed != 0;
+}
+
+int redis_ttl(struct RedisHandle *h, const char *key, size_t len, int64_t *seconds) {
+	const struct Object args[] = {
+		REDIS_RAW(key, len),
+	};
+
+	assert(seconds != NULL);
+
+	return int_command(h, CMD_TTL, 1, args, seconds);
+}
+
+int redis_select(struct RedisHandle *h, unsigned int db) {
+	const struct Object args[] = {
+		REDIS_INT(db),
+	};
+
+	return status_command(h, CMD_SELECT, 1, args);
+}
+
+int redis_move(struct RedisHandle *h, const char *key, size_t len, unsigned int db) {
+	const struct Object args[] = {
+		REDIS_RAW(key, len),
+		REDIS_INT(db),
+	};
+	int64_t moved;
+
+	if (int_command(h, CMD_MOVE, 2, args, &moved))
+		return -1;
+
+	return moved != 0;
+}
+
+int redis_dbsize(struct RedisHandle *h, int64_t *size) {
+	assert(size != NULL);
+
+	return int_command(h, CMD_DBSIZE, 0, NULL, size);
+}
+
+int redis_flushdb(struct RedisHandle *h) {
+	return status_command(h, CMD_FLUSHDB, 0, NULL);
+}
+
+int redis_flushall(struct RedisHandle *h) {
+	return status_command(h, CMD_FLUSHALL, 0, NULL);
+}
+
+/**
+ * Commands operating on string values
+ */
+
+int redis_get(struct RedisHandle *h, const char *key, size_t len, struct Object *value) {
+	const struct Object args[] = {
+		REDIS_RAW(key, len),
+	};
+	const char *cached;
+	size_t cachedLen;
+	struct Reply *r;
+
+	assert(value != NULL);
+
+	if (redis_cache_lookup(h, key, len, &cached, &cachedLen)) {
+		if (cached == NULL)
+			return 0;
+
+		if (redis_object_init_copy(value, cached, cachedLen) == NULL) {
+			h->lastErr = "Error allocating a Object struct";
+			return -1;
+		}
+		return 1;
+	}
+
+	r = command(h, CMD_GET, 1, args, 1);
+	if (r == NULL)
+		return -1;
+
+	redis_cache_store(h, key, len, r->argv[0].ptr, r->argv[0].len);
+
+	if (r->argv[0].ptr == NULL) {
+		redis_reply_free(r);
+		return 0;
+	}
+
+	if (redis_object_init_copy(value, r->argv[0].ptr, r->argv[0].len) == NULL) {
+		h->lastErr = "Error allocating a Object struct";
+		redis_reply_free(r);
+		return -1;
+	}
+
+	redis_reply_free(r);
+	return 1;
+}
+
+int redis_send_get_into(struct RedisHandle *h, const char *key, size_t len, struct RedisInto *into) {
+	const struct Object args[] = {
+		REDIS_RAW(key, len),
+	};
+
+	assert(into != NULL);
+	assert(into->dst != NULL || into->cap == 0);
+
+	if (h->streaming) {
+		h->lastErr = "Error can not read into a buffer while streaming";
+		return -1;
+	}
+
+	/* Batched requests must go first, so the GET's place in the replies is known */
+	if (h->batch != NULL && redis_batch_flush(h) < 0)
+		return -1;
+
+	if (redis_into_expect(h, into))
+		return -1;
+
+	if (redis_send_command(h, &redis_commands[CMD_GET], 1, args) < 0) {
+		redis_into_forget(h, into);
+		into->status = REDIS_INTO_ERROR;
+		return -1;
+	}
+
+	return 0;
+}
+
+int redis_get_into(struct RedisHandle *h, const char *key, size_t len, char *dst, size_t cap, size_t *valueLen) {
+	struct RedisInto into;
+	const char *cached;
+	size_t cachedLen;
+	uint64_t seq;
+
+	if (redis_cache_lookup(h, key, len, &cached, &cachedLen)) {
+		if (cached == NULL) {
+			if (valueLen != NULL)
+				*valueLen = 0;
+			return REDIS_INTO_NIL;
+		}
+
+		memcpy(dst, cached, cachedLen < cap ? cachedLen : cap);
+		if (valueLen != NULL)
+			*valueLen = cachedLen;
+
+		return cachedLen > cap ? REDIS_INTO_TRUNCATED : REDIS_INTO_OK;
+	}
+
+	if (h->pipeline) {
+		h->lastErr = "Error can not wait for a reply while pipelining";
+		return -1;
+	}
+
+	if (h->nonblocking) {
+		h->lastErr = "Error can not wait for a reply on a non-blocking handle";
+		return -1;
+	}
+
+	into.dst = dst;
+	into.cap = cap;
+
+	if (redis_send_get_into(h, key, len, &into) < 0)
+		return -1;
+
+	/* Read until the GET itself is answered, not just any reply */
+	seq = h->commandSeq;
+	while (into.status == REDIS_INTO_PENDING || h->replySeq < seq) {
+		if (redis_read(h) < 0) {
+			/* into is about to go out of scope */
+			redis_into_forget(h, &into);
+			return -1;
+		}
+	}
+
+	/* Batched requests sent ahead of the GET are answered first */
+	if (redis_batch_dispatch(h) < 0) {
+		redis_into_forget(h, &into);
+		return -1;
+	}
+
+	if (h->replySeq - h->replies + 1 != seq) {
+		redis_into_forget(h, &into);
+		h->lastErr = "Error replies to other commands are waiting ahead of the reply";
+		return -1;
+	}
+
+	redis_reply_free(redis_reply_pop(h));
+
+	if (into.status == REDIS_INTO_ERROR) {
+		h->lastErr = "Error reading reply, the reply is not what the command replies with";
+		return -1;
+	}
+
+	/* Only whole values can be cached */
+	if (into.status == REDIS_INTO_NIL)
+		redis_cache_store(h, key, len, NULL, 0);
+	else if (into.status == REDIS_INTO_OK)
+		redis_cache_store(h, key, len, dst, into.len);
+
+	if (valueLen != NULL)
+		*valueLen = into.len;
+
+	return into.status;
+}
+
+int redis_set(struct RedisHandle *h, const char *key, size_t len, const char *value, size_t valueLen) {
+	const struct Object args[] = {
+		REDIS_RAW(key, len),
+		REDIS_RAW(value, valueLen),
+	};
+
+	return status_command(h, CMD_SET, 2, args);
+}
+
+int redis_mget(struct RedisHandle *h, const unsigned int n, const struct Object keys[], struct Object values[]) {
+	const struct Object nil = REDIS_NIL();
+	struct Reply *r;
+	unsigned int i;
+	int found = 0;
+
+	assert(values != NULL);
+
+	r = command(h, CMD_MGET, n, keys, n);
+	if (r == NULL)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		const struct Object *o = &r->argv[i];
+
+		if (keys[i].type != REDIS_TYPE_INT)
+			redis_cache_store(h, keys[i].ptr, keys[i].len, o->ptr, o->len);
+
+		if (o->ptr == NULL) {
+			values[i] = nil;
+			continue;
+		}
+
+		if (redis_object_init_copy(&values[i], o->ptr, o->len) == NULL) {
+			h->lastErr = "Error allocating a Object struct";
+			while (i-- > 0)
+				redis_object_cleanup(&values[i]);
+			redis_reply_free(r);
+			return -1;
+		}
+		found++;
+	}
+
+	redis_reply_free(r);
+	return found;
+}
+
+int redis_incrby(struct RedisHandle *h, const char *key, size_t len, int64_t increment, int64_t *result) {
+	const struct Object args[] = {
+		REDIS_RAW(key, len),
+		REDIS_INT(increment),
+	};
+	int64_t value;
+
+	if (int_command(h, increment == 1 ? CMD_INCR : CMD_INCRBY, increment == 1 ? 1 : 2, args, &value))
+		return -1;
+
+	if (result != NULL)
+		*result = value;
+
+	return 0;
+}
+
+int redis_incr(struct RedisHandle *h, const char *key, size_t len, int64_t *result) {
+	return redis_incrby(h, key, len, 1, result);
+}
+
+int redis_decrby(struct RedisHandle *h, const char *key, size_t len, int64_t decrement, int64_t *result) {
+	const struct Object args[] = {
+		REDIS_RAW(key, len),
+		REDIS_INT(decrement),
+	};
+	int64_t value;
+
+	if (int_command(h, decrement == 1 ? CMD_DECR : CMD_DECRBY, decrement == 1 ? 1 : 2, args, &value))
+		return -1;
+
+	if (result != NULL)
+		*result = value;
+
+	return 0;
+}
+
+int redis_decr(struct RedisHandle *h, const char *key, size_t len, int64_t *result) {
+	return redis_decrby(h, key, len, 1, result);
+}
+
+int redis_strlen(struct RedisHandle *h, const char *key, size_t len, int64_t *length) {
+	const struct Object args[] = {
+		REDIS_RAW(key, len),
+	};
+
+	assert(length != NULL);
+
+	return int_command(h, CMD_STRLEN, 1, args, length);
+}
@@ -0,0 +1,63 @@
+#ifndef LIBREDIS_COMMANDS_H_
+#define LIBREDIS_COMMANDS_H_
+
+/**
+ * @internal
+ * The commands which have typed helpers, one line each:
+ *
+ * X(id, name, length of name, arity, reply, cache)
+ *
+ * arity counts the name, and is -n for at least n arguments. reply is the REPLY_
+ * type the command answers with, and cache the CACHE_ effect it has on the near
+ * cache. Everything else about a command is derived from this table when the
+ * library is compiled, including its name pre-encoded as a bulk string.
+ */
+#define REDIS_COMMANDS(X) \
+	X(DEL,       "DEL",       3, -2, INT,    WRITE) \
+	X(EXISTS,    "EXISTS",    6,  2, INT,    READ)  \
+	X(TYPE,      "TYPE",      4,  2, STATUS, READ)  \
+	X(KEYS,      "KEYS",      4,  2, ARRAY,  READ)  \
+	X(RANDOMKEY, "RANDOMKEY", 9,  1, BULK,   READ)  \
+	X(RENAME,    "RENAME",    6,  3, STATUS, CLEAR) \
+	X(RENAMENX,  "RENAMENX",  8,  3, INT,    CLEAR) \
+	X(EXPIRE,    "EXPIRE",    6,  3, INT,    WRITE) \
+	X(PERSIST,   "PERSIST",   7,  2, INT,    WRITE) \
+	X(TTL,       "TTL",       3,  2, INT,    READ)  \
+	X(SELECT,    "SELECT",    6,  2, STATUS, CLEAR) \
+	X(MOVE,      "MOVE",      4,  3, INT,    WRITE) \
+	X(DBSIZE,    "DBSIZE",    6,  1, INT,    READ)  \
+	X(FLUSHDB,   "FLUSHDB",   7,  1, STATUS, CLEAR) \
+	X(FLUSHALL,  "FLUSHALL",  8,  1, STATUS, CLEAR) \
+	X(GET,       "GET",       3,  2, BULK,   READ)  \
+	X(SET,       "SET",       3,  3, STATUS, WRITE) \
+	X(MGET,      "MGET",      4, -2, ARRAY,  READ)  \
+	X(INCR,      "INCR",      4,  2, INT,    WRITE) \
+	X(INCRBY,    "INCRBY",    6,  3, INT,    WRITE) \
+	X(DECR,      "DECR",      4,  2, INT,    WRITE) \
+	X(DECRBY,    "DECRBY",    6,  3, INT,    WRITE) \
+	X(STRLEN,    "STRLEN",    6,  2, INT,    READ)
+
+#define REPLY_INT    0 /** :N */
+#define REPLY_STATUS 1 /** +status */
+#define REPLY_BULK   2 /** $N, or nil */
+#define REPLY_ARRAY  3 /** *N of bulk values */
+
+enum RedisCommandId {
+#define X(id, name, len, arity, reply, cache) CMD_##id,
+	REDIS_COMMANDS(X)
+#undef X
+	CMD_COUNT
+};
+
+struct RedisCommand {
+	const char *name;
+	const char *header;       /** The name pre-encoded as a bulk string, "$3\r\nGET\r\n" */
+	size_t headerLen;
+	int arity;                /** Number of arguments (including the name), -n for at least n */
+	int reply;                /** What the command replies with, REPLY_INT etc */
+	int cache;                /** What sending the command does to the cache, CACHE_READ etc */
+};
+
+extern const struct RedisCommand redis_commands[CMD_COUNT];
+
+#endif /* LIBREDIS_COMMANDS_H_ */
@@ -0,0 +1,91 @@
+#include "redis-c.h"
+#include "redis_private.h"
+
+/* The two digit strings for 00 to 99, so numbers can be formatted two digits at a time */
+static const char digitPairs[201] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+int redis_parse_int64(const char *str, size_t len, int64_t *num) {
+	const char *end = str + len;
+	uint64_t value = 0;
+	int negative = 0;
+
+	assert(str != NULL || len == 0);
+	assert(num != NULL);
+
+	if (len > 0 && *str == '-') {
+		negative = 1;
+		str++;
+	}
+
+	/* No digits, or more than an int64 could hold. With at most 19 digits
+	 * value can't overflow, which keeps the loop free of overflow checks */
+	if (str == end || end - str > 19)
+		return -1;
+
+	while (str < end) {
+		unsigned int digit = (unsigned char)*str - '0';
+		if (digit > 9)
+			return -1;
+
+		value = value * 10 + digit;
+		str++;
+	}
+
+	if (negative) {
+		if (value > (uint64_t)INT64_MAX + 1)
+			return -1;
+		*num = (int64_t)(0 - value);
+	} else {
+		if (value > INT64_MAX)
+			return -1;
+		*num = (int64_t)value;
+	}
+
+	return 0;
+}
+
+size_t redis_format_uint64(char *buf, uint64_t num) {
+	char tmp[REDIS_INT64_LEN];
+	char *ptr = tmp + sizeof(tmp);
+	size_t len;
+
+	/* Fill tmp from the end, two digits at a time */
+	while (num >= 100) {
+		const char *pair = &digitPairs[(num % 100) * 2];
+		num /= 100;
+		*--ptr = pair[1];
+		*--ptr = pair[0];
+	}
+
+	if (num >= 10) {
+		const char *pair = &digitPairs[num * 2];
+		*--ptr = pair[1];
+		*--ptr = pair[0];
+	} else {
+		*--ptr = '0' + num;
+	}
+
+	len = tmp + sizeof(tmp) - ptr;
+	memcpy(buf, ptr, len);
+
+	return len;
+}
+
+size_t redis_format_int64(char *buf, int64_t num) {
+	if (num < 0) {
+		buf[0] = '-';
+		return 1 + redis_format_uint64(buf + 1, 0 - (uint64_t)num);
+	}
+
+	return redis_format_uint64(buf, (uint64_t)num);
+}
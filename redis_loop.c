@@ -0,0 +1,219 @@
+#include "redis-c.h"
+#include "redis_private.h"
+
+#include <sys/epoll.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+#define LOOP_MAX_EVENTS 64 /** How many ready handles are fetched per epoll_wait */
+
+struct RedisLoop {
+	int epfd;                      /** The epoll instance */
+	struct epoll_event events[LOOP_MAX_EVENTS]; /** The events from the last epoll_wait */
+	struct RedisHandle *batched;   /** Handles which may have batched requests to send */
+};
+
+/**
+ * @internal
+ * @return The epoll events the loop should wait for on h
+ */
+static unsigned int loop_events(const struct RedisHandle * h) {
+	return EPOLLIN | (h->loopWrite ? EPOLLOUT : 0);
+}
+
+struct RedisLoop * redis_loop_alloc(void) {
+	struct RedisLoop *loop = malloc(sizeof(struct RedisLoop));
+	if (loop == NULL)
+		return NULL;
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		free(loop);
+		return NULL;
+	}
+
+	loop->batched = NULL;
+
+	return loop;
+}
+
+void redis_loop_free(struct RedisLoop *loop) {
+	if (loop == NULL)
+		return;
+
+	/* The handles are not tracked, so they can't be told. It is up to the caller
+	 * to remove them first if they are going to be used again. */
+	close(loop->epfd);
+	free(loop);
+}
+
+int redis_loop_add(struct RedisLoop *loop, struct RedisHandle *h, redis_loop_callback cb, void *arg) {
+	struct epoll_event ev;
+
+	assert(loop != NULL);
+	assert(h    != NULL);
+
+	if (h->socket == INVALID_SOCKET) {
+		h->lastErr = "Invalid socket";
+		return -1;
+	}
+
+	if (h->loop != NULL) {
+		h->lastErr = "Error handle is already in a loop";
+		return -1;
+	}
+
+	if (redis_set_nonblocking(h, 1))
+		return -1;
+
+	h->loopWrite = buffer_len(&h->sendBuf) > 0;
+
+	ev.events   = loop_events(h);
+	ev.data.ptr = h;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, h->socket, &ev)) {
+		h->lastErr = "Error adding socket to loop";
+		return -1;
+	}
+
+	h->loop         = loop;
+	h->loopCallback = cb;
+	h->loopArg      = arg;
+
+	if (redis_batch_due(h) >= 0)
+		redis_loop_batched(h);
+
+	return 0;
+}
+
+int redis_loop_remove(struct RedisLoop *loop, struct RedisHandle *h) {
+	assert(loop != NULL);
+	assert(h    != NULL);
+
+	if (h->loop != loop) {
+		h->lastErr = "Error handle is not in this loop";
+		return -1;
+	}
+
+	if (h->loopBatched) {
+		struct RedisHandle **link = &loop->batched;
+
+		while (*link != h)
+			link = &(*link)->loopBatchNext;
+		*link = h->loopBatchNext;
+
+		h->loopBatched   = 0;
+		h->loopBatchNext = NULL;
+	}
+
+	h->loop         = NULL;
+	h->loopCallback = NULL;
+	h->loopArg      = NULL;
+	h->loopWrite    = 0;
+
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_DEL, h->socket, NULL)) {
+		h->lastErr = "Error removing socket from loop";
+		return -1;
+	}
+
+	return 0;
+}
+
+int redis_loop_update(struct RedisHandle * h) {
+	struct epoll_event ev;
+	unsigned int want = buffer_len(&h->sendBuf) > 0;
+
+	assert(h->loop != NULL);
+
+	if (want == h->loopWrite)
+		return 0;
+
+	h->loopWrite = want;
+
+	ev.events   = loop_events(h);
+	ev.data.ptr = h;
+	if (epoll_ctl(h->loop->epfd, EPOLL_CTL_MOD, h->socket, &ev)) {
+		h->lastErr = "Error updating socket in loop";
+		return -1;
+	}
+
+	return 0;
+}
+
+void redis_loop_batched(struct RedisHandle * h) {
+	assert(h->loop != NULL);
+
+	if (h->loopBatched)
+		return;
+
+	h->loopBatched   = 1;
+	h->loopBatchNext = h->loop->batched;
+	h->loop->batched = h;
+}
+
+/**
+ * @internal
+ * Sends the batched requests which are due, and forgets handles with none left.
+ * @param timeout How long the loop would wait
+ * @return How long the loop may wait before more requests are due
+ */
+static int loop_send_batched(struct RedisLoop *loop, int timeout) {
+	struct RedisHandle **link = &loop->batched;
+
+	while (*link != NULL) {
+		struct RedisHandle *h = *link;
+		int due = redis_batch_due(h);
+
+		/* Failures are given to the requests' callbacks */
+		if (due == 0)
+			redis_batch_flush(h);
+
+		if (due > 0) {
+			if (timeout < 0 || due < timeout)
+				timeout = due;
+			link = &h->loopBatchNext;
+			continue;
+		}
+
+		*link = h->loopBatchNext;
+		h->loopBatched   = 0;
+		h->loopBatchNext = NULL;
+	}
+
+	return timeout;
+}
+
+int redis_loop_run_once(struct RedisLoop *loop, int timeout) {
+	int n, i;
+
+	assert(loop != NULL);
+
+	/* Requests batched since the last iteration go before waiting for more */
+	timeout = loop_send_batched(loop, timeout);
+
+	n = epoll_wait(loop->epfd, loop->events, LOOP_MAX_EVENTS, timeout);
+	if (n < 0)
+		return errno == EINTR ? 0 : -1;
+
+	for (i = 0; i < n; i++) {
+		struct RedisHandle *h = loop->events[i].data.ptr;
+		unsigned int events = loop->events[i].events;
+		int ret = 0;
+
+		/* Send whatever the socket would not take before */
+		if (events & EPOLLOUT)
+			ret = redis_flush(h) < 0 ? -1 : 0;
+
+		if (ret == 0 && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+			ret = redis_read(h);
+
+		/* Replies to batched requests go to their own callbacks */
+		if (ret > 0 && h->batch != NULL && redis_batch_dispatch(h) != 0)
+			ret = h->failed ? -1 : (int)h->replies;
+
+		if (ret != 0 && h->loopCallback != NULL)
+			h->loopCallback(h, ret, h->loopArg);
+	}
+
+	return n;
+}
@@ -1,13 +1,17 @@
 #include "redis-c.h"
+#include "redis_private.h"
 
 #include <ctype.h>
 #include <stdio.h>
 
-struct Object * redis_object_init(struct Object *o, size_t len) {
+/* Always allocate at least 1 byte, so empty values still get a valid ptr */
+#define OBJECT_ALLOC_SIZE(len) ((len) > 0 ? (len) : 1)
+
+struct Object * redis_object_init_with(const struct RedisAllocator *a, struct Object *o, size_t len) {
 	if (o == NULL)
 		return NULL;
 
-	o->ptr = malloc(len);
+	o->ptr = redis_mem_alloc(a, OBJECT_ALLOC_SIZE(len));
 	if (o->ptr == NULL) {
 		return NULL;
 	}
@@ -18,6 +22,10 @@ struct Object * redis_object_init(struct Object *o, size_t len) {
 	return o;
 }
 
+struct Object * redis_object_init(struct Object *o, size_t len) {
+	return redis_object_init_with(NULL, o, len);
+}
+
 struct Object * redis_object_alloc(size_t len) {
 	struct Object * o = malloc(sizeof(struct Object));
 
@@ -28,11 +36,11 @@ struct Object * redis_object_alloc(size_t len) {
 	return NULL;
 }
 
-struct Object * redis_object_init_copy(struct Object *o, const char *src, size_t len) {
+struct Object * redis_object_init_copy_with(const struct RedisAllocator *a, struct Object *o, const char *src, size_t len) {
 	if (src == NULL && len != 0)
 		return NULL;
 
-	o = redis_object_init(o, len);
+	o = redis_object_init_with(a, o, len);
 	if (o == NULL)
 		return NULL;
 
@@ -42,6 +50,10 @@ struct Object * redis_object_init_copy(struct Object *o, const char *src, size_t
 	return o;
 }
 
+struct Object * redis_object_init_copy(struct Object *o, const char *src, size_t len) {
+	return redis_object_init_copy_with(NULL, o, src, len);
+}
+
 struct Object * redis_object_alloc_copy(const char *src, size_t len) {
 	struct Object *o;
 
@@ -56,12 +68,20 @@ struct Object * redis_object_alloc_copy(const char *src, size_t len) {
 	return NULL;
 }
 
-void redis_object_cleanup( struct Object * o ) {
+void redis_object_cleanup_with( const struct RedisAllocator *a, struct Object * o ) {
 	if (o == NULL)
 		return;
 
-	if (o->ptrOwned)
-		free(o->ptr);
+	if (o->ptrOwned) {
+		if (o->type == REDIS_TYPE_MULTIBULK)
+			redis_reply_free((struct Reply *)o->ptr);
+		else
+			redis_mem_release(a, o->ptr, OBJECT_ALLOC_SIZE(o->len));
+	}
+}
+
+void redis_object_cleanup( struct Object * o ) {
+	redis_object_cleanup_with(NULL, o);
 }
 
 void redis_object_free( struct Object * o ) {
@@ -76,7 +96,9 @@ void redis_object_free( struct Object * o ) {
 
 void redis_object_print( const struct Object * o ) {
 	int i;
+	unsigned int n;
 	const char *ptr;
+	const struct Reply *reply;
 
 	switch (o->type) {
 		case REDIS_TYPE_UNKNOWN:
@@ -103,7 +125,18 @@ void redis_object_print( const struct Object * o ) {
 			break;
 
 		case REDIS_TYPE_INT:
-			printf("{%d}", (int)o->ptr);
+			printf("{%lld}", (long long)o->integer);
+			break;
+
+		case REDIS_TYPE_MULTIBULK:
+			reply = (const struct Reply *)o->ptr;
+			printf("[");
+			for (n = 0; n < reply->argc; n++) {
+				if (n > 0)
+					printf(", ");
+				redis_object_print(&reply->argv[n]);
+			}
+			printf("]");
 			break;
 	}
 }
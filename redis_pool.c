@@ -0,0 +1,259 @@
+#include "redis-c.h"
+#include "redis_private.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+struct RedisPool {
+	pthread_mutex_t lock;
+	pthread_cond_t  available;   /** Signalled when a handle is checked in, or a slot frees up */
+
+	char *host;                  /** Where new connections are made to */
+	unsigned short port;
+
+	struct RedisHandle **idle;   /** Stack of connected handles waiting to be checked out */
+	unsigned int idleCount;      /** How many handles are on the stack */
+	unsigned int live;           /** How many handles exist (idle, checked out, or connecting) */
+
+	uint64_t lastChange;         /** When inUse last changed, in ns */
+	uint64_t created;            /** When the pool was created, in ns */
+
+	struct RedisPoolStats stats;
+};
+
+/**
+ * @internal
+ * @return The monotonic time in ns
+ */
+static uint64_t pool_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @internal
+ * Changes the number of handles checked out, keeping the time integral of
+ * inUse up to date. Must be called with the lock held.
+ */
+static void pool_in_use(struct RedisPool *pool, int delta) {
+	uint64_t now = pool_now();
+
+	pool->stats.busyTime += pool->stats.inUse * (now - pool->lastChange);
+	pool->lastChange = now;
+
+	pool->stats.inUse += delta;
+	if (pool->stats.inUse > pool->stats.inUseMax)
+		pool->stats.inUseMax = pool->stats.inUse;
+}
+
+/**
+ * @internal
+ * Creates a new handle and connects it. Called without the lock held.
+ * @return The handle, or NULL on failure
+ */
+static struct RedisHandle * pool_connect(struct RedisPool *pool) {
+	struct RedisHandle *h = redis_alloc();
+	if (h == NULL)
+		return NULL;
+
+	if (redis_connect(h, pool->host, pool->port)) {
+		redis_free(h);
+		return NULL;
+	}
+
+	return h;
+}
+
+struct RedisPool * redis_pool_alloc(const char *host, unsigned short port, unsigned int size) {
+	struct RedisPool *pool;
+
+	if (size == 0)
+		return NULL;
+
+	pool = calloc(1, sizeof(struct RedisPool));
+	if (pool == NULL)
+		return NULL;
+
+	pool->idle = calloc(size, sizeof(struct RedisHandle *));
+	pool->host = host ? strdup(host) : NULL;
+	if (pool->idle == NULL || (host != NULL && pool->host == NULL))
+		goto error;
+
+	pool->port       = port;
+	pool->stats.size = size;
+	pool->created    = pool->lastChange = pool_now();
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->available, NULL);
+
+	/* Connect them all up front, so the first requests don't pay for it */
+	while (pool->idleCount < size) {
+		struct RedisHandle *h = pool_connect(pool);
+		if (h == NULL) {
+			redis_pool_free(pool);
+			return NULL;
+		}
+		pool->idle[pool->idleCount++] = h;
+		pool->live++;
+	}
+
+	return pool;
+
+error:
+	free(pool->idle);
+	free(pool->host);
+	free(pool);
+	return NULL;
+}
+
+void redis_pool_free(struct RedisPool *pool) {
+	if (pool == NULL)
+		return;
+
+	/* Any handles still checked out are left to their owners */
+	while (pool->idleCount > 0)
+		redis_free(pool->idle[--pool->idleCount]);
+
+	pthread_cond_destroy(&pool->available);
+	pthread_mutex_destroy(&pool->lock);
+
+	free(pool->idle);
+	free(pool->host);
+	free(pool);
+}
+
+struct RedisHandle * redis_pool_checkout(struct RedisPool *pool, int timeout) {
+	struct RedisHandle *h = NULL;
+	struct timespec deadline;
+	uint64_t start = 0;
+	int waited = 0;
+
+	assert(pool != NULL);
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (pool->idleCount == 0 && pool->live == pool->stats.size) {
+		int err = 0;
+
+		if (timeout == 0)
+			break;
+
+		if (!waited) {
+			waited = 1;
+			start = pool_now();
+			pool->stats.waits++;
+
+			if (timeout > 0) {
+				clock_gettime(CLOCK_REALTIME, &deadline);
+				deadline.tv_sec  += timeout / 1000;
+				deadline.tv_nsec += (timeout % 1000) * 1000000L;
+				if (deadline.tv_nsec >= 1000000000L) {
+					deadline.tv_sec++;
+					deadline.tv_nsec -= 1000000000L;
+				}
+			}
+		}
+
+		if (timeout > 0)
+			err = pthread_cond_timedwait(&pool->available, &pool->lock, &deadline);
+		else
+			pthread_cond_wait(&pool->available, &pool->lock);
+
+		if (err == ETIMEDOUT)
+			break;
+	}
+
+	if (waited) {
+		uint64_t waitTime = pool_now() - start;
+		pool->stats.waitTime += waitTime;
+		if (waitTime > pool->stats.waitTimeMax)
+			pool->stats.waitTimeMax = waitTime;
+	}
+
+	if (pool->idleCount > 0) {
+		h = pool->idle[--pool->idleCount];
+
+	} else if (pool->live < pool->stats.size) {
+		/* A handle was discarded earlier, so replace it. The slot is taken now,
+		 * but the connect happens without the lock held */
+		pool->live++;
+		pthread_mutex_unlock(&pool->lock);
+
+		h = pool_connect(pool);
+
+		pthread_mutex_lock(&pool->lock);
+		if (h == NULL) {
+			pool->live--;
+			pool->stats.connectFailures++;
+			pthread_cond_signal(&pool->available);
+		} else {
+			pool->stats.reconnects++;
+		}
+	}
+
+	if (h != NULL) {
+		pool->stats.checkouts++;
+		pool_in_use(pool, 1);
+	} else {
+		pool->stats.timeouts++;
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return h;
+}
+
+void redis_pool_checkin(struct RedisPool *pool, struct RedisHandle *h) {
+	int discard;
+
+	assert(pool != NULL);
+
+	if (h == NULL)
+		return;
+
+	/* A dead connection, or one part way through a conversation, can't be reused */
+	discard = h->failed || h->socket == INVALID_SOCKET || h->pipeline
+	       || h->replies > 0 || h->replyCount > 0 || buffer_len(&h->sendBuf) > 0
+	       || h->state != STATE_WAITING || buffer_len(&h->buf) > 0 || h->intoCount > 0
+	       || h->commandSeq != h->replySeq || h->pipelined > 0;
+
+	/* Nor can one left in a mode, or on a database, the next caller won't expect */
+	discard = discard || h->batch != NULL || h->streaming || h->nonblocking
+	       || h->cache != NULL || h->uring != NULL || h->loop != NULL
+	       || h->selected || h->allocator != NULL || h->arena != NULL;
+
+	if (discard)
+		redis_free(h);
+
+	pthread_mutex_lock(&pool->lock);
+
+	pool_in_use(pool, -1);
+
+	if (discard) {
+		pool->live--;
+		pool->stats.discarded++;
+	} else {
+		pool->idle[pool->idleCount++] = h;
+	}
+
+	pthread_cond_signal(&pool->available);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void redis_pool_stats(struct RedisPool *pool, struct RedisPoolStats *stats) {
+	assert(pool  != NULL);
+	assert(stats != NULL);
+
+	pthread_mutex_lock(&pool->lock);
+
+	/* Bring busyTime up to now */
+	pool_in_use(pool, 0);
+
+	*stats = pool->stats;
+	stats->idle    = pool->idleCount;
+	stats->elapsed = pool->lastChange - pool->created;
+
+	pthread_mutex_unlock(&pool->lock);
+}
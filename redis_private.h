@@ -1,10 +1,258 @@
-#ifndef LIBREDIS_PRIVATE_H_
-#define LIBREDIS_PRIVATE_H_
-
-#define UNKNOWN_READ_LENGTH 128 /** How much should we read when we don't know the length of the data */
-
-#define STATE_WAITING         0 /** We are waiting for the first line of the reply */
-#define STATE_READ_BULK       1 /** We reading a bulk reply                        */
-#define STATE_READ_MULTI_BULK 2 /** We reading a multi-mulk reply                  */
-
-#endif /* LIBREDIS_PRIVATE_H_ */
+#ifndef LIBREDIS_PRIVATE_H_
+#define LIBREDIS_PRIVATE_H_
+
+#define UNKNOWN_READ_LENGTH 128 /** How much should we read when we don't know the length of the data */
+#define INITIAL_SEND_LENGTH 512 /** How big the send buffer starts, it grows to fit the largest command */
+#define MAX_READ_LENGTH   65536 /** The most a recv asks for, bulk values bigger than this skip the receive buffer */
+#define READ_SHORT_STREAK 64    /** How many mostly empty recvs in a row halve the amount asked for */
+#define SEND_REF_MIN      16384 /** Values at least this big are sent from the caller's memory instead of copied */
+
+#define STATE_WAITING         0 /** We are waiting for the first line of the reply */
+#define STATE_READ_BULK       1 /** We reading a bulk reply                        */
+#define STATE_READ_MULTI_BULK 2 /** We reading a multi-mulk reply                  */
+#define STATE_STREAM          3 /** We are handing a reply to the stream callbacks   */
+
+/**
+ * @internal
+ * Looks for the end of the next line in the handle's receive buffer. Data which
+ * has already been searched is not searched again, so this can be called each
+ * time more data arrives.
+ * @return The \n which ends the line, or NULL if a full line has not arrived yet.
+ */
+char * redis_readLine(struct RedisHandle * h);
+
+/**
+ * @internal
+ * For a blocking handle with no replies waiting or part read. Reads the next reply
+ * and, if it is a single line (status, error or integer), decodes it into o without
+ * building a #Reply. A status or error points into the receive buffer, so is only
+ * valid until the handle next reads. Anything else is left to #redis_read.
+ * @return 1 if the reply was decoded into o, 0 if it is something else, or -1 on error.
+ */
+int redis_read_line(struct RedisHandle * h, struct Object *o);
+
+#define CACHE_READ  0 /** The command leaves the cache alone */
+#define CACHE_WRITE 1 /** The command may write to the keys in its arguments */
+#define CACHE_CLEAR 2 /** The command may write to any key */
+
+/**
+ * @internal
+ * Looks for the key in the handle's cache, counting a hit or miss.
+ * @param value Set to the cached value, or NULL if the key held no value
+ * @return 1 if the key was cached, otherwise 0.
+ */
+int redis_cache_lookup(struct RedisHandle * h, const char *key, size_t len, const char **value, size_t *valueLen);
+
+/**
+ * @internal
+ * Caches the result of a GET, value NULL if the key held no value. Does nothing
+ * without a cache.
+ */
+void redis_cache_store(struct RedisHandle * h, const char *key, size_t len, const char *value, size_t valueLen);
+
+/**
+ * @internal
+ * @return What sending the named command does to the cache, one of CACHE_READ, CACHE_WRITE or CACHE_CLEAR.
+ */
+int redis_cache_command(const struct Object *name);
+
+/**
+ * @internal
+ * Drops whatever a command being sent may change from the handle's cache.
+ * @param action From #redis_cache_command
+ * @param argc The number of arguments, after the command's name
+ */
+void redis_cache_written(struct RedisHandle * h, int action, const int argc, const struct Object argv[]);
+
+/**
+ * @internal
+ * Frees the cache and its entries.
+ */
+void redis_cache_free(struct RedisCache *c);
+
+/**
+ * @internal
+ * Fails any batched requests and frees the handle's batch.
+ */
+void redis_batch_free(struct RedisHandle * h);
+
+/**
+ * @internal
+ * Fails the batched requests waiting for replies, after the connection has been replaced.
+ */
+void redis_batch_reset(struct RedisHandle * h);
+
+/**
+ * @internal
+ * @return How many ms until the handle's batched requests must be sent, 0 if they are
+ *         due now, or -1 if none are queued.
+ */
+int redis_batch_due(const struct RedisHandle * h);
+
+/**
+ * @internal
+ * Registers into to receive the value of the reply to the next command sent.
+ * @return 0 on success, -1 on failure.
+ */
+int redis_into_expect(struct RedisHandle * h, struct RedisInto *into);
+
+/**
+ * @internal
+ * Stops into being written to, such as when its command could not be sent.
+ */
+void redis_into_forget(struct RedisHandle * h, struct RedisInto *into);
+
+/**
+ * @internal
+ * Sets every buffer still waiting for a reply to #REDIS_INTO_ERROR, after the
+ * connection has been replaced.
+ */
+void redis_into_reset(struct RedisHandle * h);
+
+struct RedisCommand;
+
+/**
+ * @internal
+ * Sends one of the commands in the table, as a multi-bulk command with its name
+ * already encoded. Like #redis_send_multibulk this queues the command if pipelining.
+ * @param argc The number of arguments, after the command's name
+ * @return 0 on success, -1 on failure.
+ */
+int redis_send_command(struct RedisHandle * h, const struct RedisCommand *cmd, const int argc, const struct Object argv[]);
+
+/**
+ * @internal
+ * Encodes a multi-bulk command onto the end of b, without a handle, so it can be
+ * done on a thread other than the one which sends it.
+ * @return 0 on success, -1 on failure.
+ */
+int redis_encode_multibulk(struct Buffer *b, const int argc, const struct Object argv[]);
+
+#define REDIS_INT64_LEN 20 /** The most characters an int64 can be formatted into, "-9223372036854775808" */
+
+/**
+ * @internal
+ * Parses a decimal integer, which must be len characters of digits with an optional
+ * leading '-'. Anything else, or a number which does not fit, is rejected.
+ * @return 0 on success, -1 if str is not a valid int64.
+ */
+int redis_parse_int64(const char *str, size_t len, int64_t *num);
+
+/**
+ * @internal
+ * Formats num in decimal into buf (which must hold #REDIS_INT64_LEN characters).
+ * buf is not NUL terminated.
+ * @return The number of characters written.
+ */
+size_t redis_format_int64(char *buf, int64_t num);
+
+/**
+ * @internal
+ * As #redis_format_int64 but for unsigned numbers, such as lengths.
+ */
+size_t redis_format_uint64(char *buf, uint64_t num);
+
+/**
+ * @internal
+ * Allocates size bytes from a, or from malloc if a is NULL.
+ */
+static inline void * redis_mem_alloc(const struct RedisAllocator *a, size_t size) {
+	if (a == NULL)
+		return malloc(size);
+	return a->alloc(a->ctx, size);
+}
+
+/**
+ * @internal
+ * Gives back size bytes allocated by #redis_mem_alloc.
+ */
+static inline void redis_mem_release(const struct RedisAllocator *a, void *ptr, size_t size) {
+	if (a == NULL)
+		free(ptr);
+	else if (ptr != NULL)
+		a->release(a->ctx, ptr, size);
+}
+
+/**
+ * @internal
+ * Creates a new slab allocator.
+ * @return The arena, or NULL on failure.
+ */
+struct RedisArena * redis_arena_alloc(void);
+
+/**
+ * @internal
+ * @return The allocator which hands out memory from the arena.
+ */
+const struct RedisAllocator * redis_arena_allocator(struct RedisArena *arena);
+
+/**
+ * @internal
+ * The arena's owner is finished with it. It is freed once all the memory
+ * it handed out has been given back.
+ */
+void redis_arena_detach(struct RedisArena *arena);
+
+/**
+ * @internal
+ * Queues everything in the send buffer to be written through the handle's io_uring,
+ * leaving the send buffer empty.
+ * @return 0 on success, -1 on failure.
+ */
+int redis_uring_send(struct RedisHandle * h);
+
+/**
+ * @internal
+ * Submits any queued writes, and waits for them to complete.
+ * @return 0 on success, -1 on failure.
+ */
+int redis_uring_flush(struct RedisHandle * h);
+
+/**
+ * @internal
+ * Copies up to len bytes of received data into dst, submitting any queued writes and
+ * waiting if nothing has arrived yet.
+ * @return The number of bytes copied, or -1 on failure.
+ */
+int redis_uring_recv(struct RedisHandle * h, char *dst, size_t len);
+
+/**
+ * @internal
+ * Writes anything still queued, then stops using io_uring, before the socket is closed.
+ */
+void redis_uring_free(struct RedisHandle * h);
+
+/**
+ * @internal
+ * Tells the loop driving h whether it should wait for h's socket to become
+ * writable, depending on whether h has any queued data.
+ * @return 0 on success, -1 on failure.
+ */
+int redis_loop_update(struct RedisHandle * h);
+
+/**
+ * @internal
+ * Tells the handle's loop it has batched requests, so the loop sends them when they are due.
+ */
+void redis_loop_batched(struct RedisHandle * h);
+
+/**
+ * @internal
+ * Counts commands being sent, and notes when, so their round trips can be timed.
+ * @param commands How many commands are being sent
+ */
+void redis_stats_sent(struct RedisHandle * h, unsigned int commands);
+
+/**
+ * @internal
+ * Counts a reply, and times the round trip of the command it answers.
+ */
+void redis_stats_reply(struct RedisHandle * h);
+
+/**
+ * @internal
+ * Forgets the commands waiting for replies, as the connection has changed.
+ */
+void redis_stats_reset_inflight(struct RedisHandle * h);
+
+#endif /* LIBREDIS_PRIVATE_H_ */
@@ -3,57 +3,177 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 
+#if defined(__AVX2__)
+# include <immintrin.h>
+#elif defined(__SSE2__)
+# include <emmintrin.h>
+#endif
+
 static int state_waiting(struct RedisHandle * h);
 static int state_read_bulk(struct RedisHandle * h);
 static int state_read_multibulk(struct RedisHandle * h);
+static int state_stream(struct RedisHandle * h);
+
+/**
+ * @internal
+ * Works out why recv did not return any data.
+ * @param h
+ * @param len What recv returned
+ * @return 0 if a non-blocking socket just has nothing to read, otherwise -1.
+ */
+static int recv_failed(struct RedisHandle * h, int len) {
+	if (len == 0) {
+		h->lastErr = "Error reading from redis server, connection closed";
+		h->failed  = 1;
+		return -1;
+	}
+
+	if (errno == EINTR || (h->nonblocking && (errno == EAGAIN || errno == EWOULDBLOCK)))
+		return 0;
+
+	h->lastErr = "Error reading from redis server";
+	h->failed  = 1;
+	return -1;
+}
 
 /**
  * @internal
  * Recvs some more data into the buffer
  * @param h
  * @param hint The amount of data we need
- * @return
+ * @return The number of bytes received, 0 if there was nothing to receive, or -1 on error.
  */
 static int redis_readmore(struct RedisHandle * h, size_t hint) {
 
 	int len;
 
-	buffer_reserveExtra(&h->buf, hint);
-
-	len = recv(h->socket, buffer_end(&h->buf), buffer_available(&h->buf), 0);
-	if (len <= 0) {
-		h->lastErr = "Error reading from redis server";
+	if (buffer_reserveExtra(&h->buf, hint > h->readLen ? hint : h->readLen) == NULL) {
+		h->lastErr = "Error allocating receive buffer";
 		return -1;
 	}
 
+	if (h->uring != NULL) {
+		len = redis_uring_recv(h, buffer_end(&h->buf), buffer_available(&h->buf));
+		if (len < 0)
+			return -1;
+	} else {
+		len = recv(h->socket, buffer_end(&h->buf), buffer_available(&h->buf), 0);
+		h->stats.recvCalls++;
+		if (len <= 0)
+			return recv_failed(h, len);
+	}
+
+	/* A full recv means more is probably waiting, so ask for more next time. Once
+	 * recvs have kept coming back mostly empty, ask for less, so the buffer can
+	 * shrink again. Replies arriving in bursts give a mix of both, and shouldn't
+	 * make the buffer bounce between sizes */
+	if ((size_t)len >= h->readLen) {
+		h->readShort = 0;
+		if (h->readLen < MAX_READ_LENGTH)
+			h->readLen *= 2;
+	} else if ((size_t)len >= h->readLen / 4) {
+		h->readShort = 0;
+	} else if (++h->readShort >= READ_SHORT_STREAK && h->readLen > UNKNOWN_READ_LENGTH) {
+		h->readShort = 0;
+		h->readLen /= 2;
+	}
+
+	h->stats.bytesReceived += len;
 	buffer_push(&h->buf, len);
 	return len;
 }
 
+/**
+ * @internal
+ * Recvs the rest of the current bulk reply straight into the reply's #Object,
+ * so large values never pass through the receive buffer.
+ * @param h
+ * @return The number of bytes received, 0 if there was nothing to receive, or -1 on error.
+ */
+static int redis_readbulk(struct RedisHandle * h) {
+
+	struct Object * o = h->bulk;
+	int len;
+
+	assert(o != NULL);
+	assert(h->bulkPos < o->len);
+
+	if (h->uring != NULL) {
+		len = redis_uring_recv(h, o->ptr + h->bulkPos, o->len - h->bulkPos);
+		if (len < 0)
+			return -1;
+	} else {
+		len = recv(h->socket, o->ptr + h->bulkPos, o->len - h->bulkPos, 0);
+		h->stats.recvCalls++;
+		if (len <= 0)
+			return recv_failed(h, len);
+	}
+
+	h->stats.bytesReceived += len;
+	h->bulkPos += len;
+	return len;
+}
+
+/**
+ * @internal
+ * Finds the first \n between ptr and ptrEnd. Whole blocks are compared with
+ * SSE2 or AVX2 (whichever the compiler was told it may use), and anything
+ * left over is handed to memchr.
+ * @return The \n, or NULL if there isn't one.
+ */
+static char * find_newline(char *ptr, char *ptrEnd) {
+
+#if defined(__AVX2__)
+	const __m256i nl = _mm256_set1_epi8('\n');
+
+	while (ptrEnd - ptr >= 32) {
+		__m256i block = _mm256_loadu_si256((const __m256i *)ptr);
+		unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, nl));
+		if (mask)
+			return ptr + __builtin_ctz(mask);
+		ptr += 32;
+	}
+#endif
+
+#if defined(__SSE2__)
+	const __m128i nl16 = _mm_set1_epi8('\n');
+
+	while (ptrEnd - ptr >= 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *)ptr);
+		unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, nl16));
+		if (mask)
+			return ptr + __builtin_ctz(mask);
+		ptr += 16;
+	}
+#endif
+
+	if (ptr >= ptrEnd)
+		return NULL;
+
+	return memchr(ptr, '\n', ptrEnd - ptr);
+}
+
 char * redis_readLine(struct RedisHandle * h) {
 
-	char * ptr    = buffer_start(&h->buf);
-	char * ptrEnd = buffer_end  (&h->buf);
+	char * ptrStart = buffer_start(&h->buf);
+	char * ptrEnd   = buffer_end  (&h->buf);
+	char * ptr      = ptrStart + h->linePos;
 
-	/* Keep reading until we find \r\n */
-	ptr += h->linePos + 1;
-	while ( ptr < ptrEnd ) {
-		if (*(ptr - 1) == '\r' && *ptr == '\n') {
+	/* Keep looking for a \n (which follows a \r), starting from where we got to last time */
+	while ( (ptr = find_newline(ptr, ptrEnd)) != NULL ) {
+		if (ptr > ptrStart && *(ptr - 1) == '\r') {
 			h->linePos = 0;
 			return ptr;
 		}
-
-		/* We can skip 1 if this character isn't a \r */
-		if (*ptr != '\r')
-			ptr+=2;
-		else
-			ptr++;
+		ptr++;
 	}
 
-	/* Record state of how far we got */
-	h->linePos = ptr - buffer_start(&h->buf);
+	/* Record state of how far we got, none of this data contains a \n */
+	h->linePos = ptrEnd - ptrStart;
 
 	return NULL;
 }
@@ -62,50 +182,280 @@ char * redis_readLine(struct RedisHandle * h) {
 /**
  * Parses a int from the line, ignoring the first character
  * @param line
+ * @param len The length of the line, up to but not including the \n
  * @param num The parsed number
- * @return
+ * @return 0 on success, -1 if the line does not hold a valid number.
  */
-static int parse_int(const char *line, int *num) {
+static int parse_int(const char *line, size_t len, int64_t *num) {
 	assert(line != NULL);
 	assert(num  != NULL);
 
-	*num = atol(line);
+	/* Skip the type character and the \r */
+	if (len < 2)
+		return -1;
 
-	/* Is zero a valid number? Why does atol not tell us if a problem occured :( */
+	return redis_parse_int64(line + 1, len - 2, num);
+}
+
+/**
+ * @internal
+ * Copies an inline (error or status) line into o, or parses an integer
+ * into it, and shifts the line off the buffer.
+ * @param len The length of the line, up to but not including the \n
+ * @return 0 on success, -1 on error.
+ */
+static int read_inline(struct RedisHandle * h, struct Object *o, size_t len) {
+
+	if (*buffer_start(&h->buf) == ':') {
+		if ( parse_int(buffer_start(&h->buf), len, &o->integer) ) {
+			h->lastErr = "Error parsing integer from reponse";
+			return -1;
+		}
+		o->type = REDIS_TYPE_INT;
+
+		buffer_unshift(&h->buf, len + 1);
+		return 0;
+	}
+
+	/* Copy the line without its trailing \r */
+	if (redis_object_init_copy_with(h->allocator, o, buffer_start(&h->buf), len - 1) == NULL) {
+		h->lastErr = "Error allocating a Object struct";
+		return -1;
+	}
+
+	/* Status and error lines are STR, so they can't be mistaken for bulk values */
+	o->type = REDIS_TYPE_STR;
+
+	/* Shift this data (and the \n) off the buffer now */
+	buffer_unshift(&h->buf, len + 1);
 
 	return 0;
 }
 
-
 static int return_read_inline(struct RedisHandle * h, size_t len) {
 
 	struct Reply * reply;
-	struct Object *o;
 
 	/* Store the result */
-	reply = redis_reply_alloc(1);
+	reply = redis_reply_alloc_with(h->allocator, 1);
 	if (reply == NULL) {
 		h->lastErr = "Error allocating a Reply struct";
 		return -1;
 	}
 
-	o = redis_object_init_copy(&reply->argv[0], buffer_start(&h->buf), len);
-	if (o == NULL) {
+	if (read_inline(h, &reply->argv[0], len)) {
 		redis_reply_free(reply);
-		h->lastErr = "Error allocating a Object struct";
 		return -1;
 	}
 
-	/* Shift this data off the buffer now */
-	buffer_unshift(&h->buf, len);
-
 	/* Push the reply onto the handle */
-	redis_reply_temp_push(h, reply);
+	if (redis_reply_temp_push(h, reply)) {
+		redis_reply_free(reply);
+		return -1;
+	}
 	redis_reply_push(h);
 
 	return 0;
 }
 
+/**
+ * @internal
+ * Parses the N from a $N line, and shifts the line off the buffer. The
+ * value itself will then be read straight into o.
+ * @param len The length of the line, up to but not including the \n
+ * @return 0 if the bulk value needs reading, 1 if it was nil, -1 on error.
+ */
+static int begin_bulk(struct RedisHandle * h, struct Object *o, size_t len) {
+	int64_t num;
+
+	if ( parse_int(buffer_start(&h->buf), len, &num) || num > (int64_t)(SIZE_MAX / 2) ) {
+		h->lastErr = "Error parsing integer from reponse";
+		return -1;
+	}
+
+	/* The header is no longer needed */
+	buffer_unshift(&h->buf, len + 1);
+
+	/* $-1 is a nil reply, which is left as a blank object */
+	if (num < 0) {
+		o->type = REDIS_TYPE_RAW;
+		return 1;
+	}
+
+	if (redis_object_init_with(h->allocator, o, num) == NULL) {
+		h->lastErr = "Error allocating a Object struct";
+		return -1;
+	}
+	o->type = REDIS_TYPE_RAW;
+
+	h->bulk    = o;
+	h->bulkPos = 0;
+
+	return 0;
+}
+
+/**
+ * @internal
+ * As #begin_bulk, but the value is read into the caller's buffer h->into. Whatever
+ * doesn't fit is discarded as it arrives.
+ * @return 0 if the bulk value needs reading, 1 if it was nil, -1 on error.
+ */
+static int begin_bulk_into(struct RedisHandle * h, struct Object *o, size_t len) {
+	struct RedisInto *into = h->into;
+	int64_t num;
+
+	if ( parse_int(buffer_start(&h->buf), len, &num) || num > (int64_t)(SIZE_MAX / 2) ) {
+		h->lastErr = "Error parsing integer from reponse";
+		return -1;
+	}
+
+	buffer_unshift(&h->buf, len + 1);
+
+	o->type = REDIS_TYPE_RAW;
+
+	if (num < 0) {
+		into->len    = 0;
+		into->status = REDIS_INTO_NIL;
+		h->into = NULL;
+		return 1;
+	}
+
+	o->ptr      = into->dst;
+	o->len      = (size_t)num < into->cap ? (size_t)num : into->cap;
+	o->ptrOwned = 0;
+	into->len   = num;
+
+	h->bulk     = o;
+	h->bulkPos  = 0;
+	h->bulkSkip = num - o->len;
+
+	return 0;
+}
+
+/**
+ * @internal
+ * Takes the buffer waiting for the reply about to be read, if there is one.
+ * Buffers left waiting for replies which have already been read (because the
+ * handle was in streaming mode) are given #REDIS_INTO_ERROR.
+ */
+static struct RedisInto * into_next(struct RedisHandle * h) {
+	while (h->intoCount > 0) {
+		struct RedisIntoWait *w = &h->intoRing[h->intoHead];
+
+		if (w->seq > h->replySeq + 1)
+			return NULL;
+
+		h->intoHead = (h->intoHead + 1) & (h->intoCap - 1);
+		h->intoCount--;
+
+		if (w->seq == h->replySeq + 1)
+			return w->into;
+
+		w->into->status = REDIS_INTO_ERROR;
+	}
+
+	return NULL;
+}
+
+int redis_into_expect(struct RedisHandle * h, struct RedisInto *into) {
+	struct RedisIntoWait *w;
+
+	if (h->intoCount == h->intoCap) {
+		unsigned int cap = h->intoCap ? h->intoCap * 2 : 16;
+		struct RedisIntoWait *ring = malloc(cap * sizeof(struct RedisIntoWait));
+		unsigned int i;
+
+		if (ring == NULL) {
+			h->lastErr = "Error allocating a RedisIntoWait struct";
+			return -1;
+		}
+
+		for (i = 0; i < h->intoCount; i++)
+			ring[i] = h->intoRing[(h->intoHead + i) & (h->intoCap - 1)];
+
+		free(h->intoRing);
+		h->intoRing = ring;
+		h->intoCap  = cap;
+		h->intoHead = 0;
+	}
+
+	/* Queued commands are counted when the pipeline is flushed, in order */
+	w = &h->intoRing[(h->intoHead + h->intoCount++) & (h->intoCap - 1)];
+	w->seq  = h->commandSeq + h->pipelined + 1;
+	w->into = into;
+
+	into->len    = 0;
+	into->status = REDIS_INTO_PENDING;
+
+	return 0;
+}
+
+void redis_into_forget(struct RedisHandle * h, struct RedisInto *into) {
+	unsigned int i, kept = 0;
+
+	if (h->into == into)
+		h->into = NULL;
+
+	for (i = 0; i < h->intoCount; i++) {
+		const struct RedisIntoWait *w = &h->intoRing[(h->intoHead + i) & (h->intoCap - 1)];
+		if (w->into != into)
+			h->intoRing[(h->intoHead + kept++) & (h->intoCap - 1)] = *w;
+	}
+
+	h->intoCount = kept;
+}
+
+void redis_into_reset(struct RedisHandle * h) {
+	if (h->into != NULL) {
+		h->into->status = REDIS_INTO_ERROR;
+		h->into = NULL;
+	}
+
+	while (h->intoCount > 0) {
+		h->intoRing[h->intoHead].into->status = REDIS_INTO_ERROR;
+		h->intoHead = (h->intoHead + 1) & (h->intoCap - 1);
+		h->intoCount--;
+	}
+}
+
+/**
+ * @internal
+ * Parses the N from a *N line, shifts the line off the buffer, and starts
+ * reading a multi-bulk reply of N arguments into a freshly allocated #Reply.
+ * @param len The length of the line, up to but not including the \n
+ * @return The new reply, or NULL on error.
+ */
+static struct Reply * begin_multibulk(struct RedisHandle * h, size_t len) {
+	struct MultiBulkState *m;
+	struct Reply *reply;
+	int64_t num;
+
+	if ( parse_int(buffer_start(&h->buf), len, &num) || num > INT_MAX ) {
+		h->lastErr = "Error parsing integer from reponse";
+		return NULL;
+	}
+
+	if (h->depth == REDIS_MAX_DEPTH) {
+		h->lastErr = "Error reading response, multi-bulk replies nested too deeply";
+		return NULL;
+	}
+
+	buffer_unshift(&h->buf, len + 1);
+
+	/* Allocate all N arguments up front. *-1 (nil) is treated as empty */
+	reply = redis_reply_alloc_with(h->allocator, num > 0 ? num : 0);
+	if (reply == NULL) {
+		h->lastErr = "Error allocating a Reply struct";
+		return NULL;
+	}
+
+	m = &h->multi[h->depth++];
+	m->reply = reply;
+	m->pos   = 0;
+
+	return reply;
+}
+
 /**
  * @internal
  * We are waiting for commands
@@ -114,7 +464,7 @@ static int return_read_inline(struct RedisHandle * h, size_t len) {
  */
 static int state_waiting(struct RedisHandle * h) {
 	const char * lineEnd;
-	int num;
+	int ret;
 
 	assert(h->state == STATE_WAITING);
 
@@ -122,11 +472,18 @@ static int state_waiting(struct RedisHandle * h) {
 	lineEnd = redis_readLine(h);
 	if (lineEnd) {
 		struct Reply  * reply;
-		struct Object * o;
 
 		const char *line = buffer_start(&h->buf);
 		size_t len = lineEnd - line;
 
+		/* Only a bulk value can go into a caller's buffer */
+		if (h->intoCount > 0)
+			h->into = into_next(h);
+		if (h->into != NULL && line[0] != '$') {
+			h->into->status = REDIS_INTO_ERROR;
+			h->into = NULL;
+		}
+
 		switch (line[0]) {
 			case '-': /* Error   */
 			case '+': /* OK      */
@@ -134,37 +491,50 @@ static int state_waiting(struct RedisHandle * h) {
 				return return_read_inline(h, len);
 
 			case '$': /* $N\r\n Keep reading for N bytes and then a \r\n */
-				h->state = STATE_READ_BULK;
-				if ( parse_int(line, &num) ) {
-					h->lastErr = "Error parsing integer from reponse";
-					return -1;
-				}
-
 				/* Create new reply (with one argument) */
-				reply = redis_reply_alloc(1);
+				reply = redis_reply_alloc_with(h->allocator, 1);
 				if (reply == NULL) {
 					h->lastErr = "Error allocating a Reply struct";
 					return -1;
 				}
 
-				o = redis_object_init(&reply->argv[0], num);
-				if (o == NULL) {
+				if (h->into != NULL)
+					ret = begin_bulk_into(h, &reply->argv[0], len);
+				else
+					ret = begin_bulk(h, &reply->argv[0], len);
+				if (ret < 0) {
+					redis_reply_free(reply);
+					return -1;
+				}
+
+				if (redis_reply_temp_push(h, reply)) {
 					redis_reply_free(reply);
-					h->lastErr = "Error allocating a Object struct";
 					return -1;
 				}
 
-				redis_reply_temp_push(h, reply);
+				/* A nil reply is already complete */
+				if (ret > 0) {
+					redis_reply_push(h);
+					return 0;
+				}
+
+				h->state = STATE_READ_BULK;
 
 				return state_read_bulk(h);
 
 			case '*': /* *N\r\n Do N RECV_BULK */
-				h->state = STATE_READ_MULTI_BULK;
+				reply = begin_multibulk(h, len);
+				if (reply == NULL)
+					return -1;
+
+				if (redis_reply_temp_push(h, reply)) {
+					redis_reply_free(reply);
+					return -1;
+				}
 
-				parse_int(line, &num);
+				h->state = STATE_READ_MULTI_BULK;
 
 				return state_read_multibulk(h);
-				break;
 
 			default:
 				h->lastErr = "Error reading response, unknown reply";
@@ -175,39 +545,468 @@ static int state_waiting(struct RedisHandle * h) {
 	return UNKNOWN_READ_LENGTH;
 }
 
-static int state_read_bulk(struct RedisHandle * h) {
+/**
+ * @internal
+ * Reads the rest of the bulk value into h->bulk, followed by its \r\n.
+ * @param h
+ * @return The number of more bytes we need, 0 once finished, or -1 on error
+ */
+static int read_bulk(struct RedisHandle * h) {
+
+	struct Object * o = h->bulk;
+	size_t len;
+
+	assert(o != NULL);
+
+	/* Copy across any of the value which arrived along with the header. The rest
+	 * is received straight into the reply by #redis_readbulk */
+	if (h->bulkPos < o->len) {
+		len = o->len - h->bulkPos;
+		if (len > buffer_len(&h->buf))
+			len = buffer_len(&h->buf);
+
+		memcpy(o->ptr + h->bulkPos, buffer_start(&h->buf), len);
+		buffer_unshift(&h->buf, len);
+		h->bulkPos += len;
+
+		if (h->bulkPos < o->len)
+			return o->len - h->bulkPos < MAX_READ_LENGTH ? o->len - h->bulkPos : MAX_READ_LENGTH;
+	}
+
+	/* Discard whatever didn't fit in the caller's buffer */
+	if (h->bulkSkip > 0) {
+		len = h->bulkSkip;
+		if (len > buffer_len(&h->buf))
+			len = buffer_len(&h->buf);
+
+		buffer_unshift(&h->buf, len);
+		h->bulkSkip -= len;
+
+		if (h->bulkSkip > 0)
+			return h->bulkSkip < MAX_READ_LENGTH ? h->bulkSkip : MAX_READ_LENGTH;
+	}
+
+	/* Only the trailing \r\n goes through the buffer */
+	if (buffer_len(&h->buf) < 2)
+		return 2 - buffer_len(&h->buf);
 
-	struct Object * o = &h->lastReply->argv[0];
-	size_t len = o->len;
+	if (memcmp(buffer_start(&h->buf), "\r\n", 2) != 0) {
+		h->lastErr = "Error reading bulk reply, missing newline";
+		return -1;
+	}
+
+	/* Shift the \r\n off the buffer now */
+	buffer_unshift(&h->buf, 2);
+
+	h->bulk = NULL;
+
+	return 0;
+}
 
-	if (buffer_len(&h->buf) < len)
-		return len - buffer_len(&h->buf);
+static int state_read_bulk(struct RedisHandle * h) {
 
-	/* Copy the data into the reply */
-	/* TODO Reduce the copies, by setting this reply as a buffer when we start to read the bulk */
-	memcpy(o->ptr, buffer_start(&h->buf), len);
+	int need = read_bulk(h);
+	if (need != 0)
+		return need;
 
-	/* Shift this data off the buffer now */
-	buffer_unshift(&h->buf, len);
+	if (h->into != NULL) {
+		h->into->status = h->into->len > h->into->cap ? REDIS_INTO_TRUNCATED : REDIS_INTO_OK;
+		h->into = NULL;
+	}
 
 	/* and finally push this reply on */
 	redis_reply_push(h);
 
 	return 0;
-
 }
 
+/**
+ * @internal
+ * Reads the arguments of a multi-bulk reply, which may themselves be nested
+ * multi-bulk replies. This may stop (and later resume) at any point, the
+ * progress is kept in h->multi.
+ * @param h
+ * @return The number of more bytes we need
+ */
 static int state_read_multibulk(struct RedisHandle * h) {
+
+	struct MultiBulkState *m;
+	struct Reply *nested;
+	struct Object *o;
+	const char *lineEnd;
+	size_t len;
+	int ret;
+
+	assert(h->depth > 0);
+
+	for (;;) {
+		m = &h->multi[h->depth - 1];
+
+		/* Finish off any bulk argument we are part way through */
+		if (h->bulk) {
+			ret = read_bulk(h);
+			if (ret != 0)
+				return ret;
+			m->pos++;
+		}
+
+		/* Step out of every multi-bulk which now has all its arguments */
+		while (m->pos == m->reply->argc) {
+			h->depth--;
+			if (h->depth == 0) {
+				redis_reply_push(h);
+				return 0;
+			}
+			m = &h->multi[h->depth - 1];
+			m->pos++;
+		}
+
+		/* We can't continue until the next argument's line has been read */
+		lineEnd = redis_readLine(h);
+		if (lineEnd == NULL)
+			return UNKNOWN_READ_LENGTH;
+
+		len = lineEnd - buffer_start(&h->buf);
+		o   = &m->reply->argv[m->pos];
+
+		switch (*buffer_start(&h->buf)) {
+			case '-': /* Error   */
+			case '+': /* OK      */
+			case ':': /* Integer */
+				if (read_inline(h, o, len))
+					return -1;
+				m->pos++;
+				break;
+
+			case '$': /* Bulk argument, nil arguments are already complete */
+				ret = begin_bulk(h, o, len);
+				if (ret < 0)
+					return -1;
+				if (ret > 0)
+					m->pos++;
+				break;
+
+			case '*': /* Nested multi-bulk, finished once all its arguments are */
+				nested = begin_multibulk(h, len);
+				if (nested == NULL)
+					return -1;
+
+				o->ptr      = (char *)nested;
+				o->len      = 0;
+				o->type     = REDIS_TYPE_MULTIBULK;
+				o->ptrOwned = 1;
+				break;
+
+			default:
+				h->lastErr = "Error reading response, unknown reply";
+				return -1;
+		}
+	}
+}
+
+/**
+ * @internal
+ * Counts an element handed over in streaming mode, stepping out of every
+ * multi-bulk which now has all its elements.
+ * @return 1 if that was the end of the reply, otherwise 0.
+ */
+static int stream_element_done(struct RedisHandle * h) {
+	while (h->depth > 0) {
+		struct MultiBulkState *m = &h->multi[h->depth - 1];
+
+		if (++m->pos < m->count)
+			return 0;
+		h->depth--;
+	}
+
+	return 1;
+}
+
+/**
+ * @internal
+ * Hands the rest of the bulk value being streamed to the chunk callback, a receive
+ * buffer at a time, and then checks its \r\n.
+ * @return The number of more bytes we need, 0 once finished, or -1 on error
+ */
+static int stream_bulk(struct RedisHandle * h) {
+	size_t len = h->streamLen - h->streamPos;
+
+	if (len > buffer_len(&h->buf))
+		len = buffer_len(&h->buf);
+
+	if (len > 0) {
+		if (h->streamChunk != NULL)
+			h->streamChunk(h, buffer_start(&h->buf), len, h->streamPos, h->streamLen, h->streamArg);
+		buffer_unshift(&h->buf, len);
+		h->streamPos += len;
+	}
+
+	/* Never ask for more than one recv's worth, however much is left */
+	if (h->streamPos < h->streamLen)
+		return h->streamLen - h->streamPos < MAX_READ_LENGTH ? h->streamLen - h->streamPos : MAX_READ_LENGTH;
+
+	if (buffer_len(&h->buf) < 2)
+		return 2 - buffer_len(&h->buf);
+
+	if (memcmp(buffer_start(&h->buf), "\r\n", 2) != 0) {
+		h->lastErr = "Error reading bulk reply, missing newline";
+		return -1;
+	}
+
+	buffer_unshift(&h->buf, 2);
+	h->streamBulk = 0;
+
+	return 0;
+}
+
+/**
+ * @internal
+ * Hands a reply to the stream callbacks as it is parsed, keeping only the position
+ * in each multi-bulk. Once all of it has been handed over an empty reply is pushed,
+ * so it is counted like any other.
+ * @return The number of more bytes we need, 0 once finished, or -1 on error
+ */
+static int state_stream(struct RedisHandle * h) {
+	struct Reply *reply;
+	struct Object o;
+	const char *lineEnd;
+	const char *line;
+	size_t len;
+	int64_t num;
+	int ret;
+
+	for (;;) {
+		if (h->streamBulk) {
+			ret = stream_bulk(h);
+			if (ret != 0)
+				return ret;
+			if (stream_element_done(h))
+				break;
+		}
+
+		/* We can't continue until the next element's line has been read. If the reply
+		 * hasn't started yet, it isn't committed to streaming */
+		lineEnd = redis_readLine(h);
+		if (lineEnd == NULL) {
+			if (h->depth == 0)
+				h->state = STATE_WAITING;
+			return UNKNOWN_READ_LENGTH;
+		}
+
+		line = buffer_start(&h->buf);
+		len  = lineEnd - line;
+
+		memset(&o, 0, sizeof(o));
+
+		switch (line[0]) {
+			case '-': /* Error   */
+			case '+': /* OK      */
+				/* Handed over straight from the buffer, without its \r */
+				o.ptr  = (char *)line;
+				o.len  = len - 1;
+				o.type = REDIS_TYPE_STR;
+				if (h->streamElement != NULL)
+					h->streamElement(h, h->depth, &o, h->streamArg);
+				buffer_unshift(&h->buf, len + 1);
+				break;
+
+			case ':': /* Integer */
+				if (parse_int(line, len, &o.integer)) {
+					h->lastErr = "Error parsing integer from reponse";
+					return -1;
+				}
+				o.type = REDIS_TYPE_INT;
+				buffer_unshift(&h->buf, len + 1);
+				if (h->streamElement != NULL)
+					h->streamElement(h, h->depth, &o, h->streamArg);
+				break;
+
+			case '$': /* Bulk value, handed over as it arrives */
+				if (parse_int(line, len, &num) || num > (int64_t)(SIZE_MAX / 2)) {
+					h->lastErr = "Error parsing integer from reponse";
+					return -1;
+				}
+				buffer_unshift(&h->buf, len + 1);
+
+				if (num < 0) {
+					o.type = REDIS_TYPE_RAW;
+					if (h->streamElement != NULL)
+						h->streamElement(h, h->depth, &o, h->streamArg);
+					break;
+				}
+
+				/* Empty values still get a call, so every value has one with offset 0 */
+				if (num == 0 && h->streamChunk != NULL)
+					h->streamChunk(h, "", 0, 0, 0, h->streamArg);
+
+				h->streamBulk = 1;
+				h->streamLen  = num;
+				h->streamPos  = 0;
+				continue;
+
+			case '*': /* Multi-bulk, finished once all its elements are */
+				if (parse_int(line, len, &num) || num > INT_MAX) {
+					h->lastErr = "Error parsing integer from reponse";
+					return -1;
+				}
+				if (h->depth == REDIS_MAX_DEPTH) {
+					h->lastErr = "Error reading response, multi-bulk replies nested too deeply";
+					return -1;
+				}
+				buffer_unshift(&h->buf, len + 1);
+
+				/* *-1 (nil) is treated as empty */
+				o.type    = REDIS_TYPE_MULTIBULK;
+				o.integer = num > 0 ? num : 0;
+				if (h->streamElement != NULL)
+					h->streamElement(h, h->depth, &o, h->streamArg);
+
+				if (num > 0) {
+					h->multi[h->depth].reply = NULL;
+					h->multi[h->depth].pos   = 0;
+					h->multi[h->depth].count = num;
+					h->depth++;
+					continue;
+				}
+				break;
+
+			default:
+				h->lastErr = "Error reading response, unknown reply";
+				return -1;
+		}
+
+		if (stream_element_done(h))
+			break;
+	}
+
+	reply = redis_reply_alloc_with(h->allocator, 0);
+	if (reply == NULL) {
+		h->lastErr = "Error allocating a Reply struct";
+		return -1;
+	}
+
+	if (redis_reply_temp_push(h, reply)) {
+		redis_reply_free(reply);
+		return -1;
+	}
+	redis_reply_push(h);
+
 	return 0;
 }
 
+void redis_stream(struct RedisHandle * h, redis_chunk_callback chunk, redis_element_callback element, void *arg) {
+	assert(h != NULL);
+
+	h->streamChunk   = chunk;
+	h->streamElement = element;
+	h->streamArg     = arg;
+	h->streaming     = 1;
+}
+
+void redis_stream_end(struct RedisHandle * h) {
+	assert(h != NULL);
+
+	h->streaming = 0;
+}
+
+/**
+ * @internal
+ * Runs the state machine over everything in the receive buffer.
+ * @param h
+ * @return The number of more bytes we need, or -1 on error.
+ */
+static int redis_parse(struct RedisHandle * h) {
+	int need;
+
+	do {
+		switch (h->state) {
+			case STATE_WAITING:
+				if (h->streaming) {
+					h->state = STATE_STREAM;
+					need = state_stream(h);
+				} else {
+					need = state_waiting(h);
+				}
+				break;
+			case STATE_STREAM:
+				need = state_stream(h);
+				break;
+			case STATE_READ_BULK:
+				need = state_read_bulk(h);
+				break;
+			case STATE_READ_MULTI_BULK:
+				need = state_read_multibulk(h);
+				break;
+			default:
+				need = -1;
+				break;
+		}
+
+		/* If no more bytes are needed, we can revert back to the waiting state */
+		if (need <= 0) {
+			h->state = STATE_WAITING;
+			h->bulk  = NULL;
+			h->bulkSkip = 0;
+			h->depth = 0;
+			h->streamBulk = 0;
+
+			if (h->into != NULL) {
+				h->into->status = REDIS_INTO_ERROR;
+				h->into = NULL;
+			}
+		}
+	} while (need == 0);
+
+	return need;
+}
+
+int redis_read_line(struct RedisHandle * h, struct Object *o) {
+	const char *lineEnd;
+	const char *line;
+	size_t len;
+
+	assert(h->replies == 0 && h->state == STATE_WAITING && !h->nonblocking);
+
+	while ((lineEnd = redis_readLine(h)) == NULL) {
+		if (redis_readmore(h, UNKNOWN_READ_LENGTH) < 0)
+			return -1;
+	}
+
+	line = buffer_start(&h->buf);
+	len  = lineEnd - line;
+
+	if (line[0] != '+' && line[0] != '-' && line[0] != ':')
+		return 0;
+
+	/* Integers are parsed as usual, but status lines aren't copied */
+	if (line[0] == ':') {
+		if (read_inline(h, o, len)) {
+			h->failed = 1;
+			return -1;
+		}
+	} else {
+		o->ptr      = (char *)line;
+		o->len      = len - 1;
+		o->type     = REDIS_TYPE_STR;
+		o->ptrOwned = 0;
+		buffer_unshift(&h->buf, len + 1);
+	}
+
+	redis_stats_reply(h);
+	return 1;
+}
+
 /**
+ * Parses any replies already received and then, if there is nothing new to return
+ * (or the handle is non-blocking), reads more from the socket and parses that too.
  *
  * @param h
  * @return How many replies are waiting, or -1 on error.
  */
 int redis_read(struct RedisHandle * h) {
-	int need = 0;
+	unsigned int replies;
+	int need;
+	int len;
 
 	assert(h != NULL);
 
@@ -216,28 +1015,32 @@ int redis_read(struct RedisHandle * h) {
 		return -1;
 	}
 
-	switch (h->state) {
-		case STATE_WAITING:
-			need = state_waiting(h);
-			break;
-		case STATE_READ_BULK:
-			need = state_read_bulk(h);
-			break;
-		case STATE_READ_MULTI_BULK:
-			need = state_read_multibulk(h);
-			break;
-	}
+	replies = h->replies;
 
-	/* If no more bytes are needed, we can revert back to the waiting state */
-	if (need <= 0) {
-		h->state = STATE_WAITING;
-	} else {
-		need = redis_readmore(h, need);
+	/* A reply we can't parse leaves us out of step with the server */
+	need = redis_parse(h);
+	if (need < 0) {
+		h->failed = 1;
+		return -1;
 	}
 
-	/* Did a error occur? */
-	if (need < 0)
-		return -1;
+	/* A blocking read would stall if we already had a reply to return */
+	if (h->nonblocking || h->replies == replies) {
+		/* Large values are received straight into the reply, but small ones go through
+		 * the buffer, so the replies after them arrive in the same recv */
+		if (h->bulk != NULL && h->bulk->len - h->bulkPos >= h->readLen)
+			len = redis_readbulk(h);
+		else
+			len = redis_readmore(h, need);
+
+		if (len < 0)
+			return -1;
+
+		if (len > 0 && redis_parse(h) < 0) {
+			h->failed = 1;
+			return -1;
+		}
+	}
 
 	/* Return how many replies are waiting */
 	return h->replies;
@@ -1,21 +1,29 @@
 #include "redis-c.h"
+#include "redis_private.h"
 
 #include <stdio.h>
 
-struct Reply * redis_reply_alloc(int argc) {
-	/* Malloc one Reply, and many Objects */
-	struct Reply * r;
+#define REPLY_RING_INITIAL 16 /** How many replies the ring starts with room for */
 
+/**
+ * @internal
+ * How much memory a Reply with argc responses needs
+ */
+static size_t reply_size(int argc) {
 	if (argc > 0)
-		r = malloc(sizeof(struct Reply) + (argc-1) * sizeof(struct Object));
-	else
-		r = malloc(sizeof(struct Reply));
+		return sizeof(struct Reply) + (argc-1) * sizeof(struct Object);
+	return sizeof(struct Reply);
+}
+
+struct Reply * redis_reply_alloc_with(const struct RedisAllocator *a, int argc) {
+	/* Allocate one Reply, and many Objects */
+	struct Reply * r = redis_mem_alloc(a, reply_size(argc));
 
 	if (r == NULL)
 		return NULL;
 
 	r->argc = argc;
-	r->next = NULL;
+	r->allocator = a;
 
 	/* Ensure the objects start blanked */
 	memset(&r->argv, 0, argc *  sizeof(struct Object));
@@ -23,41 +31,119 @@ struct Reply * redis_reply_alloc(int argc) {
 	return r;
 }
 
+struct Reply * redis_reply_alloc(int argc) {
+	return redis_reply_alloc_with(NULL, argc);
+}
+
+/**
+ * @internal
+ * Doubles the size of the reply ring, keeping the replies in order.
+ * @return 0 on success, -1 on failure.
+ */
+static int reply_ring_grow(struct RedisHandle * h) {
+	unsigned int cap = h->replyCap ? h->replyCap * 2 : REPLY_RING_INITIAL;
+	struct Reply **ring;
+	unsigned int i;
+
+	if (cap < h->replyCap)
+		return -1;
+
+	ring = malloc(cap * sizeof(struct Reply *));
+	if (ring == NULL)
+		return -1;
+
+	for (i = 0; i < h->replyCount; i++)
+		ring[i] = h->replyRing[(h->replyHead + i) & (h->replyCap - 1)];
+
+	free(h->replyRing);
+	h->replyRing = ring;
+	h->replyCap  = cap;
+	h->replyHead = 0;
+
+	return 0;
+}
+
 struct Reply * redis_reply_pop(struct RedisHandle * h) {
 	struct Reply *r;
 
 	if (h == NULL || h->replies == 0)
 		return NULL;
 
-	assert(h->reply != NULL);
+	r = h->replyRing[h->replyHead];
+	assert(r != NULL);
 
-	r = h->reply;
-	h->reply = h->reply->next;
+	h->replyHead = (h->replyHead + 1) & (h->replyCap - 1);
+	h->replyCount--;
 	h->replies--;
+
 	return r;
 }
 
-void redis_reply_temp_push(struct RedisHandle * h, struct Reply *r) {
-	if (h->lastReply)
-		h->lastReply->next = r;
+unsigned int redis_reply_pop_many(struct RedisHandle * h, struct Reply *replies[], unsigned int n) {
+	unsigned int first;
 
-	h->lastReply = r;
+	if (h == NULL)
+		return 0;
 
-	if (h->reply == NULL)
-		h->reply = r;
+	assert(replies != NULL || n == 0);
+
+	if (n > h->replies)
+		n = h->replies;
+
+	/* The replies may wrap around the end of the ring, so copy them in up to two runs */
+	first = h->replyCap - h->replyHead;
+	if (first > n)
+		first = n;
+
+	memcpy(replies, &h->replyRing[h->replyHead], first * sizeof(struct Reply *));
+	memcpy(replies + first, h->replyRing, (n - first) * sizeof(struct Reply *));
+
+	if (n > 0)
+		h->replyHead = (h->replyHead + n) & (h->replyCap - 1);
+	h->replyCount -= n;
+	h->replies    -= n;
+
+	return n;
+}
+
+int redis_reply_temp_push(struct RedisHandle * h, struct Reply *r) {
+	/* A reply left unfinished by an earlier error is of no use to anyone */
+	if (h->replyCount > h->replies) {
+		unsigned int last = (h->replyHead + h->replyCount - 1) & (h->replyCap - 1);
+		redis_reply_free(h->replyRing[last]);
+		h->replyCount--;
+	}
+
+	if (h->replyCount == h->replyCap && reply_ring_grow(h)) {
+		h->lastErr = "Error allocating reply ring";
+		return -1;
+	}
+
+	h->replyRing[(h->replyHead + h->replyCount++) & (h->replyCap - 1)] = r;
+	return 0;
 }
 
 void redis_reply_push(struct RedisHandle * h) {
 	h->replies++;
+	redis_stats_reply(h);
 }
 
 void redis_reply_free(struct Reply *r) {
+	const struct RedisAllocator *a = r->allocator;
 	unsigned int i;
 
 	for (i=0; i < r->argc; i++)
-		redis_object_cleanup(&r->argv[i]);
+		redis_object_cleanup_with(a, &r->argv[i]);
+
+	/* This may free the allocator, so it must be last */
+	redis_mem_release(a, r, reply_size(r->argc));
+}
+
+void redis_reply_free_many(struct Reply *replies[], unsigned int n) {
+	unsigned int i;
 
-	free(r);
+	for (i = 0; i < n; i++)
+		redis_reply_free(replies[i]);
 }
 
 void redis_reply_print(const struct Reply *r) {
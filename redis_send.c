@@ -1,25 +1,44 @@
 #include "redis-c.h"
+#include "redis_private.h"
+#include "redis_commands.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <stdio.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <poll.h>
+#include <strings.h>
+#include <time.h>
+
+#ifdef __linux__
+# include <linux/errqueue.h>
+#endif
+
+#ifdef MSG_NOSIGNAL
+# define SEND_FLAGS MSG_NOSIGNAL /** A dead connection should be an error, not a SIGPIPE */
+#else
+# define SEND_FLAGS 0
+#endif
 
 /**
  * @internal
  * Ensures all the data is sent. On Windows send may not send all the requested data,
  * I don't know what the case is on *nix.
  */
-static int fullsend(SOCKET s, const char *buf, size_t len, int flags) {
+static int fullsend(struct RedisHandle *h, const char *buf, size_t len, int flags) {
 	int remain;
 
-	assert(s != INVALID_SOCKET);
+	assert(h->socket != INVALID_SOCKET);
 	assert(buf != NULL || len == 0);
 
 	remain = len;
 	while (remain > 0) {
-		int sent = send(s, buf, remain, flags);
+		int sent = send(h->socket, buf, remain, flags);
+		h->stats.sendCalls++;
 		if (sent < 0)
 			return sent;
+		h->stats.bytesSent += sent;
 		buf    += sent;
 		remain -= sent;
 	}
@@ -29,63 +48,385 @@ static int fullsend(SOCKET s, const char *buf, size_t len, int flags) {
 
 /**
  * @internal
- * Sends a Object followed by the string in extra.
- * It concat the two to save a single system call.
- * @todo BENCHMARK THE COST OF SYSCAL VS MEMCPY!
+ * Sends all of iov with as few sendmsg() calls as the socket allows. If the kernel
+ * can't take any more MSG_ZEROCOPY sends, the rest is sent normally.
  *
- * @return The number of bytes written
-*/
-static int send_object(struct RedisHandle *h, const struct Object *obj, const char *extra, int flags) {
-	char buf[1024];
-	size_t extraLen = strlen(extra);
+ * @return 0 on success, -1 on failure.
+ */
+static int fullsendmsg(struct RedisHandle *h, struct iovec *iov, int count, int flags) {
+	struct msghdr msg;
 
-	assert(h         != NULL);
-	assert(h->socket != INVALID_SOCKET);
-	assert(obj       != NULL);
-	assert(extra     != NULL);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = iov;
+	msg.msg_iovlen = count;
 
-	if (obj->len + extraLen < sizeof(buf)) {
-		/* If we have room send in one buffer */
-		memcpy(buf, obj->ptr, obj->len);
-		memcpy(buf + obj->len, extra, extraLen);
-		return fullsend(h->socket, buf, obj->len + extraLen, flags);
-	} else {
-		/* Otherwise send in two buffers */
-		int ret1, ret2;
-		ret1 = fullsend(h->socket, obj->ptr, obj->len, flags);
-		if (ret1 < 0) return ret1;
+	while (msg.msg_iovlen > 0) {
+		ssize_t sent = sendmsg(h->socket, &msg, flags);
+		h->stats.sendCalls++;
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+#ifdef MSG_ZEROCOPY
+			if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+				flags &= ~MSG_ZEROCOPY;
+				continue;
+			}
+#endif
+			return -1;
+		}
+		h->stats.bytesSent += sent;
 
-		ret2 = fullsend(h->socket, extra, extraLen, flags);
-		if (ret2 < 0) return ret2;
+#ifdef MSG_ZEROCOPY
+		if (flags & MSG_ZEROCOPY) {
+			h->zerocopySent++;
+			h->stats.zerocopySends++;
+		}
+#endif
 
-		return ret1 + ret2;
+		/* Skip what was sent, which may end part way through an iovec */
+		while (msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len) {
+			sent -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (sent > 0) {
+			msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + sent;
+			msg.msg_iov->iov_len -= sent;
+		}
 	}
+
+	return 0;
 }
 
+/**
+ * @internal
+ * Sends the command in the send buffer along with the large values it left where
+ * they are, gathered into one sendmsg().
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int send_buffer_refs(struct RedisHandle *h) {
+	struct iovec iov[2 * REDIS_MAX_SEND_REFS + 1];
+	char *buf = buffer_start(&h->sendBuf);
+	size_t pos = 0, refBytes = 0;
+	unsigned int i;
+	int count = 0;
+	int flags = SEND_FLAGS;
+	int ret;
+
+	for (i = 0; i < h->sendRefCount; i++) {
+		const struct RedisSendRef *r = &h->sendRefs[i];
+
+		if (r->offset > pos) {
+			iov[count].iov_base = buf + pos;
+			iov[count].iov_len  = r->offset - pos;
+			count++;
+			pos = r->offset;
+		}
+
+		iov[count].iov_base = (char *)r->ptr;
+		iov[count].iov_len  = r->len;
+		count++;
+		refBytes += r->len;
+	}
+
+	if (buffer_len(&h->sendBuf) > pos) {
+		iov[count].iov_base = buf + pos;
+		iov[count].iov_len  = buffer_len(&h->sendBuf) - pos;
+		count++;
+	}
+
+#ifdef MSG_ZEROCOPY
+	if (h->zerocopyThreshold > 0 && refBytes >= h->zerocopyThreshold)
+		flags |= MSG_ZEROCOPY;
+#endif
+
+	ret = fullsendmsg(h, iov, count, flags);
+
+	/* Either way this data is finished with */
+	buffer_unshift(&h->sendBuf, buffer_len(&h->sendBuf));
+	h->sendRefCount = 0;
+
+	if (ret < 0) {
+		h->lastErr = "Error sending command";
+		h->failed  = 1;
+		return -1;
+	}
+
+	return 0;
+}
 
 /**
  * @internal
- * Send a single object as a bulk (that is send the length then the data)
+ * Sends as much of the send buffer as a non-blocking socket will take, and
+ * leaves the rest queued for later.
+ *
+ * @return 0 if everything was sent, 1 if some is still queued, -1 on failure.
  */
-static int send_single_bulk(struct RedisHandle *h, const struct Object *obj, int printStar) {
+static int send_buffer_nonblocking(struct RedisHandle *h) {
 
-	const char *fmt = printStar ? "*%ld\r\n" : "%ld\r\n";
-	char lenString[16];
+	assert(h         != NULL);
+	assert(h->socket != INVALID_SOCKET);
+
+	while (buffer_len(&h->sendBuf) > 0) {
+		int sent = send(h->socket, buffer_start(&h->sendBuf), buffer_len(&h->sendBuf), SEND_FLAGS);
+		h->stats.sendCalls++;
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			buffer_unshift(&h->sendBuf, buffer_len(&h->sendBuf));
+			h->lastErr = "Error sending command";
+			h->failed  = 1;
+			return -1;
+		}
+		h->stats.bytesSent += sent;
+		buffer_unshift(&h->sendBuf, sent);
+	}
+
+	/* Let the loop know if it needs to wait for the socket to become writable */
+	if (h->loop != NULL && redis_loop_update(h))
+		return -1;
+
+	return buffer_len(&h->sendBuf) > 0;
+}
+
+/**
+ * @internal
+ * Sends everything which has been encoded into the send buffer with a single
+ * #fullsend, and empties the buffer. Non-blocking handles instead send what
+ * they can, and keep the rest queued.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int send_buffer(struct RedisHandle *h) {
+	int ret;
 
 	assert(h         != NULL);
 	assert(h->socket != INVALID_SOCKET);
-	assert(obj       != NULL);
 
-	/* Send the argument's length */
-	snprintf(lenString, sizeof(lenString), fmt, obj->len);
-	if (fullsend(h->socket, lenString, strlen(lenString), 0) < 0)
+	if (h->nonblocking)
+		return send_buffer_nonblocking(h) < 0 ? -1 : 0;
+
+	if (h->uring != NULL)
+		return redis_uring_send(h);
+
+	if (h->sendRefCount > 0)
+		return send_buffer_refs(h);
+
+	ret = fullsend(h, buffer_start(&h->sendBuf), buffer_len(&h->sendBuf), SEND_FLAGS);
+
+	/* Either way this data is finished with */
+	buffer_unshift(&h->sendBuf, buffer_len(&h->sendBuf));
+
+	if (ret < 0) {
+		h->lastErr = "Error sending command";
+		h->failed  = 1;
 		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * @internal
+ * A command has been fully encoded, so either send it now or leave it queued
+ * if we are pipelining.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int send_command(struct RedisHandle *h) {
+	if (h->pipeline) {
+		h->pipelined++;
+		return 0;
+	}
+
+	redis_stats_sent(h, 1);
+	return send_buffer(h);
+}
+
+/**
+ * @internal
+ * Drops anything the command may change from the handle's cache.
+ */
+static inline void cache_sent(struct RedisHandle *h, const int argc, const struct Object argv[]) {
+	if (h->cache != NULL)
+		redis_cache_written(h, redis_cache_command(&argv[0]), argc - 1, argv + 1);
+}
+
+/**
+ * @internal
+ * Notes a SELECT being sent, as the connection may then no longer be on database 0.
+ */
+static inline void select_sent(struct RedisHandle *h, const struct Object *name) {
+	if (name->len == 6 && name->ptr != NULL && name->type != REDIS_TYPE_INT && strncasecmp(name->ptr, "SELECT", 6) == 0)
+		h->selected = 1;
+}
 
-	/* Sent the argument's data (followed by a newline) */
-	if (send_object(h, obj, "\r\n", 0) < 0)
+/**
+ * @internal
+ * Sends any batched requests ahead of another command, so they stay in order.
+ * @return 0 on success, -1 on failure.
+ */
+static inline int batch_sent(struct RedisHandle *h) {
+	return h->batch != NULL ? redis_batch_flush(h) : 0;
+}
+
+/**
+ * @internal
+ * Drops a partially encoded command from the send buffer, leaving any
+ * queued commands before it.
+ * @param mark The length of the send buffer before the command was encoded
+ */
+static void encode_failed(struct RedisHandle *h, size_t mark) {
+	buffer_pop(&h->sendBuf, buffer_len(&h->sendBuf) - mark);
+	h->sendRefCount = 0;
+	h->lastErr = "Error encoding command";
+}
+
+/**
+ * @internal
+ * Finds the bytes which represent obj on the wire. Integers are formatted into tmp.
+ * @param tmp Room for #REDIS_INT64_LEN characters
+ * @param len Set to the number of bytes
+ * @return The bytes
+ */
+static const char * object_data(const struct Object *obj, char *tmp, size_t *len) {
+	if (obj->type == REDIS_TYPE_INT) {
+		*len = redis_format_int64(tmp, obj->integer);
+		return tmp;
+	}
+
+	*len = obj->len;
+	return obj->ptr;
+}
+
+/**
+ * @internal
+ * Encodes a Object followed by the string in extra into the send buffer.
+ *
+ * @return 0 on success, -1 on failure.
+*/
+static int encode_object(struct Buffer *b, const struct Object *obj, const char *extra, size_t extraLen) {
+	char tmp[REDIS_INT64_LEN];
+	const char *data;
+	size_t len;
+
+	assert(b     != NULL);
+	assert(obj   != NULL);
+	assert(extra != NULL);
+
+	data = object_data(obj, tmp, &len);
+
+	if (buffer_reserveExtra(b, len + extraLen) == NULL)
+		return -1;
+
+	memcpy(buffer_end(b), data, len);
+	buffer_push(b, len);
+
+	memcpy(buffer_end(b), extra, extraLen);
+	buffer_push(b, extraLen);
+
+	return 0;
+}
+
+/**
+ * @internal
+ * Encodes a length (or count) followed by \r\n into the send buffer.
+ * @param prefix The character to put before the length, or 0 for none.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int encode_length(struct Buffer *b, char prefix, uint64_t len) {
+	char *ptr;
+
+	if (buffer_reserveExtra(b, 1 + REDIS_INT64_LEN + 2) == NULL)
+		return -1;
+
+	ptr = buffer_end(b);
+	if (prefix)
+		*ptr++ = prefix;
+	ptr += redis_format_uint64(ptr, len);
+	*ptr++ = '\r';
+	*ptr++ = '\n';
+
+	buffer_push(b, ptr - buffer_end(b));
+
+	return 0;
+}
+
+/**
+ * @internal
+ * Encode a single object as a bulk (that is the length then the data)
+ * @param printDollar Prefix the length with a $, as multi bulk commands do
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int encode_single_bulk(struct Buffer *b, const struct Object *obj, int printDollar) {
+	char tmp[REDIS_INT64_LEN];
+	const char *data;
+	size_t len;
+
+	assert(b   != NULL);
+	assert(obj != NULL);
+
+	data = object_data(obj, tmp, &len);
+
+	/* The argument's length, then its data (followed by a newline) */
+	if (buffer_reserveExtra(b, 1 + REDIS_INT64_LEN + 2 + len + 2) == NULL)
+		return -1;
+
+	encode_length(b, printDollar ? '$' : 0, len);
+
+	memcpy(buffer_end(b), data, len);
+	buffer_push(b, len);
+
+	memcpy(buffer_end(b), "\r\n", 2);
+	buffer_push(b, 2);
+
+	return 0;
+}
+
+/**
+ * @internal
+ * Encodes one bulk argument of a command. When the command will have been sent
+ * before the call returns, a large value is not copied, but sent from where it is.
+ * @param printDollar Prefix the length with a $, as multi bulk commands do
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int encode_argument(struct RedisHandle *h, const struct Object *obj, int printDollar) {
+	struct RedisSendRef *r;
+
+	if (obj->type == REDIS_TYPE_INT || obj->len < SEND_REF_MIN || h->nonblocking || h->pipeline ||
+	    h->uring != NULL || h->sendRefCount == REDIS_MAX_SEND_REFS)
+		return encode_single_bulk(&h->sendBuf, obj, printDollar);
+
+	if (encode_length(&h->sendBuf, printDollar ? '$' : 0, obj->len))
 		return -1;
 
-	return 1;
+	r = &h->sendRefs[h->sendRefCount++];
+	r->offset = buffer_len(&h->sendBuf);
+	r->ptr    = obj->ptr;
+	r->len    = obj->len;
+
+	return buffer_append(&h->sendBuf, "\r\n", 2) == NULL ? -1 : 0;
+}
+
+int redis_encode_multibulk(struct Buffer *b, const int argc, const struct Object argv[]) {
+	int i;
+
+	if (encode_length(b, '*', argc))
+		return -1;
+
+	for (i = 0; i < argc; i++) {
+		if (encode_single_bulk(b, &argv[i], 1))
+			return -1;
+	}
+
+	return 0;
 }
 
 /**
@@ -141,71 +482,589 @@ static inline int check_send_parameters(struct RedisHandle *h, const int argc, c
 int redis_send_multibulk(struct RedisHandle *handle, const int argc, const struct Object argv[] ) {
 	const struct Object *obj;
 	const struct Object *last;
-	char lenString[16];
+	size_t mark;
 
 	if (check_send_parameters(handle, argc, argv, 0))
 		return -1;
 
-	/* Send the number of arguments */
-	snprintf(lenString, sizeof(lenString), "*%d\r\n", argc);
-	if (fullsend(handle->socket, lenString, strlen(lenString), 0) < 0)
+	if (batch_sent(handle))
 		return -1;
 
-	/* Now loop sending each argument */
+	cache_sent(handle, argc, argv);
+	select_sent(handle, &argv[0]);
+
+	mark = buffer_len(&handle->sendBuf);
+
+	/* The number of arguments */
+	if (encode_length(&handle->sendBuf, '*', argc))
+		goto error;
+
+	/* Now loop encoding each argument */
 	obj  = &argv[0];
 	last = &argv[argc];
 	while (obj < last) {
-		if (send_single_bulk(handle, obj, 1) < 0)
-			return -1;
+		if (encode_argument(handle, obj, 1))
+			goto error;
 		obj++;
 	}
+
+	if (send_command(handle))
+		return -1;
+
 	return argc;
+
+error:
+	encode_failed(handle, mark);
+	return -1;
+}
+
+int redis_send_command(struct RedisHandle *h, const struct RedisCommand *cmd, const int argc, const struct Object argv[]) {
+	const struct Object *obj;
+	const struct Object *last;
+	size_t mark;
+
+	assert(cmd != NULL);
+
+	if (h->socket == INVALID_SOCKET) {
+		h->lastErr = "Invalid socket";
+		return -1;
+	}
+
+	if (cmd->arity >= 0 ? argc + 1 != cmd->arity : argc + 1 < -cmd->arity) {
+		h->lastErr = "Error wrong number of arguments for command";
+		return -1;
+	}
+
+	if (batch_sent(h))
+		return -1;
+
+	if (h->cache != NULL)
+		redis_cache_written(h, cmd->cache, argc, argv);
+
+	if (cmd == &redis_commands[CMD_SELECT])
+		h->selected = 1;
+
+	mark = buffer_len(&h->sendBuf);
+
+	if (encode_length(&h->sendBuf, '*', argc + 1))
+		goto error;
+
+	/* The name was encoded when the library was compiled */
+	if (buffer_reserveExtra(&h->sendBuf, cmd->headerLen) == NULL)
+		goto error;
+	memcpy(buffer_end(&h->sendBuf), cmd->header, cmd->headerLen);
+	buffer_push(&h->sendBuf, cmd->headerLen);
+
+	obj  = &argv[0];
+	last = &argv[argc];
+	while (obj < last) {
+		if (encode_argument(h, obj, 1))
+			goto error;
+		obj++;
+	}
+
+	return send_command(h);
+
+error:
+	encode_failed(h, mark);
+	return -1;
 }
 
 int redis_send_bulk(struct RedisHandle *handle, const int argc, const struct Object argv[] ) {
 	const struct Object *obj;
 	const struct Object *last;
+	size_t mark;
 
 	if (check_send_parameters(handle, argc, argv, argc - 1))
 		return -1;
 
-	/* Now loop sending all but the last argument */
+	if (batch_sent(handle))
+		return -1;
+
+	cache_sent(handle, argc, argv);
+	select_sent(handle, &argv[0]);
+
+	mark = buffer_len(&handle->sendBuf);
+
+	/* Now loop encoding all but the last argument */
 	obj  = &argv[0];
 	last = &argv[argc - 1];
 	while (obj < last) {
-		if (send_object(handle, obj, " ", 0) < 0) {
-			handle->lastErr = "Error sending argument";
-			return -1;
-		}
+		if (encode_object(&handle->sendBuf, obj, " ", 1))
+			goto error;
 		obj++;
 	}
 
-	/* For the last argument we send as bulk */
-	if (send_single_bulk(handle, obj, 0) < 0) {
-		handle->lastErr = "Error sending bulk argument";
-		return -1;
-	}
+	/* For the last argument we encode as bulk */
+	if (encode_argument(handle, obj, 0))
+		goto error;
 
-	return 0;
+	return send_command(handle);
+
+error:
+	encode_failed(handle, mark);
+	return -1;
 }
 
 int redis_send(struct RedisHandle *handle, const int argc, const struct Object argv[] ) {
 	const struct Object *obj;
 	const struct Object *last;
+	size_t mark;
 
 	if (check_send_parameters(handle, argc, argv, argc))
 		return -1;
 
-	/* Now loop sending all arguments */
+	if (batch_sent(handle))
+		return -1;
+
+	cache_sent(handle, argc, argv);
+	select_sent(handle, &argv[0]);
+
+	mark = buffer_len(&handle->sendBuf);
+
+	/* Now loop encoding all arguments, separated by spaces and ending in a newline */
 	obj  = &argv[0];
-	last = &argv[argc];
+	last = &argv[argc - 1];
 	while (obj < last) {
-		if (send_object(handle, obj, " ", 0) < 0) {
-			handle->lastErr = "Error sending argument";
+		if (encode_object(&handle->sendBuf, obj, " ", 1))
+			goto error;
+		obj++;
+	}
+
+	if (encode_object(&handle->sendBuf, obj, "\r\n", 2))
+		goto error;
+
+	return send_command(handle);
+
+error:
+	encode_failed(handle, mark);
+	return -1;
+}
+
+/**
+ * A run of pre-encoded text in a prepared command, which comes before a placeholder
+ * (or the end of the command).
+ */
+struct PreparedSegment {
+	size_t offset;            /** Where the segment starts in text */
+	size_t len;               /** The length of the segment */
+};
+
+struct RedisPrepared {
+	unsigned int args;        /** How many placeholders the command has */
+	struct PreparedSegment *segments; /** args + 1 segments, each placeholder goes after its segment */
+	unsigned char *types;     /** The type each placeholder accepts */
+	char *text;               /** The pre-encoded parts of the command */
+	size_t textLen;           /** The length of text */
+	int cache;                /** What sending the command does to the cache, see #redis_cache_command */
+	int select;               /** Is the command a SELECT, see #select_sent */
+};
+
+struct RedisPrepared * redis_prepare(const int argc, const struct Object argv[]) {
+	struct RedisPrepared *p;
+	struct Buffer b;
+	size_t segmentStart = 0;
+	unsigned int args = 0;
+	int i;
+
+	if (argc <= 0 || argv == NULL)
+		return NULL;
+
+	for (i = 0; i < argc; i++) {
+		if (argv[i].type == REDIS_TYPE_ARG)
+			args++;
+	}
+
+	if (buffer_init(&b, 0) == NULL)
+		return NULL;
+
+	/* One block holds the segments, then the types, then the text */
+	p = malloc(sizeof(struct RedisPrepared) + (args + 1) * sizeof(struct PreparedSegment) + args);
+	if (p == NULL)
+		goto error;
+
+	p->args     = 0;
+	p->segments = (struct PreparedSegment *)(p + 1);
+	p->types    = (unsigned char *)(p->segments + args + 1);
+	p->cache    = redis_cache_command(&argv[0]);
+	p->select   = argv[0].len == 6 && argv[0].ptr != NULL && argv[0].type != REDIS_TYPE_INT && strncasecmp(argv[0].ptr, "SELECT", 6) == 0;
+
+	/* Only the placeholders are seen when the command is sent, so a write with
+	 * fixed keys could change any of them */
+	for (i = 1; i < argc && p->cache == CACHE_WRITE; i++) {
+		if (argv[i].type != REDIS_TYPE_ARG && argv[i].type != REDIS_TYPE_INT)
+			p->cache = CACHE_CLEAR;
+	}
+
+	if (encode_length(&b, '*', argc))
+		goto error;
+
+	for (i = 0; i < argc; i++) {
+		const struct Object *obj = &argv[i];
+
+		if (obj->type != REDIS_TYPE_ARG) {
+			if (encode_single_bulk(&b, obj, 1))
+				goto error;
+			continue;
+		}
+
+		/* The text so far is the segment before this placeholder */
+		p->segments[p->args].offset = segmentStart;
+		p->segments[p->args].len    = buffer_len(&b) - segmentStart;
+		p->types[p->args]           = (unsigned char)obj->integer;
+		p->args++;
+
+		segmentStart = buffer_len(&b);
+	}
+
+	p->segments[p->args].offset = segmentStart;
+	p->segments[p->args].len    = buffer_len(&b) - segmentStart;
+
+	/* The buffer's memory becomes the prepared command's text */
+	if (buffer_shrink(&b) == NULL)
+		goto error;
+	p->text    = b.buf;
+	p->textLen = buffer_len(&b);
+
+	return p;
+
+error:
+	free(p);
+	buffer_cleanup(&b);
+	return NULL;
+}
+
+void redis_prepared_free(struct RedisPrepared *p) {
+	if (p == NULL)
+		return;
+
+	free(p->text);
+	free(p);
+}
+
+int redis_send_prepared(struct RedisHandle *handle, const struct RedisPrepared *p, const struct Object argv[]) {
+	char tmp[REDIS_INT64_LEN];
+	size_t need;
+	unsigned int i;
+	char *ptr;
+
+	if (handle == NULL)
+		return -1;
+
+	if (p == NULL) {
+		handle->lastErr = "Error prepared command is null";
+		return -1;
+	}
+
+	if (handle->socket == INVALID_SOCKET) {
+		handle->lastErr = "Invalid socket";
+		return -1;
+	}
+
+	if (argv == NULL && p->args > 0) {
+		handle->lastErr = "Error argv is null";
+		return -1;
+	}
+
+	/* Check the arguments fit their placeholders, and work out how much room they need */
+	need = p->textLen;
+	for (i = 0; i < p->args; i++) {
+		unsigned int type = argv[i].type;
+
+		if (type == REDIS_TYPE_MULTIBULK || type == REDIS_TYPE_ARG ||
+		    (p->types[i] == REDIS_TYPE_INT && type != REDIS_TYPE_INT) ||
+		    ((p->types[i] == REDIS_TYPE_STR || p->types[i] == REDIS_TYPE_RAW) && type == REDIS_TYPE_INT)) {
+			handle->lastErr = "Error argument does not match the type of its placeholder";
 			return -1;
 		}
-		obj++;
+
+		/* An integer's digits are only known once it is formatted */
+		need += 1 + REDIS_INT64_LEN + 2 + (type == REDIS_TYPE_INT ? REDIS_INT64_LEN : argv[i].len) + 2;
 	}
 
+	if (batch_sent(handle))
+		return -1;
+
+	if (handle->cache != NULL)
+		redis_cache_written(handle, p->cache, p->args, argv);
+
+	if (p->select)
+		handle->selected = 1;
+
+	if (buffer_reserveExtra(&handle->sendBuf, need) == NULL) {
+		handle->lastErr = "Error encoding command";
+		return -1;
+	}
+
+	/* Everything fits, so write straight into the buffer */
+	ptr = buffer_end(&handle->sendBuf);
+	for (i = 0; i < p->args; i++) {
+		const struct PreparedSegment *seg = &p->segments[i];
+		const char *data;
+		size_t len;
+
+		memcpy(ptr, p->text + seg->offset, seg->len);
+		ptr += seg->len;
+
+		data = object_data(&argv[i], tmp, &len);
+
+		*ptr++ = '$';
+		ptr += redis_format_uint64(ptr, len);
+		*ptr++ = '\r';
+		*ptr++ = '\n';
+
+		memcpy(ptr, data, len);
+		ptr += len;
+		*ptr++ = '\r';
+		*ptr++ = '\n';
+	}
+
+	memcpy(ptr, p->text + p->segments[i].offset, p->segments[i].len);
+	ptr += p->segments[i].len;
+
+	buffer_push(&handle->sendBuf, ptr - buffer_end(&handle->sendBuf));
+
+	return send_command(handle);
+}
+
+int redis_pipeline_begin(struct RedisHandle *handle) {
+	if (handle == NULL)
+		return -1;
+
+	if (handle->pipeline) {
+		handle->lastErr = "Error already pipelining";
+		return -1;
+	}
+
+	handle->pipeline  = 1;
+	handle->pipelined = 0;
 	return 0;
 }
+
+int redis_pipeline_flush(struct RedisHandle *handle) {
+	unsigned int target;
+	int ret;
+
+	if (handle == NULL)
+		return -1;
+
+	if (!handle->pipeline) {
+		handle->lastErr = "Error not pipelining";
+		return -1;
+	}
+
+	handle->pipeline = 0;
+
+	if (handle->pipelined == 0)
+		return handle->replies;
+
+	if (handle->socket == INVALID_SOCKET) {
+		buffer_unshift(&handle->sendBuf, buffer_len(&handle->sendBuf));
+		handle->lastErr = "Invalid socket";
+		return -1;
+	}
+
+	/* Write the whole batch at once */
+	target = handle->replies + handle->pipelined;
+	redis_stats_sent(handle, handle->pipelined);
+	handle->pipelined = 0;
+
+	if (send_buffer(handle))
+		return -1;
+
+	/* A non-blocking handle collects its replies as they arrive */
+	if (handle->nonblocking)
+		return handle->replies;
+
+	/* and then collect all the replies */
+	while (handle->replies < target) {
+		ret = redis_read(handle);
+		if (ret < 0)
+			return -1;
+	}
+
+	return handle->replies;
+}
+
+int redis_flush(struct RedisHandle *handle) {
+	if (handle == NULL)
+		return -1;
+
+	if (handle->pipeline) {
+		handle->lastErr = "Error pipelining, use redis_pipeline_flush instead";
+		return -1;
+	}
+
+	if (handle->uring != NULL)
+		return redis_uring_flush(handle);
+
+	if (buffer_len(&handle->sendBuf) == 0)
+		return 0;
+
+	if (handle->socket == INVALID_SOCKET) {
+		handle->lastErr = "Invalid socket";
+		return -1;
+	}
+
+	if (handle->nonblocking)
+		return send_buffer_nonblocking(handle);
+
+	return send_buffer(handle);
+}
+
+int redis_use_zerocopy(struct RedisHandle *handle, size_t threshold) {
+#ifdef SO_ZEROCOPY
+	int on = threshold > 0;
+
+	assert(handle != NULL);
+
+	if (handle->socket == INVALID_SOCKET) {
+		handle->lastErr = "Invalid socket";
+		return -1;
+	}
+
+	if (setsockopt(handle->socket, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on))) {
+		handle->lastErr = "Error setting SO_ZEROCOPY, the socket does not support it";
+		return -1;
+	}
+
+	handle->zerocopyThreshold = threshold;
+	return 0;
+#else
+	assert(handle != NULL);
+
+	if (threshold == 0)
+		return 0;
+
+	handle->lastErr = "Error MSG_ZEROCOPY is not supported on this system";
+	return -1;
+#endif
+}
+
+uint32_t redis_zerocopy_ticket(const struct RedisHandle *handle) {
+	assert(handle != NULL);
+
+	return handle->zerocopySent;
+}
+
+/**
+ * @internal
+ * Reads the MSG_ZEROCOPY notifications waiting on the socket's error queue.
+ * @return 0 on success, -1 on failure.
+ */
+static int zerocopy_reap(struct RedisHandle *h) {
+#if defined(SO_EE_ORIGIN_ZEROCOPY)
+	for (;;) {
+		char control[128];
+		struct msghdr msg;
+		struct cmsghdr *cm;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(h->socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+
+			h->lastErr = "Error reading zerocopy notifications";
+			return -1;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+			const struct sock_extended_err *err;
+
+			if (!(cm->cmsg_level == SOL_IP   && cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			err = (const struct sock_extended_err *)CMSG_DATA(cm);
+			if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0)
+				continue;
+
+			/* Each notification covers sends ee_info to ee_data, and TCP finishes them in order */
+			if ((int32_t)(err->ee_data + 1 - h->zerocopyDone) > 0)
+				h->zerocopyDone = err->ee_data + 1;
+
+			if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				h->stats.zerocopyCopied += err->ee_data - err->ee_info + 1;
+		}
+	}
+#else
+	(void)h;
+	return 0;
+#endif
+}
+
+int redis_zerocopy_wait(struct RedisHandle *handle, uint32_t ticket, int timeout) {
+	struct timespec deadline;
+
+	assert(handle != NULL);
+
+	if (handle->socket == INVALID_SOCKET) {
+		handle->lastErr = "Invalid socket";
+		return -1;
+	}
+
+	if (timeout > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec  += timeout / 1000;
+		deadline.tv_nsec += (timeout % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	for (;;) {
+		struct pollfd pfd;
+		int remaining = timeout;
+		int ret;
+
+		if (zerocopy_reap(handle))
+			return -1;
+
+		if ((int32_t)(handle->zerocopyDone - ticket) >= 0)
+			return 1;
+
+		/* Each notification wakes us, so only wait for what's left of the timeout */
+		if (timeout > 0) {
+			struct timespec now;
+			long long ms;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			ms = (long long)(deadline.tv_sec - now.tv_sec) * 1000
+			   + (deadline.tv_nsec - now.tv_nsec + 999999L) / 1000000L;
+			if (ms <= 0)
+				return 0;
+			remaining = (int)ms;
+		}
+
+		/* Notifications arrive as POLLERR, which is always polled for */
+		pfd.fd      = handle->socket;
+		pfd.events  = 0;
+		pfd.revents = 0;
+
+		ret = poll(&pfd, 1, remaining);
+		if (ret < 0 && errno != EINTR) {
+			handle->lastErr = "Error waiting for zerocopy notifications";
+			return -1;
+		}
+
+		if (ret == 0)
+			return 0;
+
+		/* No more notifications can come */
+		if (pfd.revents & (POLLHUP | POLLNVAL)) {
+			if (zerocopy_reap(handle))
+				return -1;
+			if ((int32_t)(handle->zerocopyDone - ticket) >= 0)
+				return 1;
+
+			handle->lastErr = "Error connection closed before the kernel finished with the values";
+			return -1;
+		}
+	}
+}
@@ -0,0 +1,280 @@
+#include "redis-c.h"
+#include "redis_private.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
+
+#define LATENCY_SUB        (1 << REDIS_LATENCY_SUB_BITS) /** Buckets per power of two */
+#define SEND_TIMES_INITIAL 16    /** How many send times the ring starts with room for */
+#define SEND_TIMES_MAX     65536 /** Beyond this many commands waiting for replies, they go untimed */
+
+/**
+ * @internal
+ * @return The monotonic time in ns
+ */
+static uint64_t stats_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @internal
+ * @return The histogram bucket which counts ns
+ */
+static unsigned int latency_bucket(uint64_t ns) {
+	unsigned int exp, bucket;
+
+	if (ns < LATENCY_SUB)
+		return ns;
+
+	/* The power of two picks a row of buckets, and the next bits down pick the bucket */
+	exp    = 63 - __builtin_clzll(ns);
+	bucket = ((exp - REDIS_LATENCY_SUB_BITS + 1) << REDIS_LATENCY_SUB_BITS)
+	       | ((ns >> (exp - REDIS_LATENCY_SUB_BITS)) & (LATENCY_SUB - 1));
+
+	return bucket < REDIS_LATENCY_BUCKETS ? bucket : REDIS_LATENCY_BUCKETS - 1;
+}
+
+/**
+ * @internal
+ * @return The smallest time above those counted by the bucket
+ */
+static uint64_t latency_bucket_end(unsigned int bucket) {
+	unsigned int row = bucket >> REDIS_LATENCY_SUB_BITS;
+	unsigned int sub = bucket & (LATENCY_SUB - 1);
+
+	if (row == 0)
+		return bucket + 1;
+
+	return (uint64_t)(LATENCY_SUB + sub + 1) << (row - 1);
+}
+
+/**
+ * @internal
+ * Makes room for more send times, keeping them in order.
+ * @return 0 on success, -1 if the ring can't grow.
+ */
+static int send_times_grow(struct RedisHandle * h) {
+	unsigned int cap = h->sendTimesCap ? h->sendTimesCap * 2 : SEND_TIMES_INITIAL;
+	struct RedisSendTime *times;
+	unsigned int i;
+
+	if (cap > SEND_TIMES_MAX)
+		return -1;
+
+	times = malloc(cap * sizeof(struct RedisSendTime));
+	if (times == NULL)
+		return -1;
+
+	for (i = 0; i < h->sendTimesCount; i++)
+		times[i] = h->sendTimes[(h->sendTimesHead + i) & (h->sendTimesCap - 1)];
+
+	free(h->sendTimes);
+	h->sendTimes     = times;
+	h->sendTimesCap  = cap;
+	h->sendTimesHead = 0;
+
+	return 0;
+}
+
+void redis_stats_sent(struct RedisHandle * h, unsigned int commands) {
+	uint64_t now = stats_now();
+
+	h->stats.commands += commands;
+
+	while (commands-- > 0) {
+		struct RedisSendTime *t;
+		uint64_t seq = ++h->commandSeq;
+
+		if (h->sendTimesCount == h->sendTimesCap && send_times_grow(h)) {
+			h->stats.untimed++;
+			continue;
+		}
+
+		t = &h->sendTimes[(h->sendTimesHead + h->sendTimesCount++) & (h->sendTimesCap - 1)];
+		t->seq  = seq;
+		t->time = now;
+	}
+}
+
+void redis_stats_reply(struct RedisHandle * h) {
+	uint64_t seq = ++h->replySeq;
+
+	h->stats.replies++;
+
+	/* Commands are answered in order, so this reply's send time is the oldest. Any
+	 * older ones belong to commands which went without a reply. */
+	while (h->sendTimesCount > 0) {
+		const struct RedisSendTime *t = &h->sendTimes[h->sendTimesHead];
+		uint64_t latency;
+
+		if (t->seq > seq)
+			break;
+
+		h->sendTimesHead = (h->sendTimesHead + 1) & (h->sendTimesCap - 1);
+		h->sendTimesCount--;
+
+		if (t->seq < seq)
+			continue;
+
+		latency = stats_now() - t->time;
+
+		h->stats.latencyCount++;
+		h->stats.latencySum += latency;
+		h->stats.latency[latency_bucket(latency)]++;
+		if (latency > h->stats.latencyMax)
+			h->stats.latencyMax = latency;
+		break;
+	}
+}
+
+void redis_stats_reset_inflight(struct RedisHandle * h) {
+	h->sendTimesHead  = 0;
+	h->sendTimesCount = 0;
+	h->commandSeq     = 0;
+	h->replySeq       = 0;
+}
+
+void redis_stats(struct RedisHandle *h, struct RedisStats *stats) {
+	assert(h     != NULL);
+	assert(stats != NULL);
+
+	*stats = h->stats;
+	stats->bufferReallocs = h->buf.reallocs + h->sendBuf.reallocs;
+	stats->bufferMoves    = h->buf.moves    + h->sendBuf.moves;
+}
+
+void redis_stats_reset(struct RedisHandle *h) {
+	assert(h != NULL);
+
+	memset(&h->stats, 0, sizeof(h->stats));
+	h->buf.reallocs = h->sendBuf.reallocs = 0;
+	h->buf.moves    = h->sendBuf.moves    = 0;
+}
+
+uint64_t redis_stats_percentile(const struct RedisStats *stats, double percentile) {
+	uint64_t target, seen = 0;
+	unsigned int i;
+
+	assert(stats != NULL);
+
+	if (stats->latencyCount == 0)
+		return 0;
+
+	target = (uint64_t)(stats->latencyCount * percentile / 100.0);
+	if (target == 0)
+		target = 1;
+
+	for (i = 0; i < REDIS_LATENCY_BUCKETS; i++) {
+		seen += stats->latency[i];
+		if (seen >= target)
+			break;
+	}
+
+	/* The last bucket also holds everything too long for the histogram, and
+	 * no bucket holds anything longer than the longest time seen */
+	if (i >= REDIS_LATENCY_BUCKETS - 1 || latency_bucket_end(i) - 1 > stats->latencyMax)
+		return stats->latencyMax;
+
+	return latency_bucket_end(i) - 1;
+}
+
+/**
+ * @internal
+ * Tracks text being formatted into a fixed size buffer, working out how long
+ * it would be even once the buffer is full.
+ */
+struct StatsWriter {
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+static void stats_printf(struct StatsWriter *w, const char *fmt, ...) {
+	char *ptr = w->len < w->size ? w->buf + w->len : NULL;
+	size_t room = w->len < w->size ? w->size - w->len : 0;
+	va_list ap;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(ptr, room, fmt, ap);
+	va_end(ap);
+
+	if (len > 0)
+		w->len += len;
+}
+
+/**
+ * @internal
+ * Writes a counter, with its HELP and TYPE lines.
+ */
+static void stats_counter(struct StatsWriter *w, const char *name, const char *help, const char *labels, uint64_t value) {
+	stats_printf(w, "# HELP redis_c_%s %s\n", name, help);
+	stats_printf(w, "# TYPE redis_c_%s counter\n", name);
+	stats_printf(w, "redis_c_%s%s%s%s %llu\n", name,
+		labels ? "{" : "", labels ? labels : "", labels ? "}" : "", (unsigned long long)value);
+}
+
+size_t redis_stats_prometheus(const struct RedisStats *stats, const char *labels, char *buf, size_t size) {
+	struct StatsWriter w = { buf, size, 0 };
+	const char *sep;
+	uint64_t seen = 0;
+	unsigned int i = 0;
+	unsigned int exp;
+
+	assert(stats != NULL);
+	assert(buf != NULL || size == 0);
+
+	if (labels != NULL && *labels == '\0')
+		labels = NULL;
+	sep = labels ? "," : "";
+
+	if (size > 0)
+		buf[0] = '\0';
+
+	stats_counter(&w, "send_calls_total",      "send() system calls.",                    labels, stats->sendCalls);
+	stats_counter(&w, "recv_calls_total",      "recv() system calls.",                    labels, stats->recvCalls);
+	stats_counter(&w, "sent_bytes_total",      "Bytes written to the socket.",            labels, stats->bytesSent);
+	stats_counter(&w, "received_bytes_total",  "Bytes read from the socket.",             labels, stats->bytesReceived);
+	stats_counter(&w, "commands_total",        "Commands sent.",                          labels, stats->commands);
+	stats_counter(&w, "replies_total",         "Replies received.",                       labels, stats->replies);
+	stats_counter(&w, "buffer_reallocs_total", "Times a buffer was realloced.",           labels, stats->bufferReallocs);
+	stats_counter(&w, "buffer_moves_total",    "Times data was moved down a buffer.",     labels, stats->bufferMoves);
+	stats_counter(&w, "cache_hits_total",      "Lookups answered by the near cache.",     labels, stats->cacheHits);
+	stats_counter(&w, "cache_misses_total",    "Lookups the near cache couldn't answer.", labels, stats->cacheMisses);
+	stats_counter(&w, "cache_evictions_total", "Cache entries evicted to save space.",    labels, stats->cacheEvictions);
+	stats_counter(&w, "cache_invalidations_total", "Cache entries dropped by writes.",   labels, stats->cacheInvalidations);
+	stats_counter(&w, "batches_total",         "MGETs and MSETs sent for batched requests.", labels, stats->batches);
+	stats_counter(&w, "batched_requests_total", "Requests carried by batches.",          labels, stats->batched);
+	stats_counter(&w, "zerocopy_sends_total",  "sendmsg() calls made with MSG_ZEROCOPY.", labels, stats->zerocopySends);
+	stats_counter(&w, "zerocopy_copied_total", "MSG_ZEROCOPY sends the kernel copied anyway.", labels, stats->zerocopyCopied);
+	stats_counter(&w, "uring_enters_total",    "io_uring_enter() system calls.",          labels, stats->uringEnters);
+	stats_counter(&w, "untimed_total",         "Commands whose round trip was not timed.", labels, stats->untimed);
+
+	stats_printf(&w, "# HELP redis_c_command_duration_seconds Round trip time of commands.\n");
+	stats_printf(&w, "# TYPE redis_c_command_duration_seconds histogram\n");
+
+	/* One bucket per power of two nanoseconds, from 2^10ns (1.024us) to 2^36ns
+	 * (about 68.7s). Each is also a boundary between the histogram's own
+	 * buckets, so no bucket has to be split */
+	for (exp = 10; exp <= 36; exp++) {
+		unsigned int end = latency_bucket((uint64_t)1 << exp);
+
+		while (i < end)
+			seen += stats->latency[i++];
+
+		stats_printf(&w, "redis_c_command_duration_seconds_bucket{%s%sle=\"%.12g\"} %llu\n",
+			labels ? labels : "", sep, (double)((uint64_t)1 << exp) / 1e9, (unsigned long long)seen);
+	}
+
+	stats_printf(&w, "redis_c_command_duration_seconds_bucket{%s%sle=\"+Inf\"} %llu\n",
+		labels ? labels : "", sep, (unsigned long long)stats->latencyCount);
+	stats_printf(&w, "redis_c_command_duration_seconds_sum%s%s%s %.9f\n",
+		labels ? "{" : "", labels ? labels : "", labels ? "}" : "", stats->latencySum / 1e9);
+	stats_printf(&w, "redis_c_command_duration_seconds_count%s%s%s %llu\n",
+		labels ? "{" : "", labels ? labels : "", labels ? "}" : "", (unsigned long long)stats->latencyCount);
+
+	return w.len;
+}
@@ -0,0 +1,467 @@
+#include "redis-c.h"
+#include "redis_private.h"
+
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FUTURE_WAITING  -1    /** A pending future whose owner is asleep in #redis_future_wait */
+#define THREAD_SEND_MAX 65536 /** The most queued commands are gathered into the send buffer before writing */
+#define THREAD_CMD_INIT 64    /** How big a future's command buffer starts */
+
+/**
+ * @internal
+ * A slot in the submission ring. seq says whose turn the slot is: a producer may fill
+ * it when seq equals the position it claimed, and the I/O thread may empty it once seq
+ * is one past that.
+ */
+struct ThreadSlot {
+	uint64_t seq;
+	struct RedisFuture *future;
+};
+
+struct RedisThread {
+	struct RedisHandle *h;       /** The connection, only touched by the I/O thread (with lock held) */
+	pthread_t thread;
+	pthread_mutex_t lock;        /** Held by the I/O thread while it works, so stats can be copied */
+	int wake;                    /** eventfd the I/O thread sleeps on, along with the socket */
+
+	struct ThreadSlot *ring;
+	uint64_t mask;               /** The size of the ring minus one */
+	uint64_t head;               /** The next position the I/O thread empties */
+
+	struct RedisFuture *inflight;     /** Futures whose commands were sent, oldest first */
+	struct RedisFuture *inflightTail;
+
+	int sleeping;                /** Set while the I/O thread is (about to be) asleep */
+	int stopping;                /** Set by #redis_thread_free */
+	int failed;                  /** Set once the connection has failed */
+
+	/* Producers contend on this, so keep it away from what the I/O thread writes */
+	uint64_t tail __attribute__((aligned(64))); /** The next position a producer claims */
+};
+
+/**
+ * @internal
+ * Wakes a thread sleeping on addr, if any.
+ */
+static void futex_wake(int *addr) {
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/**
+ * @internal
+ * Wakes the I/O thread, if it is asleep or about to be.
+ */
+static void thread_wake(struct RedisThread *t) {
+	uint64_t one = 1;
+
+	if (__atomic_load_n(&t->sleeping, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&t->sleeping, 0, __ATOMIC_SEQ_CST)) {
+		if (write(t->wake, &one, sizeof(one)) < 0) {
+			/* The counter is already non-zero, so the thread will wake anyway */
+		}
+	}
+}
+
+/**
+ * @internal
+ * Claims a position in the ring and puts the future in it.
+ * @return 0 on success, or -1 if the ring is full.
+ */
+static int queue_push(struct RedisThread *t, struct RedisFuture *f) {
+	uint64_t pos = __atomic_load_n(&t->tail, __ATOMIC_RELAXED);
+	struct ThreadSlot *slot;
+
+	for (;;) {
+		uint64_t seq;
+
+		slot = &t->ring[pos & t->mask];
+		seq  = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&t->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+			/* pos was reloaded by the failed exchange */
+		} else if ((int64_t)(seq - pos) < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&t->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	slot->future = f;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/**
+ * @internal
+ * Takes the oldest future off the ring. Only called by the I/O thread.
+ * @return The future, or NULL if the ring is empty.
+ */
+static struct RedisFuture * queue_pop(struct RedisThread *t) {
+	struct ThreadSlot *slot = &t->ring[t->head & t->mask];
+	struct RedisFuture *f;
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != t->head + 1)
+		return NULL;
+
+	f = slot->future;
+
+	/* The slot is free for whoever claims it on the next lap */
+	__atomic_store_n(&slot->seq, t->head + t->mask + 1, __ATOMIC_RELEASE);
+	t->head++;
+
+	return f;
+}
+
+/**
+ * @internal
+ * @return 1 if there is anything on the ring for the I/O thread, otherwise 0.
+ */
+static int queue_waiting(struct RedisThread *t) {
+	const struct ThreadSlot *slot = &t->ring[t->head & t->mask];
+
+	return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == t->head + 1;
+}
+
+/**
+ * @internal
+ * Completes a future, waking its owner if it is waiting. The owner may reuse or
+ * free the future as soon as the state changes.
+ */
+static void future_complete(struct RedisFuture *f, struct Reply *r, int state) {
+	f->reply = r;
+	f->next  = NULL;
+
+	if (__atomic_exchange_n(&f->state, state, __ATOMIC_SEQ_CST) == FUTURE_WAITING)
+		futex_wake(&f->state);
+}
+
+/**
+ * @internal
+ * The connection has failed, so fails every future waiting for a reply. Later
+ * submissions fail straight away.
+ */
+static void thread_failed(struct RedisThread *t) {
+	__atomic_store_n(&t->failed, 1, __ATOMIC_RELEASE);
+
+	while (t->inflight != NULL) {
+		struct RedisFuture *f = t->inflight;
+		t->inflight = f->next;
+		future_complete(f, NULL, REDIS_FUTURE_ERROR);
+	}
+	t->inflightTail = NULL;
+
+	buffer_unshift(&t->h->sendBuf, buffer_len(&t->h->sendBuf));
+}
+
+/**
+ * @internal
+ * Sends whatever has been queued, and completes the futures whose replies arrived.
+ * Called with the lock held.
+ * @return 1 if anything was done, otherwise 0.
+ */
+static int thread_work(struct RedisThread *t) {
+	struct RedisHandle *h = t->h;
+	struct RedisFuture *f;
+	unsigned int queued = 0;
+	int replies = 0;
+
+	/* Gather everything queued so far into one write */
+	while (buffer_len(&h->sendBuf) < THREAD_SEND_MAX && (f = queue_pop(t)) != NULL) {
+		if (t->failed || buffer_append(&h->sendBuf, buffer_start(&f->cmd), buffer_len(&f->cmd)) == NULL) {
+			future_complete(f, NULL, REDIS_FUTURE_ERROR);
+			continue;
+		}
+
+		if (t->inflightTail != NULL)
+			t->inflightTail->next = f;
+		else
+			t->inflight = f;
+		t->inflightTail = f;
+		queued++;
+	}
+
+	if (queued > 0)
+		redis_stats_sent(h, queued);
+
+	if (t->failed)
+		return queued > 0;
+
+	if (buffer_len(&h->sendBuf) > 0 && redis_flush(h) < 0) {
+		thread_failed(t);
+		return 1;
+	}
+
+	if (t->inflight != NULL) {
+		struct Reply *r;
+
+		replies = redis_read(h);
+		if (replies < 0) {
+			thread_failed(t);
+			return 1;
+		}
+
+		/* Replies arrive in the order the commands were sent */
+		while (t->inflight != NULL && (r = redis_reply_pop(h)) != NULL) {
+			f = t->inflight;
+			t->inflight = f->next;
+			if (t->inflight == NULL)
+				t->inflightTail = NULL;
+			future_complete(f, r, REDIS_FUTURE_DONE);
+		}
+	}
+
+	return queued > 0 || replies > 0;
+}
+
+/**
+ * @internal
+ * Waits for a producer to wake the thread, or for the socket to become ready.
+ */
+static void thread_sleep(struct RedisThread *t) {
+	struct RedisHandle *h = t->h;
+	struct pollfd fds[2];
+	uint64_t count;
+	nfds_t n = 1;
+
+	__atomic_store_n(&t->sleeping, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	/* A producer which pushed before seeing sleeping set won't wake us */
+	if (queue_waiting(t) || __atomic_load_n(&t->stopping, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&t->sleeping, 0, __ATOMIC_SEQ_CST);
+		return;
+	}
+
+	fds[0].fd     = t->wake;
+	fds[0].events = POLLIN;
+
+	if (!t->failed && (t->inflight != NULL || buffer_len(&h->sendBuf) > 0)) {
+		fds[1].fd     = h->socket;
+		fds[1].events = (t->inflight != NULL ? POLLIN : 0) | (buffer_len(&h->sendBuf) > 0 ? POLLOUT : 0);
+		n = 2;
+	}
+
+	poll(fds, n, -1);
+
+	__atomic_store_n(&t->sleeping, 0, __ATOMIC_SEQ_CST);
+
+	if (fds[0].revents & POLLIN) {
+		if (read(t->wake, &count, sizeof(count)) < 0) {
+			/* Another wake up raced us to it */
+		}
+	}
+}
+
+static void * thread_main(void *arg) {
+	struct RedisThread *t = arg;
+	int progress;
+
+	while (!__atomic_load_n(&t->stopping, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&t->lock);
+		progress = thread_work(t);
+		pthread_mutex_unlock(&t->lock);
+
+		if (!progress)
+			thread_sleep(t);
+	}
+
+	return NULL;
+}
+
+struct RedisThread * redis_thread_alloc(const char *host, unsigned short port, unsigned int queueSize) {
+	struct RedisThread *t;
+	uint64_t size = 1, i;
+
+	while (size < queueSize)
+		size *= 2;
+
+	t = calloc(1, sizeof(struct RedisThread));
+	if (t == NULL)
+		return NULL;
+
+	t->wake = -1;
+	t->ring = malloc(size * sizeof(struct ThreadSlot));
+	t->h    = redis_alloc();
+	if (t->ring == NULL || t->h == NULL)
+		goto error;
+
+	for (i = 0; i < size; i++)
+		t->ring[i].seq = i;
+	t->mask = size - 1;
+
+	if (redis_connect(t->h, host, port) || redis_set_nonblocking(t->h, 1))
+		goto error;
+
+	t->wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (t->wake < 0)
+		goto error;
+
+	pthread_mutex_init(&t->lock, NULL);
+
+	if (pthread_create(&t->thread, NULL, thread_main, t)) {
+		pthread_mutex_destroy(&t->lock);
+		goto error;
+	}
+
+	return t;
+
+error:
+	if (t->wake >= 0)
+		close(t->wake);
+	redis_free(t->h);
+	free(t->ring);
+	free(t);
+	return NULL;
+}
+
+void redis_thread_free(struct RedisThread *t) {
+	struct RedisFuture *f;
+	uint64_t one = 1;
+
+	if (t == NULL)
+		return;
+
+	__atomic_store_n(&t->stopping, 1, __ATOMIC_SEQ_CST);
+	if (write(t->wake, &one, sizeof(one)) < 0) {
+		/* The counter is already non-zero, so the thread will wake anyway */
+	}
+	pthread_join(t->thread, NULL);
+
+	/* Fail whatever was sent, or never got sent */
+	thread_failed(t);
+	while ((f = queue_pop(t)) != NULL)
+		future_complete(f, NULL, REDIS_FUTURE_ERROR);
+
+	pthread_mutex_destroy(&t->lock);
+	close(t->wake);
+	redis_free(t->h);
+	free(t->ring);
+	free(t);
+}
+
+int redis_thread_submit(struct RedisThread *t, struct RedisFuture *f, const int argc, const struct Object argv[]) {
+	assert(t != NULL);
+	assert(f != NULL);
+
+	if (argc <= 0 || argv == NULL || __atomic_load_n(&t->failed, __ATOMIC_ACQUIRE))
+		return -1;
+
+	buffer_unshift(&f->cmd, buffer_len(&f->cmd));
+	if (redis_encode_multibulk(&f->cmd, argc, argv))
+		return -1;
+
+	f->reply = NULL;
+	f->next  = NULL;
+	__atomic_store_n(&f->state, REDIS_FUTURE_PENDING, __ATOMIC_RELAXED);
+
+	/* While the ring is full, make sure the I/O thread is emptying it */
+	while (queue_push(t, f)) {
+		thread_wake(t);
+		sched_yield();
+	}
+
+	/* Either the I/O thread sees this future, or we see it is going to sleep */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	thread_wake(t);
+
+	return 0;
+}
+
+int redis_thread_failed(struct RedisThread *t) {
+	assert(t != NULL);
+
+	return __atomic_load_n(&t->failed, __ATOMIC_ACQUIRE);
+}
+
+void redis_thread_stats(struct RedisThread *t, struct RedisStats *stats) {
+	assert(t     != NULL);
+	assert(stats != NULL);
+
+	pthread_mutex_lock(&t->lock);
+	redis_stats(t->h, stats);
+	pthread_mutex_unlock(&t->lock);
+}
+
+struct RedisFuture * redis_future_init(struct RedisFuture *f) {
+	assert(f != NULL);
+
+	f->reply = NULL;
+	f->state = REDIS_FUTURE_DONE;
+	f->next  = NULL;
+
+	if (buffer_init(&f->cmd, THREAD_CMD_INIT) == NULL)
+		return NULL;
+
+	return f;
+}
+
+void redis_future_cleanup(struct RedisFuture *f) {
+	if (f == NULL)
+		return;
+
+	if (f->reply != NULL)
+		redis_reply_free(f->reply);
+	f->reply = NULL;
+
+	buffer_cleanup(&f->cmd);
+}
+
+int redis_future_wait(struct RedisFuture *f, int timeout) {
+	struct timespec deadline, remaining;
+	int state;
+
+	assert(f != NULL);
+
+	if (timeout > 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec  += timeout / 1000;
+		deadline.tv_nsec += (timeout % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	state = __atomic_load_n(&f->state, __ATOMIC_ACQUIRE);
+
+	while (state == REDIS_FUTURE_PENDING || state == FUTURE_WAITING) {
+		if (timeout == 0)
+			return REDIS_FUTURE_PENDING;
+
+		/* Tell the I/O thread to wake us. If the state changed first, look again */
+		if (state == REDIS_FUTURE_PENDING &&
+		    !__atomic_compare_exchange_n(&f->state, &state, FUTURE_WAITING, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+			continue;
+
+		if (timeout > 0) {
+			struct timespec now;
+
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			remaining.tv_sec  = deadline.tv_sec  - now.tv_sec;
+			remaining.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+			if (remaining.tv_nsec < 0) {
+				remaining.tv_sec--;
+				remaining.tv_nsec += 1000000000L;
+			}
+			if (remaining.tv_sec < 0)
+				return REDIS_FUTURE_PENDING;
+		}
+
+		syscall(SYS_futex, &f->state, FUTEX_WAIT_PRIVATE, FUTURE_WAITING, timeout > 0 ? &remaining : NULL, NULL, 0);
+
+		state = __atomic_load_n(&f->state, __ATOMIC_ACQUIRE);
+	}
+
+	return state;
+}
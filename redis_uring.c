@@ -0,0 +1,581 @@
+#include "redis-c.h"
+#include "redis_private.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+#define URING_BUFFERS     16    /** Receive buffers registered by default */
+#define URING_BUFFER_SIZE 16384 /** The size of each receive buffer */
+#define URING_BUFFER_MAX  32768 /** The most receive buffers, as buffer IDs are 16 bits */
+#define URING_BUFFER_GROUP 0    /** The ID the receive buffers are registered under */
+#define URING_QUEUED_MAX  (1 << 20) /** How much may be queued behind a write before waiting for it */
+
+#define URING_RECV   1 /** user_data of the multishot receive */
+#define URING_SEND   2 /** user_data of the write in flight */
+#define URING_CANCEL 3 /** user_data of cancelling the receive */
+
+/**
+ * @internal
+ * Data the kernel received into one of the buffers, not yet copied out. A negative
+ * buffer marks where the connection failed, with len holding the error.
+ */
+struct UringChunk {
+	int bid;                     /** Which buffer, or -1 */
+	int len;
+	int pos;                     /** How much has been copied out */
+};
+
+struct RedisUring {
+	int fd;
+
+	void *sqRing;
+	size_t sqRingSize;
+	void *cqRing;                /** The same as sqRing if the kernel maps both together */
+	size_t cqRingSize;
+	struct io_uring_sqe *sqes;
+	size_t sqesSize;
+
+	unsigned int *sqTail, *sqMask, *sqArray;
+	unsigned int *cqHead, *cqTail, *cqMask;
+	struct io_uring_cqe *cqes;
+	unsigned int toSubmit;       /** Entries added to the submission queue since the last io_uring_enter() */
+
+	struct io_uring_buf_ring *bufRing; /** Hands the receive buffers to the kernel */
+	size_t bufRingSize;
+	char *bufs;                  /** The receive buffers */
+	unsigned int bufCount;       /** A power of two */
+	unsigned short bufTail;
+
+	struct UringChunk *chunks;   /** FIFO of received data waiting to be copied out */
+	unsigned int chunkHead;
+	unsigned int chunkCount;
+
+	struct Buffer sending;       /** The data of the write in flight */
+	struct Buffer queued;        /** Data sent while a write was in flight, to follow it */
+
+	unsigned int armed   :1;     /** Is the multishot receive active? */
+	unsigned int writing :1;     /** Is a write in flight? */
+	unsigned int closed  :1;     /** Has the connection failed? */
+};
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p) {
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_register(int fd, unsigned int opcode, void *arg, unsigned int n) {
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, n);
+}
+
+/**
+ * @internal
+ * @return A cleared submission queue entry, which is submitted by the next #uring_enter.
+ */
+static struct io_uring_sqe * uring_sqe(struct RedisUring *u) {
+	unsigned int tail  = *u->sqTail;
+	unsigned int index = tail & *u->sqMask;
+	struct io_uring_sqe *sqe = &u->sqes[index];
+
+	/* Only a receive, a write and a cancel are ever outstanding, far fewer than the ring holds */
+	memset(sqe, 0, sizeof(*sqe));
+	u->sqArray[index] = index;
+	__atomic_store_n(u->sqTail, tail + 1, __ATOMIC_RELEASE);
+	u->toSubmit++;
+
+	return sqe;
+}
+
+/**
+ * @internal
+ * Arms the multishot receive, which keeps completing as data arrives until it runs
+ * out of buffers or the connection fails.
+ */
+static void uring_arm(struct RedisHandle *h) {
+	struct RedisUring *u = h->uring;
+	struct io_uring_sqe *sqe = uring_sqe(u);
+
+	sqe->opcode    = IORING_OP_RECV;
+	sqe->fd        = h->socket;
+	sqe->ioprio    = IORING_RECV_MULTISHOT;
+	sqe->flags     = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFFER_GROUP;
+	sqe->user_data = URING_RECV;
+
+	u->armed = 1;
+}
+
+/**
+ * @internal
+ * Writes everything in u->sending, or the rest of it after a short write.
+ */
+static void uring_write(struct RedisHandle *h) {
+	struct RedisUring *u = h->uring;
+	struct io_uring_sqe *sqe = uring_sqe(u);
+
+	sqe->opcode    = IORING_OP_SEND;
+	sqe->fd        = h->socket;
+	sqe->addr      = (uint64_t)(uintptr_t)buffer_start(&u->sending);
+	sqe->len       = buffer_len(&u->sending);
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL; /* so it only completes short if it fails */
+	sqe->user_data = URING_SEND;
+
+	u->writing = 1;
+}
+
+/**
+ * @internal
+ * Gives a receive buffer back to the kernel.
+ */
+static void uring_recycle(struct RedisUring *u, int bid) {
+	struct io_uring_buf *b = &u->bufRing->bufs[u->bufTail & (u->bufCount - 1)];
+
+	b->addr = (uint64_t)(uintptr_t)(u->bufs + (size_t)bid * URING_BUFFER_SIZE);
+	b->len  = URING_BUFFER_SIZE;
+	b->bid  = bid;
+
+	__atomic_store_n(&u->bufRing->tail, ++u->bufTail, __ATOMIC_RELEASE);
+}
+
+static void uring_swap(struct Buffer *a, struct Buffer *b) {
+	struct Buffer tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+/**
+ * @internal
+ * Submits what has been queued, and waits for at least wait completions.
+ * @return 0 on success, -1 on failure.
+ */
+static int uring_enter(struct RedisHandle *h, unsigned int wait) {
+	struct RedisUring *u = h->uring;
+
+	for (;;) {
+		int ret = (int)syscall(__NR_io_uring_enter, u->fd, u->toSubmit, wait,
+		                       wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		h->stats.uringEnters++;
+
+		if (ret >= 0) {
+			u->toSubmit -= ret;
+			return 0;
+		}
+
+		if (errno == EINTR)
+			continue;
+
+		/* The completion queue is full, so it has to be emptied first */
+		if (errno == EBUSY || errno == EAGAIN)
+			return 0;
+
+		h->lastErr = "Error submitting to io_uring";
+		h->failed  = 1;
+		return -1;
+	}
+}
+
+/**
+ * @internal
+ * Handles every completion the kernel has posted, without a system call. Received
+ * data is queued to be copied out, and finished writes make way for the next.
+ * @return 0 on success, -1 if a write failed.
+ */
+static int uring_reap(struct RedisHandle *h) {
+	struct RedisUring *u = h->uring;
+	unsigned int head = *u->cqHead;
+	unsigned int tail = __atomic_load_n(u->cqTail, __ATOMIC_ACQUIRE);
+	int ret = 0;
+
+	for (; head != tail; head++) {
+		const struct io_uring_cqe *cqe = &u->cqes[head & *u->cqMask];
+
+		if (cqe->user_data == URING_RECV) {
+			struct UringChunk *c;
+
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				u->armed = 0;
+
+			/* Out of buffers, it is armed again once they've been copied out */
+			if (cqe->res == -ENOBUFS || u->closed)
+				continue;
+
+			c = &u->chunks[(u->chunkHead + u->chunkCount++) % (u->bufCount + 1)];
+			if (cqe->res > 0) {
+				c->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+				c->len = cqe->res;
+			} else {
+				c->bid = -1;
+				c->len = cqe->res;
+				u->closed = 1;
+			}
+			c->pos = 0;
+
+		} else if (cqe->user_data == URING_SEND) {
+			u->writing = 0;
+
+			if (cqe->res < 0) {
+				buffer_unshift(&u->sending, buffer_len(&u->sending));
+				buffer_unshift(&u->queued, buffer_len(&u->queued));
+				h->lastErr = "Error sending command";
+				h->failed  = 1;
+				ret = -1;
+				continue;
+			}
+
+			h->stats.bytesSent += cqe->res;
+			buffer_unshift(&u->sending, cqe->res);
+
+			/* Whatever queued up behind this write goes out as the next one */
+			if (buffer_len(&u->sending) == 0)
+				uring_swap(&u->sending, &u->queued);
+			if (buffer_len(&u->sending) > 0)
+				uring_write(h);
+		}
+	}
+
+	__atomic_store_n(u->cqHead, head, __ATOMIC_RELEASE);
+
+	return ret;
+}
+
+int redis_uring_send(struct RedisHandle *h) {
+	struct RedisUring *u = h->uring;
+
+	assert(u != NULL);
+
+	/* Nothing in flight, so the send buffer can be written from where it is */
+	if (!u->writing && buffer_len(&u->sending) == 0) {
+		uring_swap(&h->sendBuf, &u->sending);
+		uring_write(h);
+		return 0;
+	}
+
+	if (buffer_append(&u->queued, buffer_start(&h->sendBuf), buffer_len(&h->sendBuf)) == NULL) {
+		buffer_unshift(&h->sendBuf, buffer_len(&h->sendBuf));
+		h->lastErr = "Error allocating send buffer";
+		return -1;
+	}
+	buffer_unshift(&h->sendBuf, buffer_len(&h->sendBuf));
+
+	/* Don't let writes pile up behind a slow one if the replies aren't being read */
+	if (buffer_len(&u->queued) >= URING_QUEUED_MAX)
+		return redis_uring_flush(h);
+
+	return 0;
+}
+
+int redis_uring_flush(struct RedisHandle *h) {
+	struct RedisUring *u = h->uring;
+
+	assert(u != NULL);
+
+	while (u->writing) {
+		if (uring_enter(h, 1) || uring_reap(h))
+			return -1;
+	}
+
+	return 0;
+}
+
+int redis_uring_recv(struct RedisHandle *h, char *dst, size_t len) {
+	struct RedisUring *u = h->uring;
+	size_t copied = 0;
+
+	assert(u != NULL);
+
+	for (;;) {
+		if (uring_reap(h))
+			return -1;
+
+		while (copied < len && u->chunkCount > 0) {
+			struct UringChunk *c = &u->chunks[u->chunkHead];
+			size_t n;
+
+			if (c->bid < 0) {
+				if (copied > 0)
+					return (int)copied;
+
+				h->lastErr = c->len == 0 ? "Error reading from redis server, connection closed"
+				                         : "Error reading from redis server";
+				h->failed  = 1;
+				return -1;
+			}
+
+			n = c->len - c->pos;
+			if (n > len - copied)
+				n = len - copied;
+
+			memcpy(dst + copied, u->bufs + (size_t)c->bid * URING_BUFFER_SIZE + c->pos, n);
+			c->pos += n;
+			copied += n;
+
+			if (c->pos == c->len) {
+				uring_recycle(u, c->bid);
+				u->chunkHead = (u->chunkHead + 1) % (u->bufCount + 1);
+				u->chunkCount--;
+			}
+		}
+
+		if (copied > 0)
+			return (int)copied;
+
+		if (!u->armed)
+			uring_arm(h);
+
+		/* The write's completion comes first, so wait for the data after it too, and
+		 * a round trip costs a single system call */
+		if (uring_enter(h, 1 + u->writing))
+			return -1;
+	}
+}
+
+/**
+ * @internal
+ * Unmaps and closes everything #redis_use_uring set up.
+ */
+static void uring_destroy(struct RedisUring *u) {
+	if (u->bufRing != NULL)
+		munmap(u->bufRing, u->bufRingSize);
+	if (u->sqes != NULL)
+		munmap(u->sqes, u->sqesSize);
+	if (u->cqRing != NULL && u->cqRing != u->sqRing)
+		munmap(u->cqRing, u->cqRingSize);
+	if (u->sqRing != NULL)
+		munmap(u->sqRing, u->sqRingSize);
+	if (u->fd >= 0)
+		close(u->fd);
+
+	buffer_cleanup(&u->sending);
+	buffer_cleanup(&u->queued);
+	free(u->chunks);
+	free(u->bufs);
+	free(u);
+}
+
+void redis_uring_free(struct RedisHandle *h) {
+	struct RedisUring *u = h->uring;
+	unsigned int tries;
+
+	if (u == NULL)
+		return;
+
+	if (!h->failed)
+		redis_uring_flush(h);
+
+	/* The receive must be finished with the buffers before they are freed */
+	if (u->armed) {
+		struct io_uring_sqe *sqe = uring_sqe(u);
+
+		sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+		sqe->addr      = URING_RECV;
+		sqe->user_data = URING_CANCEL;
+
+		for (tries = 0; tries < 8 && u->armed; tries++) {
+			if (uring_enter(h, 1))
+				break;
+			u->closed = 1;
+			uring_reap(h);
+		}
+	}
+
+	uring_destroy(u);
+	h->uring = NULL;
+}
+
+/**
+ * @internal
+ * Checks the kernel supports everything we need. Multishot receives arrived in the
+ * same release as IORING_OP_SEND_ZC, so that stands in for them.
+ * @return 1 if it does, otherwise 0.
+ */
+static int uring_supported(int fd) {
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	int ok;
+
+	if (probe == NULL)
+		return 0;
+
+	ok = uring_register(fd, IORING_REGISTER_PROBE, probe, 256) == 0
+	  && probe->ops_len > IORING_OP_SEND_ZC
+	  && (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED)
+	  && (probe->ops[IORING_OP_RECV].flags & IO_URING_OP_SUPPORTED)
+	  && (probe->ops[IORING_OP_SEND].flags & IO_URING_OP_SUPPORTED);
+
+	free(probe);
+	return ok;
+}
+
+/**
+ * @internal
+ * Maps the submission and completion rings into memory.
+ * @return 0 on success, -1 on failure.
+ */
+static int uring_map(struct RedisUring *u, const struct io_uring_params *p) {
+	char *sq, *cq;
+
+	u->sqRingSize = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	u->cqRingSize = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cqRingSize > u->sqRingSize)
+			u->sqRingSize = u->cqRingSize;
+		u->cqRingSize = u->sqRingSize;
+	}
+
+	u->sqRing = mmap(NULL, u->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->sqRing == MAP_FAILED) {
+		u->sqRing = NULL;
+		return -1;
+	}
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		u->cqRing = u->sqRing;
+	} else {
+		u->cqRing = mmap(NULL, u->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+		if (u->cqRing == MAP_FAILED) {
+			u->cqRing = NULL;
+			return -1;
+		}
+	}
+
+	u->sqesSize = p->sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		return -1;
+	}
+
+	sq = u->sqRing;
+	cq = u->cqRing;
+	u->sqTail  = (unsigned int *)(sq + p->sq_off.tail);
+	u->sqMask  = (unsigned int *)(sq + p->sq_off.ring_mask);
+	u->sqArray = (unsigned int *)(sq + p->sq_off.array);
+	u->cqHead  = (unsigned int *)(cq + p->cq_off.head);
+	u->cqTail  = (unsigned int *)(cq + p->cq_off.tail);
+	u->cqMask  = (unsigned int *)(cq + p->cq_off.ring_mask);
+	u->cqes    = (struct io_uring_cqe *)(cq + p->cq_off.cqes);
+
+	return 0;
+}
+
+/**
+ * @internal
+ * Allocates the receive buffers and registers them with the kernel.
+ * @return 0 on success, -1 on failure.
+ */
+static int uring_register_buffers(struct RedisUring *u) {
+	struct io_uring_buf_reg reg;
+	unsigned int i;
+
+	u->bufs   = malloc((size_t)u->bufCount * URING_BUFFER_SIZE);
+	u->chunks = malloc((u->bufCount + 1) * sizeof(struct UringChunk));
+	if (u->bufs == NULL || u->chunks == NULL)
+		return -1;
+
+	/* The ring has to be page aligned */
+	u->bufRingSize = u->bufCount * sizeof(struct io_uring_buf);
+	u->bufRing = mmap(NULL, u->bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (u->bufRing == MAP_FAILED) {
+		u->bufRing = NULL;
+		return -1;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr    = (uint64_t)(uintptr_t)u->bufRing;
+	reg.ring_entries = u->bufCount;
+	reg.bgid         = URING_BUFFER_GROUP;
+
+	if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return -1;
+
+	for (i = 0; i < u->bufCount; i++)
+		uring_recycle(u, i);
+
+	return 0;
+}
+
+int redis_use_uring(struct RedisHandle *h, unsigned int buffers) {
+	struct io_uring_params p;
+	struct RedisUring *u;
+	unsigned int count = 1;
+
+	assert(h != NULL);
+
+	if (h->socket == INVALID_SOCKET) {
+		h->lastErr = "Invalid socket";
+		return -1;
+	}
+
+	/* Pipelining is fine either side of this, as queued commands never refer to
+	 * the caller's memory and are flushed through #redis_uring_send */
+	if (h->nonblocking || h->loop != NULL) {
+		h->lastErr = "Error io_uring needs a blocking handle";
+		return -1;
+	}
+
+	if (h->uring != NULL)
+		return 0;
+
+	if (buffers == 0)
+		buffers = URING_BUFFERS;
+	if (buffers > URING_BUFFER_MAX)
+		buffers = URING_BUFFER_MAX;
+	while (count < buffers)
+		count *= 2;
+
+	u = calloc(1, sizeof(struct RedisUring));
+	if (u == NULL) {
+		h->lastErr = "Error allocating a RedisUring struct";
+		return -1;
+	}
+
+	u->fd       = -1;
+	u->bufCount = count;
+
+	if (buffer_init(&u->sending, INITIAL_SEND_LENGTH) == NULL || buffer_init(&u->queued, INITIAL_SEND_LENGTH) == NULL) {
+		h->lastErr = "Error allocating send buffer";
+		uring_destroy(u);
+		return -1;
+	}
+
+	/* Every receive buffer may be waiting to be copied out, so the completion
+	 * queue (twice the size of this) needs room for them all */
+	memset(&p, 0, sizeof(p));
+	u->fd = uring_setup(count < 8 ? 8 : count, &p);
+	if (u->fd < 0) {
+		h->lastErr = "Error io_uring is not available";
+		uring_destroy(u);
+		return -1;
+	}
+
+	if (!uring_supported(u->fd)) {
+		h->lastErr = "Error io_uring does not support multishot receives";
+		uring_destroy(u);
+		return -1;
+	}
+
+	if (uring_map(u, &p) || uring_register_buffers(u)) {
+		h->lastErr = "Error setting up io_uring";
+		uring_destroy(u);
+		return -1;
+	}
+
+	/* Large values can't be written from the caller's memory, as writes complete later */
+	h->sendRefCount = 0;
+	h->uring = u;
+
+	uring_arm(h);
+	if (uring_enter(h, 0)) {
+		h->uring = NULL;
+		h->failed = 0;
+		h->lastErr = "Error io_uring is not available";
+		uring_destroy(u);
+		return -1;
+	}
+
+	return 0;
+}